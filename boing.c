@@ -17,6 +17,11 @@
  *            time based animation steps (which results in much smoother
  *            movement)
  *
+ *          - The ball and the grid are built once into a vertex and an
+ *            index buffer and drawn with shaders on OpenGL 3.2 core profile
+ *            contexts. Immediate mode is only used when no such context can
+ *            be created.
+ *
  * History of Amiga Boing:
  *
  * Boing was demonstrated on the prototype Amiga (codenamed "Lorraine") in
@@ -34,11 +39,14 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <math.h>
 
+#define GLFW_INCLUDE_GLEXT
 #include <GLFW/glfw3.h>
 
 #include <linmath.h>
+#include <meshbuilder.h>
 
 
 /*****************************************************************************
@@ -56,6 +64,10 @@ void DrawBoingBall( void );
 void BounceBall( double dt );
 void DrawBoingBallBand( GLfloat long_lo, GLfloat long_hi );
 void DrawGrid( void );
+int  InitMesh( void );
+void BuildBoingBall( mesh_builder* m );
+void BuildGrid( mesh_builder* m );
+void DrawMesh( mat4x4 model, GLint first, GLsizei count, GLfloat shadow );
 
 #define RADIUS           70.f
 #define STEP_LONGITUDE   22.5f                   /* 22.5 makes 8 bands like original Boing */
@@ -103,6 +115,77 @@ double  t;
 double  t_old = 0.f;
 double  dt;
 
+/* Set when the context lacks the fixed function pipeline */
+GLboolean core_profile = GL_FALSE;
+
+/* The ball and the grid as a single mesh, drawn with shaders */
+struct {
+   GLuint program;
+   GLuint vertex_array;
+   GLuint buffers[2];
+   GLint  mvp_location;
+   GLint  shadow_location;
+   GLint  ball_first, ball_count;   /* Index ranges of the objects */
+   GLint  grid_first, grid_count;
+   mat4x4 projection, view;
+} mesh;
+
+/*****************************************************************************
+ * OpenGL functions for the mesh, loaded at run-time.
+ *****************************************************************************/
+static PFNGLCREATESHADERPROC glCreateShader;
+static PFNGLSHADERSOURCEPROC glShaderSource;
+static PFNGLCOMPILESHADERPROC glCompileShader;
+static PFNGLGETSHADERIVPROC glGetShaderiv;
+static PFNGLGETSHADERINFOLOGPROC glGetShaderInfoLog;
+static PFNGLCREATEPROGRAMPROC glCreateProgram;
+static PFNGLATTACHSHADERPROC glAttachShader;
+static PFNGLBINDATTRIBLOCATIONPROC glBindAttribLocation;
+static PFNGLLINKPROGRAMPROC glLinkProgram;
+static PFNGLGETPROGRAMIVPROC glGetProgramiv;
+static PFNGLGETPROGRAMINFOLOGPROC glGetProgramInfoLog;
+static PFNGLUSEPROGRAMPROC glUseProgram;
+static PFNGLGETUNIFORMLOCATIONPROC glGetUniformLocation;
+static PFNGLUNIFORMMATRIX4FVPROC glUniformMatrix4fv;
+static PFNGLUNIFORM1FPROC glUniform1f;
+static PFNGLGENBUFFERSPROC glGenBuffers;
+static PFNGLBINDBUFFERPROC glBindBuffer;
+static PFNGLBUFFERDATAPROC glBufferData;
+static PFNGLGENVERTEXARRAYSPROC glGenVertexArrays;
+static PFNGLBINDVERTEXARRAYPROC glBindVertexArray;
+static PFNGLENABLEVERTEXATTRIBARRAYPROC glEnableVertexAttribArray;
+static PFNGLVERTEXATTRIBPOINTERPROC glVertexAttribPointer;
+
+#define LOAD_GL_FUNCTION(type, name) \
+   if (!(name = (type) glfwGetProcAddress(#name))) return GL_FALSE
+
+static int LoadMeshFunctions( void )
+{
+   LOAD_GL_FUNCTION(PFNGLCREATESHADERPROC, glCreateShader);
+   LOAD_GL_FUNCTION(PFNGLSHADERSOURCEPROC, glShaderSource);
+   LOAD_GL_FUNCTION(PFNGLCOMPILESHADERPROC, glCompileShader);
+   LOAD_GL_FUNCTION(PFNGLGETSHADERIVPROC, glGetShaderiv);
+   LOAD_GL_FUNCTION(PFNGLGETSHADERINFOLOGPROC, glGetShaderInfoLog);
+   LOAD_GL_FUNCTION(PFNGLCREATEPROGRAMPROC, glCreateProgram);
+   LOAD_GL_FUNCTION(PFNGLATTACHSHADERPROC, glAttachShader);
+   LOAD_GL_FUNCTION(PFNGLBINDATTRIBLOCATIONPROC, glBindAttribLocation);
+   LOAD_GL_FUNCTION(PFNGLLINKPROGRAMPROC, glLinkProgram);
+   LOAD_GL_FUNCTION(PFNGLGETPROGRAMIVPROC, glGetProgramiv);
+   LOAD_GL_FUNCTION(PFNGLGETPROGRAMINFOLOGPROC, glGetProgramInfoLog);
+   LOAD_GL_FUNCTION(PFNGLUSEPROGRAMPROC, glUseProgram);
+   LOAD_GL_FUNCTION(PFNGLGETUNIFORMLOCATIONPROC, glGetUniformLocation);
+   LOAD_GL_FUNCTION(PFNGLUNIFORMMATRIX4FVPROC, glUniformMatrix4fv);
+   LOAD_GL_FUNCTION(PFNGLUNIFORM1FPROC, glUniform1f);
+   LOAD_GL_FUNCTION(PFNGLGENBUFFERSPROC, glGenBuffers);
+   LOAD_GL_FUNCTION(PFNGLBINDBUFFERPROC, glBindBuffer);
+   LOAD_GL_FUNCTION(PFNGLBUFFERDATAPROC, glBufferData);
+   LOAD_GL_FUNCTION(PFNGLGENVERTEXARRAYSPROC, glGenVertexArrays);
+   LOAD_GL_FUNCTION(PFNGLBINDVERTEXARRAYPROC, glBindVertexArray);
+   LOAD_GL_FUNCTION(PFNGLENABLEVERTEXATTRIBARRAYPROC, glEnableVertexAttribArray);
+   LOAD_GL_FUNCTION(PFNGLVERTEXATTRIBPOINTERPROC, glVertexAttribPointer);
+   return GL_TRUE;
+}
+
 /* Random number generator */
 #ifndef RAND_MAX
  #define RAND_MAX 4095
@@ -182,7 +265,8 @@ void init( void )
     */
    glClearColor( 0.55f, 0.55f, 0.55f, 0.f );
 
-   glShadeModel( GL_FLAT );
+   if ( !core_profile )
+      glShadeModel( GL_FLAT );
 }
 
 
@@ -192,7 +276,14 @@ void init( void )
 void display(void)
 {
    glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
-   glPushMatrix();
+
+   if ( mesh.program )
+   {
+      glUseProgram( mesh.program );
+      glBindVertexArray( mesh.vertex_array );
+   }
+   else
+      glPushMatrix();
 
    drawBallHow = DRAW_BALL_SHADOW;
    DrawBoingBall();
@@ -202,7 +293,9 @@ void display(void)
    drawBallHow = DRAW_BALL;
    DrawBoingBall();
 
-   glPopMatrix();
+   if ( !mesh.program )
+      glPopMatrix();
+
    glFlush();
 }
 
@@ -216,20 +309,26 @@ void reshape( GLFWwindow* window, int w, int h )
 
    glViewport( 0, 0, (GLsizei)w, (GLsizei)h );
 
-   glMatrixMode( GL_PROJECTION );
    mat4x4_perspective( projection,
                        2.f * (float) atan2( RADIUS, 200.f ),
                        (float)w / (float)h,
                        1.f, VIEW_SCENE_DIST );
-   glLoadMatrixf((const GLfloat*) projection);
-
-   glMatrixMode( GL_MODELVIEW );
    {
       vec3 eye = { 0.f, 0.f, VIEW_SCENE_DIST };
       vec3 center = { 0.f, 0.f, 0.f };
       vec3 up = { 0.f, -1.f, 0.f };
       mat4x4_look_at( view, eye, center, up );
    }
+
+   mat4x4_dup( mesh.projection, projection );
+   mat4x4_dup( mesh.view, view );
+   if ( core_profile )
+      return;
+
+   glMatrixMode( GL_PROJECTION );
+   glLoadMatrixf((const GLfloat*) projection);
+
+   glMatrixMode( GL_MODELVIEW );
    glLoadMatrixf((const GLfloat*) view);
 }
 
@@ -283,14 +382,6 @@ void DrawBoingBall( void )
    GLfloat lon_deg;     /* degree of longitude */
    double dt_total, dt2;
 
-   glPushMatrix();
-   glMatrixMode( GL_MODELVIEW );
-
-  /*
-   * Another relative Z translation to separate objects.
-   */
-   glTranslatef( 0.0, 0.0, DIST_BALL );
-
    /* Update ball position and rotation (iterate if necessary) */
    dt_total = dt;
    while( dt_total > 0.0 )
@@ -301,6 +392,37 @@ void DrawBoingBall( void )
        deg_rot_y = TruncateDeg( deg_rot_y + deg_rot_y_inc*((float)dt2*ANIMATION_SPEED) );
    }
 
+  /*
+   * The mesh only needs the transforms below.
+   */
+   if ( mesh.program )
+   {
+      mat4x4 model;
+
+      mat4x4_translate( model, ball_x, ball_y, DIST_BALL );
+      if ( drawBallHow == DRAW_BALL_SHADOW )
+      {
+         mat4x4_translate_in_place( model, SHADOW_OFFSET_X,
+                                           SHADOW_OFFSET_Y,
+                                           SHADOW_OFFSET_Z );
+      }
+      mat4x4_rotate( model, model, 0.f, 0.f, 1.f, (float) deg2rad( -20.0 ) );
+      mat4x4_rotate( model, model, 0.f, 1.f, 0.f, (float) deg2rad( deg_rot_y ) );
+
+      glEnable( GL_CULL_FACE );
+      DrawMesh( model, mesh.ball_first, mesh.ball_count,
+                drawBallHow == DRAW_BALL_SHADOW ? 1.f : 0.f );
+      return;
+   }
+
+   glPushMatrix();
+   glMatrixMode( GL_MODELVIEW );
+
+  /*
+   * Another relative Z translation to separate objects.
+   */
+   glTranslatef( 0.0, 0.0, DIST_BALL );
+
    /* Set ball position */
    glTranslatef( ball_x, ball_y, 0.0 );
 
@@ -523,6 +645,16 @@ void DrawGrid( void )
    GLfloat          xl, xr;
    GLfloat          yt, yb;
 
+   if ( mesh.program )
+   {
+      mat4x4 model;
+
+      glDisable( GL_CULL_FACE );
+      mat4x4_translate( model, 0.f, 0.f, DIST_BALL );
+      DrawMesh( model, mesh.grid_first, mesh.grid_count, 0.f );
+      return;
+   }
+
    glPushMatrix();
    glDisable( GL_CULL_FACE );
 
@@ -589,6 +721,261 @@ void DrawGrid( void )
 }
 
 
+/* Facets are unlit, the shadow is the ball in a single color */
+static const char* mesh_vertex_shader_text =
+"#version 150\n"
+"uniform mat4 mvp;\n"
+"uniform float shadow;\n"
+"in vec3 position;\n"
+"in vec3 color;\n"
+"out vec3 facet_color;\n"
+"void main()\n"
+"{\n"
+"    facet_color = mix(color, vec3(0.35), shadow);\n"
+"    gl_Position = mvp * vec4(position, 1.0);\n"
+"}\n";
+
+static const char* mesh_fragment_shader_text =
+"#version 150\n"
+"in vec3 facet_color;\n"
+"out vec4 fragment;\n"
+"void main()\n"
+"{\n"
+"    fragment = vec4(facet_color, 1.0);\n"
+"}\n";
+
+static GLuint CompileShader( GLenum type, const char* text )
+{
+   GLint status;
+   GLchar log[1024];
+   GLuint shader = glCreateShader( type );
+
+   glShaderSource( shader, 1, &text, NULL );
+   glCompileShader( shader );
+
+   glGetShaderiv( shader, GL_COMPILE_STATUS, &status );
+   if ( status != GL_TRUE )
+   {
+      glGetShaderInfoLog( shader, sizeof(log), NULL, log );
+      fprintf( stderr, "Failed to compile Boing shader:\n%s\n", log );
+      return 0;
+   }
+
+   return shader;
+}
+
+
+/*****************************************************************************
+ * Build the ball and the grid once and upload them.
+ * Returns GL_FALSE on failure.
+ *****************************************************************************/
+int InitMesh( void )
+{
+   GLuint vertex_shader, fragment_shader;
+   GLint status;
+   GLchar log[1024];
+   mesh_builder m;
+
+   if ( !LoadMeshFunctions() )
+      return GL_FALSE;
+
+   vertex_shader = CompileShader( GL_VERTEX_SHADER, mesh_vertex_shader_text );
+   fragment_shader = CompileShader( GL_FRAGMENT_SHADER, mesh_fragment_shader_text );
+   if ( !vertex_shader || !fragment_shader )
+      return GL_FALSE;
+
+   mesh.program = glCreateProgram();
+   glAttachShader( mesh.program, vertex_shader );
+   glAttachShader( mesh.program, fragment_shader );
+   glBindAttribLocation( mesh.program, 0, "position" );
+   glBindAttribLocation( mesh.program, 1, "color" );
+   glLinkProgram( mesh.program );
+
+   glGetProgramiv( mesh.program, GL_LINK_STATUS, &status );
+   if ( status != GL_TRUE )
+   {
+      glGetProgramInfoLog( mesh.program, sizeof(log), NULL, log );
+      fprintf( stderr, "Failed to link Boing program:\n%s\n", log );
+      mesh.program = 0;
+      return GL_FALSE;
+   }
+
+   mesh.mvp_location = glGetUniformLocation( mesh.program, "mvp" );
+   mesh.shadow_location = glGetUniformLocation( mesh.program, "shadow" );
+
+   mesh_init( &m );
+
+   mesh.ball_first = mesh_index_count( &m );
+   BuildBoingBall( &m );
+   mesh.ball_count = mesh_index_count( &m ) - mesh.ball_first;
+
+   mesh.grid_first = mesh_index_count( &m );
+   BuildGrid( &m );
+   mesh.grid_count = mesh_index_count( &m ) - mesh.grid_first;
+
+   if ( m.failed )
+   {
+      mesh_free( &m );
+      mesh.program = 0;
+      return GL_FALSE;
+   }
+
+   glGenVertexArrays( 1, &mesh.vertex_array );
+   glBindVertexArray( mesh.vertex_array );
+
+   glGenBuffers( 2, mesh.buffers );
+   glBindBuffer( GL_ARRAY_BUFFER, mesh.buffers[0] );
+   glBufferData( GL_ARRAY_BUFFER, m.vertex_count * sizeof(mesh_vertex),
+                 m.vertices, GL_STATIC_DRAW );
+   glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, mesh.buffers[1] );
+   glBufferData( GL_ELEMENT_ARRAY_BUFFER, m.index_count * sizeof(uint32_t),
+                 m.indices, GL_STATIC_DRAW );
+
+   glEnableVertexAttribArray( 0 );
+   glVertexAttribPointer( 0, 3, GL_FLOAT, GL_FALSE, sizeof(mesh_vertex),
+                          (void*) offsetof(mesh_vertex, position) );
+   glEnableVertexAttribArray( 1 );
+   glVertexAttribPointer( 1, 3, GL_FLOAT, GL_FALSE, sizeof(mesh_vertex),
+                          (void*) offsetof(mesh_vertex, color) );
+
+   mesh_free( &m );
+
+   glCullFace( GL_FRONT );
+   return GL_TRUE;
+}
+
+
+/*****************************************************************************
+ * Add the facets of the Boing ball to a mesh.
+ *
+ * These are the facets of DrawBoingBallBand, with the same colors. The
+ * normal of a facet points from the center of the ball through the center
+ * of the facet.
+ *****************************************************************************/
+void BuildBoingBall( mesh_builder* m )
+{
+   GLfloat  vert_ne[3];
+   GLfloat  vert_nw[3];
+   GLfloat  vert_sw[3];
+   GLfloat  vert_se[3];
+   GLfloat  center[3];
+   GLfloat  lon_deg, lat_deg, length;
+   int      colorToggle = 0;
+   int      i;
+
+   for ( lon_deg = 0;
+         lon_deg < 180;
+         lon_deg += STEP_LONGITUDE )
+   {
+      for ( lat_deg = 0;
+            lat_deg <= (360 - STEP_LATITUDE);
+            lat_deg += STEP_LATITUDE )
+      {
+         if ( colorToggle )
+            mesh_color( m, 0.8f, 0.1f, 0.1f );
+         else
+            mesh_color( m, 0.95f, 0.95f, 0.95f );
+         colorToggle = ! colorToggle;
+
+         vert_ne[1] = vert_nw[1] = (float) cos_deg( lon_deg + STEP_LONGITUDE ) * RADIUS;
+         vert_sw[1] = vert_se[1] = (float) cos_deg( lon_deg                  ) * RADIUS;
+
+         vert_ne[0] = (float) cos_deg( lat_deg                 ) * (RADIUS * (float) sin_deg( lon_deg + STEP_LONGITUDE ));
+         vert_se[0] = (float) cos_deg( lat_deg                 ) * (RADIUS * (float) sin_deg( lon_deg                  ));
+         vert_nw[0] = (float) cos_deg( lat_deg + STEP_LATITUDE ) * (RADIUS * (float) sin_deg( lon_deg + STEP_LONGITUDE ));
+         vert_sw[0] = (float) cos_deg( lat_deg + STEP_LATITUDE ) * (RADIUS * (float) sin_deg( lon_deg                  ));
+
+         vert_ne[2] = (float) sin_deg( lat_deg                 ) * (RADIUS * (float) sin_deg( lon_deg + STEP_LONGITUDE ));
+         vert_se[2] = (float) sin_deg( lat_deg                 ) * (RADIUS * (float) sin_deg( lon_deg                  ));
+         vert_nw[2] = (float) sin_deg( lat_deg + STEP_LATITUDE ) * (RADIUS * (float) sin_deg( lon_deg + STEP_LONGITUDE ));
+         vert_sw[2] = (float) sin_deg( lat_deg + STEP_LATITUDE ) * (RADIUS * (float) sin_deg( lon_deg                  ));
+
+         for ( i = 0; i < 3; i++ )
+            center[i] = vert_ne[i] + vert_nw[i] + vert_sw[i] + vert_se[i];
+
+         length = (float) sqrt( center[0] * center[0] +
+                                center[1] * center[1] +
+                                center[2] * center[2] );
+         mesh_normal( m, center[0] / length, center[1] / length, center[2] / length );
+
+         mesh_flat_quad( m, vert_ne, vert_nw, vert_sw, vert_se );
+      }
+
+      colorToggle = ! colorToggle;
+   }
+}
+
+
+/*****************************************************************************
+ * Add the rectangles of the grid of DrawGrid to a mesh.
+ *****************************************************************************/
+static void AddGridRectangle( mesh_builder* m, GLfloat xl, GLfloat xr,
+                              GLfloat yt, GLfloat yb, GLfloat z )
+{
+   const GLfloat ne[3] = { xr, yt, z };
+   const GLfloat nw[3] = { xl, yt, z };
+   const GLfloat sw[3] = { xl, yb, z };
+   const GLfloat se[3] = { xr, yb, z };
+
+   mesh_flat_quad( m, ne, nw, sw, se );
+}
+
+void BuildGrid( mesh_builder* m )
+{
+   int              row, col;
+   const int        rowTotal    = 12;                   /* must be divisible by 2 */
+   const int        colTotal    = rowTotal;             /* must be same as rowTotal */
+   const GLfloat    widthLine   = 2.0;                  /* should be divisible by 2 */
+   const GLfloat    sizeCell    = GRID_SIZE / rowTotal;
+   const GLfloat    z_offset    = -40.0;
+   GLfloat          xl, xr;
+   GLfloat          yt, yb;
+
+   mesh_color( m, 0.6f, 0.1f, 0.6f );               /* purple */
+   mesh_normal( m, 0.f, 0.f, 1.f );
+
+   for ( col = 0; col <= colTotal; col++ )
+   {
+      xl = -GRID_SIZE / 2 + col * sizeCell;
+      xr = xl + widthLine;
+
+      yt =  GRID_SIZE / 2;
+      yb = -GRID_SIZE / 2 - widthLine;
+
+      AddGridRectangle( m, xl, xr, yt, yb, z_offset );
+   }
+
+   for ( row = 0; row <= rowTotal; row++ )
+   {
+      yt = GRID_SIZE / 2 - row * sizeCell;
+      yb = yt - widthLine;
+
+      xl = -GRID_SIZE / 2;
+      xr =  GRID_SIZE / 2 + widthLine;
+
+      AddGridRectangle( m, xl, xr, yt, yb, z_offset );
+   }
+}
+
+
+/*****************************************************************************
+ * Draw a range of the mesh. Per frame, only the matrix and the shadow flag
+ * change.
+ *****************************************************************************/
+void DrawMesh( mat4x4 model, GLint first, GLsizei count, GLfloat shadow )
+{
+   mat4x4 modelview, mvp;
+
+   mat4x4_mul( modelview, mesh.view, model );
+   mat4x4_mul( mvp, mesh.projection, modelview );
+
+   glUniformMatrix4fv( mesh.mvp_location, 1, GL_FALSE, (const GLfloat*) mvp );
+   glUniform1f( mesh.shadow_location, shadow );
+   glDrawElements( GL_TRIANGLES, count, GL_UNSIGNED_INT,
+                   (void*) (first * sizeof(uint32_t)) );
+}
+
+
 /*======================================================================*
  * main()
  *======================================================================*/
@@ -602,8 +989,34 @@ int main( void )
       exit( EXIT_FAILURE );
 
    glfwWindowHint(GLFW_DEPTH_BITS, 16);
+   glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+   glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 2);
+   glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+   glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
    window = glfwCreateWindow( 400, 400, "Boing (classic Amiga demo)", NULL, NULL );
+   if (window)
+   {
+      glfwMakeContextCurrent(window);
+
+      core_profile = InitMesh();
+      if (!core_profile)
+      {
+         fprintf( stderr, "Failed to create the Boing mesh, using immediate mode\n" );
+         glfwDestroyWindow(window);
+         window = NULL;
+      }
+   }
+
+   if (!window)
+   {
+      /* Fall back to immediate mode on older OpenGL versions */
+      glfwDefaultWindowHints();
+      glfwWindowHint(GLFW_DEPTH_BITS, 16);
+
+      window = glfwCreateWindow( 400, 400, "Boing (classic Amiga demo)", NULL, NULL );
+   }
+
    if (!window)
    {
        glfwTerminate();
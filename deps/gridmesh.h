@@ -0,0 +1,184 @@
+#ifndef GRIDMESH_H
+#define GRIDMESH_H
+
+/*
+ * Index buffers for regular grids of vertices.
+ *
+ * The vertex of column x and row y of a grid of width x height vertices is
+ * vertex y * width + x. The quads of the grid are drawn as triangle strips,
+ * one per row of quads, with every quad split along its diagonal from
+ * vertex (x, y) to vertex (x + 1, y + 1).
+ *
+ * Wide grids are cut into bands of GRID_BAND_WIDTH quads and the strips are
+ * ordered band by band. The vertices a strip shares with the strip of the
+ * previous row are then still in the post-transform cache when they are
+ * reused, so most vertices are only transformed once instead of twice.
+ *
+ * The strips are either separated by the restart index, which is the largest
+ * value of the index type (as with GL_PRIMITIVE_RESTART_FIXED_INDEX), or
+ * joined by degenerate triangles for contexts without primitive restart.
+ */
+
+#include <stdint.h>
+
+#ifdef _MSC_VER
+#define inline __inline
+#endif
+
+/* Quads per strip. The two rows of vertices of a strip need to fit in the
+ * post-transform cache, which has 32 entries or more on most GPUs */
+#ifndef GRID_BAND_WIDTH
+#define GRID_BAND_WIDTH 14
+#endif
+
+/* Size in bytes of the indices of the specified grid, which is two if all
+ * of its vertices and the restart index fit in 16 bits */
+static inline int grid_index_size(int width, int height)
+{
+    return (int64_t) width * height < 0xffff ? 2 : 4;
+}
+
+/* The restart index for the specified index size */
+static inline uint32_t grid_restart_index(int index_size)
+{
+    return index_size == 2 ? 0xffffu : 0xffffffffu;
+}
+
+/* Number of indices of the strips of the specified grid */
+static inline int grid_strip_index_count(int width, int height, int restart)
+{
+    const int bands = (width - 2) / GRID_BAND_WIDTH + 1;
+    const int strips = bands * (height - 1);
+
+    if (width < 2 || height < 2)
+        return 0;
+
+    /* Every band has one more column of vertices than it has quads */
+    return 2 * (height - 1) * (width - 1 + bands) +
+           (strips - 1) * (restart ? 1 : 2);
+}
+
+static inline void grid_store_index(void* out, int index_size, int i, uint32_t value)
+{
+    if (index_size == 2)
+        ((uint16_t*) out)[i] = (uint16_t) value;
+    else
+        ((uint32_t*) out)[i] = value;
+}
+
+/* Write the strips of the specified grid, with grid_strip_index_count
+ * indices of index_size bytes, and return the number of indices written */
+static inline int grid_strip_indices(void* out, int index_size,
+                                     int width, int height, int restart)
+{
+    int first, last, x, y, i = 0;
+
+    if (width < 2 || height < 2)
+        return 0;
+
+    for (first = 0;  first < width - 1;  first += GRID_BAND_WIDTH)
+    {
+        last = first + GRID_BAND_WIDTH < width - 1 ? first + GRID_BAND_WIDTH : width - 1;
+
+        for (y = 0;  y < height - 1;  y++)
+        {
+            /* Separate this strip from the previous one */
+            if (i > 0)
+            {
+                if (restart)
+                    grid_store_index(out, index_size, i++, grid_restart_index(index_size));
+                else
+                {
+                    grid_store_index(out, index_size, i, index_size == 2 ?
+                                     ((uint16_t*) out)[i - 1] : ((uint32_t*) out)[i - 1]);
+                    i++;
+                    grid_store_index(out, index_size, i++,
+                                     (uint32_t) ((y + 1) * width + first));
+                }
+            }
+
+            for (x = first;  x <= last;  x++)
+            {
+                grid_store_index(out, index_size, i++, (uint32_t) ((y + 1) * width + x));
+                grid_store_index(out, index_size, i++, (uint32_t) (y * width + x));
+            }
+        }
+    }
+
+    return i;
+}
+
+/*
+ * The edges of the triangles of the grid as line strips, one per row, one
+ * per column and one per diagonal, separated by the restart index. Every
+ * edge is drawn once, with about half the indices of a list of lines.
+ */
+
+/* Number of vertices of diagonal d, starting from the bottom right corner
+ * and moving left, then up */
+static inline int grid_diagonal_length(int width, int height, int d)
+{
+    const int x = d < width - 1 ? width - 2 - d : 0;
+    const int y = d < width - 1 ? 0 : d - (width - 2);
+    return width - x < height - y ? width - x : height - y;
+}
+
+/* Number of indices of the line strips of the specified grid */
+static inline int grid_line_index_count(int width, int height)
+{
+    const int diagonals = width + height - 3;
+    int d, count;
+
+    if (width < 2 || height < 2)
+        return 0;
+
+    count = 2 * width * height + (height + width + diagonals - 1);
+    for (d = 0;  d < diagonals;  d++)
+        count += grid_diagonal_length(width, height, d);
+
+    return count;
+}
+
+/* Write the line strips of the specified grid, with grid_line_index_count
+ * indices of index_size bytes, and return the number of indices written */
+static inline int grid_line_indices(void* out, int index_size, int width, int height)
+{
+    const uint32_t restart = grid_restart_index(index_size);
+    int d, k, x, y, length, i = 0;
+
+    if (width < 2 || height < 2)
+        return 0;
+
+    for (y = 0;  y < height;  y++)
+    {
+        if (i > 0)
+            grid_store_index(out, index_size, i++, restart);
+
+        for (x = 0;  x < width;  x++)
+            grid_store_index(out, index_size, i++, (uint32_t) (y * width + x));
+    }
+
+    for (x = 0;  x < width;  x++)
+    {
+        grid_store_index(out, index_size, i++, restart);
+
+        for (y = 0;  y < height;  y++)
+            grid_store_index(out, index_size, i++, (uint32_t) (y * width + x));
+    }
+
+    for (d = 0;  d < width + height - 3;  d++)
+    {
+        x = d < width - 1 ? width - 2 - d : 0;
+        y = d < width - 1 ? 0 : d - (width - 2);
+        length = grid_diagonal_length(width, height, d);
+
+        grid_store_index(out, index_size, i++, restart);
+
+        for (k = 0;  k < length;  k++)
+            grid_store_index(out, index_size, i++, (uint32_t) ((y + k) * width + x + k));
+    }
+
+    return i;
+}
+
+#endif /* GRIDMESH_H */
@@ -0,0 +1,204 @@
+#ifndef MESHBUILDER_H
+#define MESHBUILDER_H
+
+/*
+ * Static indexed meshes, built once on the CPU and uploaded as one vertex
+ * buffer and one index buffer.
+ *
+ * The builder keeps a current normal and color like immediate mode, so code
+ * written for glBegin/glEnd ports over call for call, but every vertex is
+ * generated only once instead of every frame. Flat shaded faces get their
+ * own vertices carrying the face normal, while smooth surfaces share their
+ * vertices between faces.
+ *
+ * Triangles keep the winding of the polygons they replace, so face culling
+ * works as before. Several objects can share a mesh and be drawn as index
+ * ranges, see mesh_index_count.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _MSC_VER
+#define inline __inline
+#endif
+
+typedef struct
+{
+    float position[3];
+    float normal[3];
+    float color[3];
+} mesh_vertex;
+
+typedef struct
+{
+    mesh_vertex* vertices;
+    int          vertex_count;
+    int          vertex_capacity;
+    uint32_t*    indices;
+    int          index_count;
+    int          index_capacity;
+    float        normal[3];    /* Normal of the next vertices */
+    float        color[3];     /* Color of the next vertices */
+    int          failed;       /* Set when an allocation failed */
+} mesh_builder;
+
+static inline void mesh_init(mesh_builder* m)
+{
+    memset(m, 0, sizeof(mesh_builder));
+    m->normal[2] = 1.f;
+    m->color[0] = m->color[1] = m->color[2] = 1.f;
+}
+
+static inline void mesh_free(mesh_builder* m)
+{
+    free(m->vertices);
+    free(m->indices);
+    mesh_init(m);
+}
+
+/* Grow an array to hold at least count elements of the specified size */
+static inline int mesh_reserve(void** array, int* capacity, int count, size_t size)
+{
+    void* grown;
+    int new_capacity = *capacity ? *capacity : 64;
+
+    if (count <= *capacity)
+        return 1;
+
+    while (new_capacity < count)
+        new_capacity *= 2;
+
+    grown = realloc(*array, new_capacity * size);
+    if (!grown)
+        return 0;
+
+    *array = grown;
+    *capacity = new_capacity;
+    return 1;
+}
+
+static inline void mesh_normal(mesh_builder* m, float x, float y, float z)
+{
+    m->normal[0] = x;
+    m->normal[1] = y;
+    m->normal[2] = z;
+}
+
+static inline void mesh_color(mesh_builder* m, float r, float g, float b)
+{
+    m->color[0] = r;
+    m->color[1] = g;
+    m->color[2] = b;
+}
+
+/* Add a vertex with the current normal and color and return its index */
+static inline uint32_t mesh_vertex3f(mesh_builder* m, float x, float y, float z)
+{
+    mesh_vertex* v;
+
+    if (!mesh_reserve((void**) &m->vertices, &m->vertex_capacity,
+                      m->vertex_count + 1, sizeof(mesh_vertex)))
+    {
+        m->failed = 1;
+        return 0;
+    }
+
+    v = m->vertices + m->vertex_count;
+    v->position[0] = x;
+    v->position[1] = y;
+    v->position[2] = z;
+    memcpy(v->normal, m->normal, sizeof(v->normal));
+    memcpy(v->color, m->color, sizeof(v->color));
+
+    return (uint32_t) m->vertex_count++;
+}
+
+static inline void mesh_triangle(mesh_builder* m, uint32_t a, uint32_t b, uint32_t c)
+{
+    if (!mesh_reserve((void**) &m->indices, &m->index_capacity,
+                      m->index_count + 3, sizeof(uint32_t)))
+    {
+        m->failed = 1;
+        return;
+    }
+
+    m->indices[m->index_count++] = a;
+    m->indices[m->index_count++] = b;
+    m->indices[m->index_count++] = c;
+}
+
+/* Add the quad a, b, c, d (in polygon order) as two triangles */
+static inline void mesh_quad(mesh_builder* m, uint32_t a, uint32_t b,
+                             uint32_t c, uint32_t d)
+{
+    mesh_triangle(m, a, b, c);
+    mesh_triangle(m, a, c, d);
+}
+
+/* Add a flat quad with four vertices of its own, in polygon order */
+static inline void mesh_flat_quad(mesh_builder* m, const float a[3], const float b[3],
+                                  const float c[3], const float d[3])
+{
+    const uint32_t first = mesh_vertex3f(m, a[0], a[1], a[2]);
+
+    mesh_vertex3f(m, b[0], b[1], b[2]);
+    mesh_vertex3f(m, c[0], c[1], c[2]);
+    mesh_vertex3f(m, d[0], d[1], d[2]);
+    mesh_quad(m, first, first + 1, first + 2, first + 3);
+}
+
+/*
+ * Quad strips. Every pair of vertices after the first closes a quad with the
+ * previous pair, as with GL_QUAD_STRIP. The quads of a flat strip get their
+ * own vertices with the normal current when the pair was added, which is the
+ * normal that flat shading would use, while a smooth strip shares vertices.
+ */
+
+typedef struct
+{
+    float    pair[2][3];   /* Positions of the last pair */
+    uint32_t first;        /* Index of the first vertex of the last pair */
+    int      smooth;
+    int      pairs;
+} mesh_strip;
+
+static inline void mesh_strip_begin(mesh_strip* s, int smooth)
+{
+    s->smooth = smooth;
+    s->pairs = 0;
+}
+
+static inline void mesh_strip_pair(mesh_builder* m, mesh_strip* s,
+                                   float x0, float y0, float z0,
+                                   float x1, float y1, float z1)
+{
+    const float a[3] = { x0, y0, z0 };
+    const float b[3] = { x1, y1, z1 };
+
+    if (s->smooth)
+    {
+        const uint32_t first = mesh_vertex3f(m, x0, y0, z0);
+        mesh_vertex3f(m, x1, y1, z1);
+
+        if (s->pairs)
+            mesh_quad(m, s->first, s->first + 1, first + 1, first);
+
+        s->first = first;
+    }
+    else if (s->pairs)
+        mesh_flat_quad(m, s->pair[0], s->pair[1], b, a);
+
+    memcpy(s->pair[0], a, sizeof(a));
+    memcpy(s->pair[1], b, sizeof(b));
+    s->pairs++;
+}
+
+/* Number of indices added so far, which is where the next object starts */
+static inline int mesh_index_count(const mesh_builder* m)
+{
+    return m->index_count;
+}
+
+#endif /* MESHBUILDER_H */
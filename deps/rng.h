@@ -0,0 +1,95 @@
+#ifndef RNG_H
+#define RNG_H
+
+/*
+ * A small counter-based random number generator.
+ *
+ * Every number is a hash of a stream key and a counter, so a stream has no
+ * hidden state beyond its position: any thread can generate any part of any
+ * stream, and results only depend on the seed and on how the work is split
+ * into streams (e.g. one stream per particle or per chunk), never on which
+ * thread ends up doing it.
+ *
+ * The hash is the RXS-M-XS output permutation of PCG applied to one LCG step,
+ * as recommended in "Hash Functions for GPU Rendering" (Jarzynski & Olano,
+ * JCGT 2020). It only needs 32-bit integer operations, so shaders can
+ * generate exactly the same numbers.
+ */
+
+#include <stdint.h>
+
+#ifdef _MSC_VER
+#define inline __inline
+#endif
+
+typedef struct
+{
+    uint32_t key;      /* Identifies the stream */
+    uint32_t counter;  /* Position of the next number in the stream */
+} rng_stream;
+
+static inline uint32_t rng_hash(uint32_t v)
+{
+    const uint32_t state = v * 747796405u + 2891336453u;
+    const uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+/* Start the specified stream of the specified seed */
+static inline void rng_stream_init(rng_stream* s, uint32_t seed, uint32_t stream)
+{
+    s->key = rng_hash(stream ^ rng_hash(seed));
+    s->counter = 0u;
+}
+
+/* The number at the specified position of a stream */
+static inline uint32_t rng_at(const rng_stream* s, uint32_t counter)
+{
+    return rng_hash(counter ^ s->key);
+}
+
+/* Convert 32 random bits to a float in [0, 1) */
+static inline float rng_to_float(uint32_t bits)
+{
+    return (float) (bits >> 8) * (1.f / 16777216.f);
+}
+
+static inline uint32_t rng_next_u32(rng_stream* s)
+{
+    return rng_at(s, s->counter++);
+}
+
+static inline float rng_next_float(rng_stream* s)
+{
+    return rng_to_float(rng_next_u32(s));
+}
+
+/*
+ * Batch generation. There are no dependencies between the numbers, so these
+ * loops are vectorized by the compiler (the variable shift of the hash needs
+ * AVX2 or better on x86, NEON on ARM).
+ */
+
+static inline void rng_fill_u32(rng_stream* s, uint32_t* out, int count)
+{
+    const uint32_t key = s->key, first = s->counter;
+    int i;
+
+    for (i = 0;  i < count;  i++)
+        out[i] = rng_hash((first + (uint32_t) i) ^ key);
+
+    s->counter += (uint32_t) count;
+}
+
+static inline void rng_fill_float(rng_stream* s, float* out, int count)
+{
+    const uint32_t key = s->key, first = s->counter;
+    int i;
+
+    for (i = 0;  i < count;  i++)
+        out[i] = rng_to_float(rng_hash((first + (uint32_t) i) ^ key));
+
+    s->counter += (uint32_t) count;
+}
+
+#endif /* RNG_H */
@@ -0,0 +1,206 @@
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+/*
+ * Threading helpers shared by the example programs: atomic operations on
+ * ints, a monotonic clock for benchmarking without GLFW, the number of
+ * processors and a pool of persistent worker threads.
+ *
+ * The pool runs batches of jobs. The calling thread hands out a batch with
+ * work_pool_run and then works on it together with the workers. Idle threads
+ * claim the next unclaimed job, so a thread that falls behind does not hold
+ * up the others. The workers sleep between batches and are only created once,
+ * so a batch costs a few lock operations rather than thread creation.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+
+#if defined(_WIN32)
+ #include <intrin.h>
+#else
+ #include <unistd.h>
+#endif
+
+#include "tinycthread.h"
+
+#ifdef _MSC_VER
+#define inline __inline
+#endif
+
+/* Atomic operations on ints, all of them sequentially consistent */
+#if defined(_MSC_VER)
+ #define atomic_load_int(p)        _InterlockedOr((volatile long*) (p), 0)
+ #define atomic_store_int(p, v)    _InterlockedExchange((volatile long*) (p), (v))
+ #define atomic_exchange_int(p, v) _InterlockedExchange((volatile long*) (p), (v))
+ #define atomic_add_int(p, v)      _InterlockedExchangeAdd((volatile long*) (p), (v))
+#else
+ #define atomic_load_int(p)        __atomic_load_n((p), __ATOMIC_SEQ_CST)
+ #define atomic_store_int(p, v)    __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+ #define atomic_exchange_int(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+ #define atomic_add_int(p, v)      __atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#endif
+
+/* Time in seconds on a clock that is never adjusted, where there is one */
+static inline double get_time(void)
+{
+    struct timespec ts;
+#if defined(CLOCK_MONOTONIC)
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#else
+    clock_gettime(CLOCK_REALTIME, &ts);
+#endif
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+static inline int get_processor_count(void)
+{
+#if defined(_WIN32)
+    const char* count = getenv("NUMBER_OF_PROCESSORS");
+    return count && atoi(count) > 0 ? atoi(count) : 1;
+#else
+    const long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int) count : 1;
+#endif
+}
+
+typedef struct
+{
+    thrd_t* threads;    /* Worker threads (all but the calling thread) */
+    int     count;      /* Number of threads working on jobs, including the caller */
+    mtx_t   lock;       /* Protects all of the below */
+    cnd_t   start;      /* Condition: new batch of jobs available (or quit) */
+    cnd_t   done;       /* Condition: all jobs of the batch are done */
+    int     batch;      /* Batch counter, used to detect new batches */
+    int     quit;       /* Tells the workers to exit */
+    void    (*job)(int index);
+    int     job_count;  /* Number of jobs in the batch */
+    int     next_job;   /* Index of the next unclaimed job */
+    int     jobs_done;  /* Number of finished jobs */
+} work_pool;
+
+/* Work on the jobs of the current batch until all have been claimed. This is
+ * called with the pool lock held. */
+static inline void work_pool__work(work_pool* pool)
+{
+    while (pool->next_job < pool->job_count)
+    {
+        const int index = pool->next_job++;
+
+        mtx_unlock(&pool->lock);
+        pool->job(index);
+        mtx_lock(&pool->lock);
+
+        if (++pool->jobs_done == pool->job_count)
+            cnd_signal(&pool->done);
+    }
+}
+
+static inline int work_pool__thread_main(void* arg)
+{
+    work_pool* pool = arg;
+    int batch = 0;
+
+    mtx_lock(&pool->lock);
+
+    for (;;)
+    {
+        while (!pool->quit && pool->batch == batch)
+            cnd_wait(&pool->start, &pool->lock);
+
+        if (pool->quit)
+            break;
+
+        batch = pool->batch;
+        work_pool__work(pool);
+    }
+
+    mtx_unlock(&pool->lock);
+    return 0;
+}
+
+/* Start a pool of the specified number of threads, including the caller, so
+ * count - 1 workers are created. Returns zero on failure, in which case the
+ * pool can still be run and terminated and uses the workers it got. */
+static inline int work_pool_init(work_pool* pool, int count)
+{
+    int i;
+
+    pool->count = 1;
+    pool->batch = 0;
+    pool->quit = 0;
+    mtx_init(&pool->lock, mtx_plain);
+    cnd_init(&pool->start);
+    cnd_init(&pool->done);
+
+    pool->threads = calloc(count, sizeof(thrd_t));
+    if (!pool->threads)
+        return 0;
+
+    for (i = 0;  i < count - 1;  i++)
+    {
+        if (thrd_create(&pool->threads[i], work_pool__thread_main, pool) != thrd_success)
+            return 0;
+
+        pool->count++;
+    }
+
+    return 1;
+}
+
+static inline void work_pool_terminate(work_pool* pool)
+{
+    int i;
+
+    mtx_lock(&pool->lock);
+    pool->quit = 1;
+    cnd_broadcast(&pool->start);
+    mtx_unlock(&pool->lock);
+
+    for (i = 0;  i < pool->count - 1;  i++)
+        thrd_join(pool->threads[i], NULL);
+
+    free(pool->threads);
+    pool->threads = NULL;
+    pool->count = 1;
+
+    cnd_destroy(&pool->done);
+    cnd_destroy(&pool->start);
+    mtx_destroy(&pool->lock);
+}
+
+/* Run the specified job function for every index in [0, count) and return
+ * when all of them are done */
+static inline void work_pool_run(work_pool* pool, void (*job)(int index), int count)
+{
+    int i;
+
+    if (count == 0)
+        return;
+
+    if (pool->count == 1 || count == 1)
+    {
+        for (i = 0;  i < count;  i++)
+            job(i);
+
+        return;
+    }
+
+    mtx_lock(&pool->lock);
+
+    pool->job = job;
+    pool->job_count = count;
+    pool->next_job = 0;
+    pool->jobs_done = 0;
+    pool->batch++;
+    cnd_broadcast(&pool->start);
+
+    work_pool__work(pool);
+
+    while (pool->jobs_done < pool->job_count)
+        cnd_wait(&pool->done, &pool->lock);
+
+    mtx_unlock(&pool->lock);
+}
+
+#endif /* WORKPOOL_H */
@@ -19,6 +19,10 @@
  *   - Removed FPS counter (this is not a benchmark)
  *   - Added a few comments
  *   - Enabled vsync
+ *
+ *   - The gears are built once into a vertex and an index buffer and drawn
+ *     with shaders on OpenGL 3.2 core profile contexts, display lists are
+ *     only used when no such context can be created
  */
 
 #if defined(_MSC_VER)
@@ -28,10 +32,16 @@
 
 #include <math.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
+
+#define GLFW_INCLUDE_GLEXT
 #include <GLFW/glfw3.h>
 
+#include <linmath.h>
+#include <meshbuilder.h>
+
 /**
 
   Draw a gear wheel.  You'll probably want to call this function when
@@ -163,15 +173,360 @@ gear(GLfloat inner_radius, GLfloat outer_radius, GLfloat width,
 }
 
 
+/**
+
+  Add a gear wheel to a mesh.  This builds the same faces as gear, with
+  the normals that flat shading would pick, so the trig is only done once.
+
+ **/
+
+/* the point at the specified radius, angle and depth, as a vector and as
+   the three arguments of a strip vertex */
+static void
+gear_point(GLfloat p[3], GLfloat r, GLfloat angle, GLfloat z)
+{
+  p[0] = r * (float) cos(angle);
+  p[1] = r * (float) sin(angle);
+  p[2] = z;
+}
+
+#define P(r, a, z) (r) * (float) cos(a), (r) * (float) sin(a), (z)
+
+static void
+gear_mesh(mesh_builder* m, GLfloat inner_radius, GLfloat outer_radius,
+  GLfloat width, GLint teeth, GLfloat tooth_depth)
+{
+  GLint i;
+  GLfloat r0, r1, r2;
+  GLfloat angle, da;
+  GLfloat u, v, len;
+  GLfloat p[4][3];
+  mesh_strip strip;
+
+  r0 = inner_radius;
+  r1 = outer_radius - tooth_depth / 2.f;
+  r2 = outer_radius + tooth_depth / 2.f;
+
+  da = 2.f * (float) M_PI / teeth / 4.f;
+
+  mesh_normal(m, 0.f, 0.f, 1.f);
+
+  /* front face */
+  mesh_strip_begin(&strip, GL_FALSE);
+  for (i = 0; i <= teeth; i++) {
+    angle = i * 2.f * (float) M_PI / teeth;
+    mesh_strip_pair(m, &strip, P(r0, angle, width * 0.5f), P(r1, angle, width * 0.5f));
+    if (i < teeth)
+      mesh_strip_pair(m, &strip, P(r0, angle, width * 0.5f), P(r1, angle + 3 * da, width * 0.5f));
+  }
+
+  /* front sides of teeth */
+  for (i = 0; i < teeth; i++) {
+    angle = i * 2.f * (float) M_PI / teeth;
+    gear_point(p[0], r1, angle, width * 0.5f);
+    gear_point(p[1], r2, angle + da, width * 0.5f);
+    gear_point(p[2], r2, angle + 2 * da, width * 0.5f);
+    gear_point(p[3], r1, angle + 3 * da, width * 0.5f);
+    mesh_flat_quad(m, p[0], p[1], p[2], p[3]);
+  }
+
+  mesh_normal(m, 0.f, 0.f, -1.f);
+
+  /* back face */
+  mesh_strip_begin(&strip, GL_FALSE);
+  for (i = 0; i <= teeth; i++) {
+    angle = i * 2.f * (float) M_PI / teeth;
+    mesh_strip_pair(m, &strip, P(r1, angle, -width * 0.5f), P(r0, angle, -width * 0.5f));
+    if (i < teeth)
+      mesh_strip_pair(m, &strip, P(r1, angle + 3 * da, -width * 0.5f), P(r0, angle, -width * 0.5f));
+  }
+
+  /* back sides of teeth */
+  for (i = 0; i < teeth; i++) {
+    angle = i * 2.f * (float) M_PI / teeth;
+    gear_point(p[0], r1, angle + 3 * da, -width * 0.5f);
+    gear_point(p[1], r2, angle + 2 * da, -width * 0.5f);
+    gear_point(p[2], r2, angle + da, -width * 0.5f);
+    gear_point(p[3], r1, angle, -width * 0.5f);
+    mesh_flat_quad(m, p[0], p[1], p[2], p[3]);
+  }
+
+  /* outward faces of teeth */
+  mesh_strip_begin(&strip, GL_FALSE);
+  for (i = 0; i < teeth; i++) {
+    angle = i * 2.f * (float) M_PI / teeth;
+
+    mesh_strip_pair(m, &strip, P(r1, angle, width * 0.5f), P(r1, angle, -width * 0.5f));
+    u = r2 * (float) cos(angle + da) - r1 * (float) cos(angle);
+    v = r2 * (float) sin(angle + da) - r1 * (float) sin(angle);
+    len = (float) sqrt(u * u + v * v);
+    mesh_normal(m, v / len, -u / len, 0.f);
+    mesh_strip_pair(m, &strip, P(r2, angle + da, width * 0.5f), P(r2, angle + da, -width * 0.5f));
+    mesh_normal(m, (float) cos(angle), (float) sin(angle), 0.f);
+    mesh_strip_pair(m, &strip, P(r2, angle + 2 * da, width * 0.5f), P(r2, angle + 2 * da, -width * 0.5f));
+    u = r1 * (float) cos(angle + 3 * da) - r2 * (float) cos(angle + 2 * da);
+    v = r1 * (float) sin(angle + 3 * da) - r2 * (float) sin(angle + 2 * da);
+    len = (float) sqrt(u * u + v * v);
+    mesh_normal(m, v / len, -u / len, 0.f);
+    mesh_strip_pair(m, &strip, P(r1, angle + 3 * da, width * 0.5f), P(r1, angle + 3 * da, -width * 0.5f));
+    mesh_normal(m, (float) cos(angle), (float) sin(angle), 0.f);
+  }
+  mesh_strip_pair(m, &strip, P(r1, 0.f, width * 0.5f), P(r1, 0.f, -width * 0.5f));
+
+  /* inside radius cylinder */
+  mesh_strip_begin(&strip, GL_TRUE);
+  for (i = 0; i <= teeth; i++) {
+    angle = i * 2.f * (float) M_PI / teeth;
+    mesh_normal(m, -(float) cos(angle), -(float) sin(angle), 0.f);
+    mesh_strip_pair(m, &strip, P(r0, angle, -width * 0.5f), P(r0, angle, width * 0.5f));
+  }
+}
+
+#undef P
+
+
 static GLfloat view_rotx = 20.f, view_roty = 30.f, view_rotz = 0.f;
 static GLint gear1, gear2, gear3;
 static GLfloat angle = 0.f;
 
+/* the gears as a single mesh, drawn with shaders on core profile contexts */
+static struct {
+  GLuint program;
+  GLuint vertex_array;
+  GLuint buffers[2];
+  GLint mvp_location, modelview_location;
+  GLint first[3], count[3];      /* index range of each gear */
+  mat4x4 projection, view;
+} mesh;
+
+/* set when the context lacks the fixed function pipeline */
+static int core_profile = GL_FALSE;
+
+static PFNGLCREATESHADERPROC glCreateShader;
+static PFNGLSHADERSOURCEPROC glShaderSource;
+static PFNGLCOMPILESHADERPROC glCompileShader;
+static PFNGLGETSHADERIVPROC glGetShaderiv;
+static PFNGLGETSHADERINFOLOGPROC glGetShaderInfoLog;
+static PFNGLCREATEPROGRAMPROC glCreateProgram;
+static PFNGLATTACHSHADERPROC glAttachShader;
+static PFNGLBINDATTRIBLOCATIONPROC glBindAttribLocation;
+static PFNGLLINKPROGRAMPROC glLinkProgram;
+static PFNGLGETPROGRAMIVPROC glGetProgramiv;
+static PFNGLGETPROGRAMINFOLOGPROC glGetProgramInfoLog;
+static PFNGLUSEPROGRAMPROC glUseProgram;
+static PFNGLGETUNIFORMLOCATIONPROC glGetUniformLocation;
+static PFNGLUNIFORMMATRIX4FVPROC glUniformMatrix4fv;
+static PFNGLGENBUFFERSPROC glGenBuffers;
+static PFNGLBINDBUFFERPROC glBindBuffer;
+static PFNGLBUFFERDATAPROC glBufferData;
+static PFNGLGENVERTEXARRAYSPROC glGenVertexArrays;
+static PFNGLBINDVERTEXARRAYPROC glBindVertexArray;
+static PFNGLENABLEVERTEXATTRIBARRAYPROC glEnableVertexAttribArray;
+static PFNGLVERTEXATTRIBPOINTERPROC glVertexAttribPointer;
+
+#define LOAD_GL_FUNCTION(type, name) \
+  if (!(name = (type) glfwGetProcAddress(#name))) return GL_FALSE
+
+static int load_mesh_functions(void)
+{
+  LOAD_GL_FUNCTION(PFNGLCREATESHADERPROC, glCreateShader);
+  LOAD_GL_FUNCTION(PFNGLSHADERSOURCEPROC, glShaderSource);
+  LOAD_GL_FUNCTION(PFNGLCOMPILESHADERPROC, glCompileShader);
+  LOAD_GL_FUNCTION(PFNGLGETSHADERIVPROC, glGetShaderiv);
+  LOAD_GL_FUNCTION(PFNGLGETSHADERINFOLOGPROC, glGetShaderInfoLog);
+  LOAD_GL_FUNCTION(PFNGLCREATEPROGRAMPROC, glCreateProgram);
+  LOAD_GL_FUNCTION(PFNGLATTACHSHADERPROC, glAttachShader);
+  LOAD_GL_FUNCTION(PFNGLBINDATTRIBLOCATIONPROC, glBindAttribLocation);
+  LOAD_GL_FUNCTION(PFNGLLINKPROGRAMPROC, glLinkProgram);
+  LOAD_GL_FUNCTION(PFNGLGETPROGRAMIVPROC, glGetProgramiv);
+  LOAD_GL_FUNCTION(PFNGLGETPROGRAMINFOLOGPROC, glGetProgramInfoLog);
+  LOAD_GL_FUNCTION(PFNGLUSEPROGRAMPROC, glUseProgram);
+  LOAD_GL_FUNCTION(PFNGLGETUNIFORMLOCATIONPROC, glGetUniformLocation);
+  LOAD_GL_FUNCTION(PFNGLUNIFORMMATRIX4FVPROC, glUniformMatrix4fv);
+  LOAD_GL_FUNCTION(PFNGLGENBUFFERSPROC, glGenBuffers);
+  LOAD_GL_FUNCTION(PFNGLBINDBUFFERPROC, glBindBuffer);
+  LOAD_GL_FUNCTION(PFNGLBUFFERDATAPROC, glBufferData);
+  LOAD_GL_FUNCTION(PFNGLGENVERTEXARRAYSPROC, glGenVertexArrays);
+  LOAD_GL_FUNCTION(PFNGLBINDVERTEXARRAYPROC, glBindVertexArray);
+  LOAD_GL_FUNCTION(PFNGLENABLEVERTEXATTRIBARRAYPROC, glEnableVertexAttribArray);
+  LOAD_GL_FUNCTION(PFNGLVERTEXATTRIBPOINTERPROC, glVertexAttribPointer);
+  return GL_TRUE;
+}
+
+/* the fixed function lighting of the display lists: one directional light,
+   the default ambient light and diffuse reflection only */
+static const char* mesh_vertex_shader_text =
+"#version 150\n"
+"uniform mat4 mvp;\n"
+"uniform mat4 modelview;\n"
+"in vec3 position;\n"
+"in vec3 normal;\n"
+"in vec3 color;\n"
+"out vec3 lit_color;\n"
+"const vec3 light = vec3(0.408248, 0.408248, 0.816497);\n"
+"void main()\n"
+"{\n"
+"    vec3 n = normalize(mat3(modelview) * normal);\n"
+"    lit_color = color * (0.2 + max(dot(n, light), 0.0));\n"
+"    gl_Position = mvp * vec4(position, 1.0);\n"
+"}\n";
+
+static const char* mesh_fragment_shader_text =
+"#version 150\n"
+"in vec3 lit_color;\n"
+"out vec4 fragment;\n"
+"void main()\n"
+"{\n"
+"    fragment = vec4(lit_color, 1.0);\n"
+"}\n";
+
+static GLuint compile_shader(GLenum type, const char* text)
+{
+  GLint status;
+  GLchar log[1024];
+  GLuint shader = glCreateShader(type);
+
+  glShaderSource(shader, 1, &text, NULL);
+  glCompileShader(shader);
+
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+  if (status != GL_TRUE) {
+    glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+    fprintf(stderr, "Failed to compile gear shader:\n%s\n", log);
+    return 0;
+  }
+
+  return shader;
+}
+
+/* build the gears once and upload them, returns GL_FALSE on failure */
+static int init_mesh(void)
+{
+  static const GLfloat colors[3][3] = {
+    {0.8f, 0.1f, 0.f}, {0.f, 0.8f, 0.2f}, {0.2f, 0.2f, 1.f}
+  };
+  static const GLfloat params[3][4] = {
+    {1.f, 4.f, 1.f, 0.7f}, {0.5f, 2.f, 2.f, 0.7f}, {1.3f, 2.f, 0.5f, 0.7f}
+  };
+  static const GLint teeth[3] = {20, 10, 10};
+  GLuint vertex_shader, fragment_shader;
+  GLint status;
+  GLchar log[1024];
+  mesh_builder m;
+  int i;
+
+  if (!load_mesh_functions())
+    return GL_FALSE;
+
+  vertex_shader = compile_shader(GL_VERTEX_SHADER, mesh_vertex_shader_text);
+  fragment_shader = compile_shader(GL_FRAGMENT_SHADER, mesh_fragment_shader_text);
+  if (!vertex_shader || !fragment_shader)
+    return GL_FALSE;
+
+  mesh.program = glCreateProgram();
+  glAttachShader(mesh.program, vertex_shader);
+  glAttachShader(mesh.program, fragment_shader);
+  glBindAttribLocation(mesh.program, 0, "position");
+  glBindAttribLocation(mesh.program, 1, "normal");
+  glBindAttribLocation(mesh.program, 2, "color");
+  glLinkProgram(mesh.program);
+
+  glGetProgramiv(mesh.program, GL_LINK_STATUS, &status);
+  if (status != GL_TRUE) {
+    glGetProgramInfoLog(mesh.program, sizeof(log), NULL, log);
+    fprintf(stderr, "Failed to link gear program:\n%s\n", log);
+    mesh.program = 0;
+    return GL_FALSE;
+  }
+
+  mesh.mvp_location = glGetUniformLocation(mesh.program, "mvp");
+  mesh.modelview_location = glGetUniformLocation(mesh.program, "modelview");
+
+  /* make the gears */
+  mesh_init(&m);
+  for (i = 0; i < 3; i++) {
+    mesh.first[i] = mesh_index_count(&m);
+    mesh_color(&m, colors[i][0], colors[i][1], colors[i][2]);
+    gear_mesh(&m, params[i][0], params[i][1], params[i][2], teeth[i], params[i][3]);
+    mesh.count[i] = mesh_index_count(&m) - mesh.first[i];
+  }
+
+  if (m.failed) {
+    mesh_free(&m);
+    mesh.program = 0;
+    return GL_FALSE;
+  }
+
+  glGenVertexArrays(1, &mesh.vertex_array);
+  glBindVertexArray(mesh.vertex_array);
+
+  glGenBuffers(2, mesh.buffers);
+  glBindBuffer(GL_ARRAY_BUFFER, mesh.buffers[0]);
+  glBufferData(GL_ARRAY_BUFFER, m.vertex_count * sizeof(mesh_vertex),
+               m.vertices, GL_STATIC_DRAW);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.buffers[1]);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, m.index_count * sizeof(uint32_t),
+               m.indices, GL_STATIC_DRAW);
+
+  glEnableVertexAttribArray(0);
+  glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(mesh_vertex),
+                        (void*) offsetof(mesh_vertex, position));
+  glEnableVertexAttribArray(1);
+  glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(mesh_vertex),
+                        (void*) offsetof(mesh_vertex, normal));
+  glEnableVertexAttribArray(2);
+  glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(mesh_vertex),
+                        (void*) offsetof(mesh_vertex, color));
+
+  mesh_free(&m);
+
+  glEnable(GL_CULL_FACE);
+  glEnable(GL_DEPTH_TEST);
+  return GL_TRUE;
+}
+
+/* draw one gear of the mesh, the only per-frame work is the matrices */
+static void draw_mesh_gear(mat4x4 view, int gear, GLfloat x, GLfloat y, GLfloat rotz)
+{
+  mat4x4 modelview, mvp;
+
+  mat4x4_dup(modelview, view);
+  mat4x4_translate_in_place(modelview, x, y, 0.f);
+  mat4x4_rotate(modelview, modelview, 0.f, 0.f, 1.f, rotz * (float) M_PI / 180.f);
+  mat4x4_mul(mvp, mesh.projection, modelview);
+
+  glUniformMatrix4fv(mesh.mvp_location, 1, GL_FALSE, (const GLfloat*) mvp);
+  glUniformMatrix4fv(mesh.modelview_location, 1, GL_FALSE, (const GLfloat*) modelview);
+  glDrawElements(GL_TRIANGLES, mesh.count[gear], GL_UNSIGNED_INT,
+                 (void*) (mesh.first[gear] * sizeof(uint32_t)));
+}
+
+static void draw_mesh(void)
+{
+  mat4x4 view;
+
+  mat4x4_rotate(view, mesh.view, 1.f, 0.f, 0.f, view_rotx * (float) M_PI / 180.f);
+  mat4x4_rotate(view, view, 0.f, 1.f, 0.f, view_roty * (float) M_PI / 180.f);
+  mat4x4_rotate(view, view, 0.f, 0.f, 1.f, view_rotz * (float) M_PI / 180.f);
+
+  glUseProgram(mesh.program);
+  glBindVertexArray(mesh.vertex_array);
+
+  draw_mesh_gear(view, 0, -3.f, -2.f, angle);
+  draw_mesh_gear(view, 1, 3.1f, -2.f, -2.f * angle - 9.f);
+  draw_mesh_gear(view, 2, -3.1f, 4.2f, -2.f * angle - 25.f);
+}
+
 /* OpenGL draw function & timing */
 static void draw(void)
 {
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
+  if (mesh.program) {
+    draw_mesh();
+    return;
+  }
+
   glPushMatrix();
     glRotatef(view_rotx, 1.0, 0.0, 0.0);
     glRotatef(view_roty, 0.0, 1.0, 0.0);
@@ -250,6 +605,12 @@ void reshape( GLFWwindow* window, int width, int height )
   xmax  = znear * 0.5f;
 
   glViewport( 0, 0, (GLint) width, (GLint) height );
+
+  mat4x4_frustum( mesh.projection, -xmax, xmax, -xmax*h, xmax*h, znear, zfar );
+  mat4x4_translate( mesh.view, 0.0, 0.0, -20.0 );
+  if (core_profile)
+    return;
+
   glMatrixMode( GL_PROJECTION );
   glLoadIdentity();
   glFrustum( -xmax, xmax, -xmax*h, xmax*h, znear, zfar );
@@ -309,8 +670,34 @@ int main(int argc, char *argv[])
     }
 
     glfwWindowHint(GLFW_DEPTH_BITS, 16);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 2);
+    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
     window = glfwCreateWindow( 300, 300, "Gears", NULL, NULL );
+    if (window)
+    {
+        glfwMakeContextCurrent(window);
+
+        core_profile = init_mesh();
+        if (!core_profile)
+        {
+            fprintf( stderr, "Failed to create the gear mesh, using display lists\n" );
+            glfwDestroyWindow(window);
+            window = NULL;
+        }
+    }
+
+    if (!window)
+    {
+        // Fall back to display lists on older OpenGL versions
+        glfwDefaultWindowHints();
+        glfwWindowHint(GLFW_DEPTH_BITS, 16);
+
+        window = glfwCreateWindow( 300, 300, "Gears", NULL, NULL );
+    }
+
     if (!window)
     {
         fprintf( stderr, "Failed to open GLFW window\n" );
@@ -328,8 +715,8 @@ int main(int argc, char *argv[])
     glfwGetFramebufferSize(window, &width, &height);
     reshape(window, width, height);
 
-    // Parse command-line options
-    init();
+    if (!core_profile)
+        init();
 
     // Main loop
     while( !glfwWindowShouldClose(window) )
@@ -25,12 +25,19 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include <assert.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
+#include <tinycthread.h>
+#include <workpool.h>
+#include <getopt.h>
+#include <rng.h>
+#include <gridmesh.h>
 
 /* Map height updates */
 #define MAX_CIRCLE_SIZE (5.0f)
@@ -38,13 +45,40 @@
 #define DISPLACEMENT_SIGN_LIMIT (0.3f)
 #define MAX_ITER (200)
 #define NUM_ITER_AT_A_TIME (1)
+#define MAP_SEED (0u)
 
 /* Map general information */
 #define MAP_SIZE (10.0f)
-#define MAP_NUM_VERTICES (80)
-#define MAP_NUM_TOTAL_VERTICES (MAP_NUM_VERTICES*MAP_NUM_VERTICES)
-#define MAP_NUM_LINES (3* (MAP_NUM_VERTICES - 1) * (MAP_NUM_VERTICES - 1) + \
-               2 * (MAP_NUM_VERTICES - 1))
+#define DEFAULT_MAP_NUM_VERTICES (80)
+#define MAX_MAP_NUM_VERTICES (16384)
+
+/* Number of vertices along each side of the map, set with -n */
+static int map_num_vertices = DEFAULT_MAP_NUM_VERTICES;
+static int map_num_total_vertices;
+static int map_num_indices;
+static int map_index_size;
+
+/* Height uploads of at least this many bytes go through a mapping */
+#define MAP_STREAM_THRESHOLD (256 * 1024)
+
+/* Number of threads applying the circles, set with -j */
+#define MAX_MAP_THREADS (64)
+static int map_threads = 1;
+
+/* Persistent worker threads applying the circles, so a batch does not pay
+ * for thread creation */
+static work_pool map_pool;
+
+/* Draw the whole map as lines instead of the terrain, set with -l */
+static int draw_lines = GL_FALSE;
+
+/* Terrain level of detail. The terrain is a quadtree whose nodes are all
+ * grids of TERRAIN_CHUNK x TERRAIN_CHUNK quads, with a spacing of 2^level map
+ * vertices at each level
+ */
+#define TERRAIN_CHUNK (64)
+#define MAX_TERRAIN_LEVELS (16)
+#define TERRAIN_PIXEL_ERROR (1.0f)
 
 
 /**********************************************************************
@@ -72,6 +106,54 @@ static const char* fragment_shader_text =
 "    color = vec4(0.2, 1.0, 0.2, 1.0); \n"
 "}\n";
 
+/* The terrain is drawn from a single grid shared by all nodes. Each vertex
+ * of the grid reads its height from the height texture, and vertices of the
+ * skirts are moved down to hide the cracks between nodes of different levels
+ */
+static const char* terrain_vertex_shader_text =
+"#version 150\n"
+"uniform mat4 project;\n"
+"uniform mat4 modelview;\n"
+"uniform sampler2D heights;\n"
+"uniform ivec2 origin;\n"
+"uniform int spacing;\n"
+"uniform float skirt;\n"
+"uniform float map_step;\n"
+"in vec3 grid;\n"
+"out float light;\n"
+"\n"
+"float height(ivec2 texel)\n"
+"{\n"
+"    ivec2 last = textureSize(heights, 0) - 1;\n"
+"    return texelFetch(heights, clamp(texel, ivec2(0), last), 0).r;\n"
+"}\n"
+"\n"
+"void main()\n"
+"{\n"
+"    ivec2 last = textureSize(heights, 0) - 1;\n"
+"    ivec2 texel = min(origin + ivec2(grid.xy) * spacing, last);\n"
+"    ivec2 row = ivec2(0, spacing);\n"
+"    ivec2 col = ivec2(spacing, 0);\n"
+"    vec3 normal = normalize(vec3(height(texel - row) - height(texel + row),\n"
+"                                 2.0 * float(spacing) * map_step,\n"
+"                                 height(texel - col) - height(texel + col)));\n"
+"    vec3 position = vec3(float(texel.y) * map_step,\n"
+"                         height(texel) - grid.z * skirt,\n"
+"                         float(texel.x) * map_step);\n"
+"\n"
+"    light = 0.3 + 0.7 * max(dot(normal, normalize(vec3(0.5, 1.0, 0.3))), 0.0);\n"
+"    gl_Position = project * modelview * vec4(position, 1.0);\n"
+"}\n";
+
+static const char* terrain_fragment_shader_text =
+"#version 150\n"
+"in float light;\n"
+"out vec4 color;\n"
+"void main()\n"
+"{\n"
+"    color = vec4(vec3(0.2, 1.0, 0.2) * light, 1.0);\n"
+"}\n";
+
 /**********************************************************************
  * Values for shader uniforms
  *********************************************************************/
@@ -102,8 +184,12 @@ static GLfloat modelview_matrix[16] = {
  * Heightmap vertex and index data
  *********************************************************************/
 
-static GLfloat map_vertices[3][MAP_NUM_TOTAL_VERTICES];
-static GLuint  map_line_indices[2*MAP_NUM_LINES];
+/* The vertices of row i and column j are at (map_coords[i], map_coords[j]),
+ * so only the heights are stored for every vertex
+ */
+static GLfloat* map_coords;
+static GLfloat* map_heights;
+static GLvoid*  map_indices;
 
 /* Store uniform location for the shaders
  * Those values are setup as part of the process of creating
@@ -200,137 +286,767 @@ static GLuint make_shader_program(const char* vs_text, const char* fs_text)
  * Geometry creation functions
  *********************************************************************/
 
+/* Allocate the vertices and, if the map is going to be drawn as lines, the
+ * indices of the heightmap
+ */
+static int alloc_map(int drawn)
+{
+    map_num_total_vertices = map_num_vertices * map_num_vertices;
+    map_num_indices = grid_line_index_count(map_num_vertices, map_num_vertices);
+    map_index_size = grid_index_size(map_num_vertices, map_num_vertices);
+
+    map_coords = malloc(sizeof(GLfloat) * map_num_vertices);
+    map_heights = malloc(sizeof(GLfloat) * map_num_total_vertices);
+    if (!map_coords || !map_heights)
+        return GL_FALSE;
+
+    if (drawn)
+    {
+        map_indices = malloc((size_t) map_index_size * map_num_indices);
+        if (!map_indices)
+            return GL_FALSE;
+    }
+
+    return GL_TRUE;
+}
+
 /* Generate vertices and indices for the heightmap
  */
 static void init_map(void)
 {
     int i;
-    int j;
+#ifdef DEBUG_ENABLED
     int k;
-    GLfloat step = MAP_SIZE / (MAP_NUM_VERTICES - 1);
+#endif
+    GLfloat step = MAP_SIZE / (map_num_vertices - 1);
     GLfloat x = 0.0f;
-    GLfloat z = 0.0f;
     /* Create a flat grid */
-    k = 0;
-    for (i = 0 ; i < MAP_NUM_VERTICES ; ++i)
+    for (i = 0 ; i < map_num_vertices ; ++i)
     {
-        for (j = 0 ; j < MAP_NUM_VERTICES ; ++j)
-        {
-            map_vertices[0][k] = x;
-            map_vertices[1][k] = 0.0f;
-            map_vertices[2][k] = z;
-            z += step;
-            ++k;
-        }
+        map_coords[i] = x;
         x += step;
-        z = 0.0f;
     }
+    memset(map_heights, 0, sizeof(GLfloat) * map_num_total_vertices);
 #if DEBUG_ENABLED
-    for (i = 0 ; i < MAP_NUM_TOTAL_VERTICES ; ++i)
+    for (i = 0 ; i < map_num_total_vertices ; ++i)
     {
         printf ("Vertice %d (%f, %f, %f)\n",
-                i, map_vertices[0][i], map_vertices[1][i], map_vertices[2][i]);
+                i, map_coords[i / map_num_vertices], map_heights[i],
+                map_coords[i % map_num_vertices]);
 
     }
 #endif
+    /* The indices are only needed when the map is drawn */
+    if (!map_indices)
+        return;
+
     /* create indices */
-    /* line fan based on i
+    /* line strips along the rows, the columns and the diagonals
      * i+1
      * |  / i + n + 1
      * | /
      * |/
      * i --- i + n
      */
+    grid_line_indices(map_indices, map_index_size, map_num_vertices, map_num_vertices);
 
-    /* close the top of the square */
-    k = 0;
-    for (i = 0 ; i < MAP_NUM_VERTICES  -1 ; ++i)
+#ifdef DEBUG_ENABLED
+    for (k = 0 ; k < map_num_indices ; ++k)
     {
-        map_line_indices[k++] = (i + 1) * MAP_NUM_VERTICES -1;
-        map_line_indices[k++] = (i + 2) * MAP_NUM_VERTICES -1;
+        const uint32_t index = map_index_size == 2 ?
+            ((GLushort*) map_indices)[k] : ((GLuint*) map_indices)[k];
+        if (index == grid_restart_index(map_index_size))
+        {
+            printf ("Index %d: restart\n", k);
+            continue;
+        }
+        printf ("Index %d: %u (%f, %f, %f)\n",
+                k, index, map_coords[index / map_num_vertices], map_heights[index],
+                map_coords[index % map_num_vertices]);
     }
-    /* close the right of the square */
-    for (i = 0 ; i < MAP_NUM_VERTICES -1 ; ++i)
+#endif
+}
+
+/* Number of circles generated so far */
+static uint32_t map_circles = 0u;
+
+static void generate_heightmap__circle(float* center_x, float* center_y,
+        float* size, float* displacement)
+{
+    float sign;
+    float r[5];
+    rng_stream rng;
+
+    /* Circle n draws from random stream n, so the map only depends on the
+     * seed, whichever thread generates each circle */
+    rng_stream_init(&rng, MAP_SEED, map_circles++);
+    rng_fill_float(&rng, r, 5);
+
+    /* random value for element in between [0-1.0] */
+    *center_x = MAP_SIZE * r[0];
+    *center_y = MAP_SIZE * r[1];
+    *size = MAX_CIRCLE_SIZE * r[2];
+    sign = (r[3] < DISPLACEMENT_SIGN_LIMIT) ? -1.0f : 1.0f;
+    *displacement = sign * MAX_DISPLACEMENT * r[4];
+}
+
+/* A circle of the batch being applied, along with the rows it touches */
+typedef struct
+{
+    float center_x;
+    float center_z;
+    float radius;
+    float scale;        /* Turns squared distances into squared pd */
+    float disp;
+    int   first_row;
+    int   last_row;
+    int   first_col;
+    int   last_col;
+} map_circle;
+
+static struct
+{
+    map_circle* circles;
+    int         count;
+    int         tiles;
+} map_batch;
+
+/* An inclusive range of rows and columns of the map */
+typedef struct
+{
+    int first_row;
+    int last_row;
+    int first_col;
+    int last_col;
+} map_span;
+
+/* The vertices changed since the mesh was last updated, one span per circle */
+static struct
+{
+    map_span* spans;
+    int       count;
+    int       capacity;
+} map_dirty;
+
+/* Bytes of heights uploaded and number of mesh updates so far */
+static double map_bytes_uploaded = 0.0;
+static int    map_uploads = 0;
+
+/* Free the map buffers and the dirty spans
+ */
+static void free_map(void)
+{
+    free(map_coords);
+    free(map_heights);
+    free(map_indices);
+    free(map_dirty.spans);
+}
+
+/* cos(3.14 * pd) as a polynomial in pd^2 (its Taylor series up to pd^18,
+ * which is accurate to 4e-9 for pd <= 1), so the inner loop below needs
+ * neither sqrt nor cos and is vectorized
+ */
+static float circle_profile(float pd2)
+{
+    float c = -1.375285633e-07f;
+    c = c * pd2 + 4.268300698e-06f;
+    c = c * pd2 - 1.038979370e-04f;
+    c = c * pd2 + 1.917869210e-03f;
+    c = c * pd2 - 2.567636809e-02f;
+    c = c * pd2 + 2.343779640e-01f;
+    c = c * pd2 - 1.331206652e+00f;
+    c = c * pd2 + 4.050488548e+00f;
+    c = c * pd2 - 4.929800329e+00f;
+    return c * pd2 + 1.0f;
+}
+
+/* Convert a map coordinate range to a clamped range of vertex indices. The
+ * range has a vertex of margin on either side, as the coordinates of the
+ * vertices are sums of steps and may be slightly off
+ */
+static void map_index_range(float low, float high, int* first, int* last)
+{
+    const float step = MAP_SIZE / (map_num_vertices - 1);
+
+    *first = (int) floorf(low / step) - 1;
+    *last = (int) ceilf(high / step) + 1;
+
+    if (*first < 0)
+        *first = 0;
+    if (*last > map_num_vertices - 1)
+        *last = map_num_vertices - 1;
+}
+
+/* Apply a circle to the vertices of the specified row within its bounds
+ */
+static void apply_circle__row(const map_circle* circle, int row)
+{
+    const GLfloat* x = map_coords + row;
+    const GLfloat* z = map_coords;
+    GLfloat* y = map_heights + (size_t) row * map_num_vertices;
+    const float center_z = circle->center_z;
+    const float scale = circle->scale;
+    const float disp = circle->disp;
+    const float dx = circle->center_x - x[0];
+    const float dx2 = dx * dx;
+    float half_width;
+    int j, first, last;
+
+    if (dx2 > circle->radius * circle->radius)
+        return;
+
+    half_width = sqrtf(circle->radius * circle->radius - dx2);
+    map_index_range(circle->center_z - half_width, circle->center_z + half_width,
+                    &first, &last);
+
+    /* The height is masked with a multiplication rather than a branch, which
+     * keeps the loop vectorizable */
+    for (j = first ; j <= last ; ++j)
     {
-        map_line_indices[k++] = (MAP_NUM_VERTICES - 1) * MAP_NUM_VERTICES + i;
-        map_line_indices[k++] = (MAP_NUM_VERTICES - 1) * MAP_NUM_VERTICES + i + 1;
+        const GLfloat dz = center_z - z[j];
+        const GLfloat pd2 = (dx2 + dz * dz) * scale;
+        const GLfloat inside = (GLfloat) (pd2 <= 1.0f);
+        y[j] += inside * (disp + circle_profile(pd2) * disp);
     }
+}
 
-    for (i = 0 ; i < (MAP_NUM_VERTICES - 1) ; ++i)
+/* Apply all circles of the batch, in order, to the rows of the specified
+ * tile. The tiles do not share any vertices, so they can be updated in
+ * parallel, and each vertex sees the circles in the same order as if they
+ * were applied one at a time
+ */
+static void update_map__tile(int tile)
+{
+    const int tile_first = map_num_vertices * tile / map_batch.tiles;
+    const int tile_last = map_num_vertices * (tile + 1) / map_batch.tiles - 1;
+    int i, row, first, last;
+
+    for (i = 0 ; i < map_batch.count ; ++i)
     {
-        for (j = 0 ; j < (MAP_NUM_VERTICES - 1) ; ++j)
+        const map_circle* circle = map_batch.circles + i;
+
+        first = circle->first_row > tile_first ? circle->first_row : tile_first;
+        last = circle->last_row < tile_last ? circle->last_row : tile_last;
+
+        for (row = first ; row <= last ; ++row)
+            apply_circle__row(circle, row);
+    }
+}
+
+/* Run the specified number of iterations of the generation process for the
+ * heightmap. The circles are generated up front and then applied as a batch,
+ * with one tile of rows per thread of the pool
+ */
+static void update_map(int num_iter)
+{
+    float size;
+    int i;
+
+    assert(num_iter > 0);
+
+    map_batch.circles = malloc(sizeof(map_circle) * num_iter);
+    if (!map_batch.circles)
+        return;
+
+    for (i = 0 ; i < num_iter ; ++i)
+    {
+        map_circle* circle = map_batch.circles + i;
+
+        generate_heightmap__circle(&circle->center_x, &circle->center_z,
+                                   &size, &circle->disp);
+        circle->disp = circle->disp / 2.0f;
+
+        /* A vertex is within the circle if pd = 2 * distance / size <= 1,
+         * so a circle of size zero has no vertices */
+        circle->radius = size / 2.0f;
+        circle->scale = size > 0.0f ? 4.0f / (size * size) : 0.0f;
+
+        map_index_range(circle->center_x - circle->radius,
+                        circle->center_x + circle->radius,
+                        &circle->first_row, &circle->last_row);
+        map_index_range(circle->center_z - circle->radius,
+                        circle->center_z + circle->radius,
+                        &circle->first_col, &circle->last_col);
+
+        if (size <= 0.0f)
+            circle->last_row = -1;
+    }
+
+    /* Remember which vertices need to be uploaded */
+    if (map_dirty.count + num_iter > map_dirty.capacity)
+    {
+        map_span* spans = realloc(map_dirty.spans,
+                                  sizeof(map_span) * (map_dirty.count + num_iter));
+        if (!spans)
         {
-            int ref = i * (MAP_NUM_VERTICES) + j;
-            map_line_indices[k++] = ref;
-            map_line_indices[k++] = ref + 1;
+            free(map_batch.circles);
+            return;
+        }
 
-            map_line_indices[k++] = ref;
-            map_line_indices[k++] = ref + MAP_NUM_VERTICES;
+        map_dirty.spans = spans;
+        map_dirty.capacity = map_dirty.count + num_iter;
+    }
 
-            map_line_indices[k++] = ref;
-            map_line_indices[k++] = ref + MAP_NUM_VERTICES + 1;
+    for (i = 0 ; i < num_iter ; ++i)
+    {
+        const map_circle* circle = map_batch.circles + i;
+        if (circle->first_row <= circle->last_row)
+        {
+            map_dirty.spans[map_dirty.count].first_row = circle->first_row;
+            map_dirty.spans[map_dirty.count].last_row = circle->last_row;
+            map_dirty.spans[map_dirty.count].first_col = circle->first_col;
+            map_dirty.spans[map_dirty.count].last_col = circle->last_col;
+            ++map_dirty.count;
         }
     }
 
-#ifdef DEBUG_ENABLED
-    for (k = 0 ; k < 2 * MAP_NUM_LINES ; k += 2)
+    map_batch.count = num_iter;
+    map_batch.tiles = map_threads < map_num_vertices ? map_threads : map_num_vertices;
+
+    work_pool_run(&map_pool, update_map__tile, map_batch.tiles);
+
+    free(map_batch.circles);
+}
+
+/**********************************************************************
+ * Terrain level of detail functions
+ *********************************************************************/
+
+/* The map is drawn as a quadtree of chunks. A node of level l covers
+ * TERRAIN_CHUNK << l quads along each side with TERRAIN_CHUNK quads, so all
+ * nodes are drawn from the same grid and index buffer, with the heights read
+ * from a texture. A node is drawn if its error projected on the screen is
+ * small enough and its children are drawn instead otherwise. Each node has
+ * skirts hanging from its edges, which hide the cracks between neighbouring
+ * nodes of different levels
+ */
+typedef struct
+{
+    float min_height;
+    float max_height;
+    float error;        /* Largest height difference with the full map */
+} terrain_node;
+
+static struct
+{
+    int            levels;
+    int            size[MAX_TERRAIN_LEVELS];    /* Nodes along each side */
+    terrain_node*  nodes[MAX_TERRAIN_LEVELS];
+    unsigned char* dirty[MAX_TERRAIN_LEVELS];
+    GLuint         vao;
+    GLuint         buffers[2];
+    GLuint         texture;
+    GLsizei        num_indices;
+    GLint          uloc_origin;
+    GLint          uloc_spacing;
+    GLint          uloc_skirt;
+    GLfloat        planes[6][4];    /* Frustum planes in map coordinates */
+    GLfloat        camera[3];
+    GLfloat        pixels;          /* Pixels per unit at unit distance */
+    int            nodes_drawn;     /* Statistics since the start */
+    double         triangles_drawn;
+} terrain;
+
+/* Height of the specified vertex, clamped to the map
+ */
+static float terrain_height(int row, int col)
+{
+    const int last = map_num_vertices - 1;
+
+    row = row < last ? row : last;
+    col = col < last ? col : last;
+    return map_heights[(size_t) row * map_num_vertices + col];
+}
+
+/* Compute the height range and the error of the specified node. The error
+ * of a node is the error of its children plus the largest difference between
+ * the vertices of its children and its own triangles, which is cheap to
+ * update and close to the real error
+ */
+static void terrain_node_bounds(int level, int row, int col)
+{
+    terrain_node* node = terrain.nodes[level] + row * terrain.size[level] + col;
+    const int spacing = 1 << level;
+    const int half = spacing / 2;
+    const int first_row = row * (TERRAIN_CHUNK << level);
+    const int first_col = col * (TERRAIN_CHUNK << level);
+    const int last = map_num_vertices - 1;
+    int i, j, k, r, c;
+    float h00, h01, h10, h11, e;
+
+    node->min_height = INFINITY;
+    node->max_height = -INFINITY;
+    node->error = 0.0f;
+
+    if (level == 0)
     {
-        int beg, end;
-        beg = map_line_indices[k];
-        end = map_line_indices[k+1];
-        printf ("Line %d: %d -> %d (%f, %f, %f) -> (%f, %f, %f)\n",
-                k / 2, beg, end,
-                map_vertices[0][beg], map_vertices[1][beg], map_vertices[2][beg],
-                map_vertices[0][end], map_vertices[1][end], map_vertices[2][end]);
+        for (r = first_row ; r <= first_row + TERRAIN_CHUNK && r <= last ; ++r)
+        {
+            const GLfloat* y = map_heights + (size_t) r * map_num_vertices;
+            const int last_col = first_col + TERRAIN_CHUNK < last ?
+                                 first_col + TERRAIN_CHUNK : last;
+            float low = node->min_height, high = node->max_height;
+
+            for (c = first_col ; c <= last_col ; ++c)
+            {
+                low = y[c] < low ? y[c] : low;
+                high = y[c] > high ? y[c] : high;
+            }
+
+            node->min_height = low;
+            node->max_height = high;
+        }
+        return;
+    }
+
+    for (k = 0 ; k < 4 ; ++k)
+    {
+        const int child_row = row * 2 + k / 2, child_col = col * 2 + k % 2;
+        const terrain_node* child;
+
+        if (child_row >= terrain.size[level - 1] || child_col >= terrain.size[level - 1])
+            continue;
+
+        child = terrain.nodes[level - 1] + child_row * terrain.size[level - 1] + child_col;
+        node->min_height = child->min_height < node->min_height ?
+                           child->min_height : node->min_height;
+        node->max_height = child->max_height > node->max_height ?
+                           child->max_height : node->max_height;
+        node->error = child->error > node->error ? child->error : node->error;
+    }
+
+    /* Compare the midpoints of the edges and of the diagonal of every quad
+     * with the triangles of the node */
+    for (i = 0 ; i < TERRAIN_CHUNK ; ++i)
+    {
+        r = first_row + i * spacing;
+        if (r >= last)
+            break;
+
+        for (j = 0 ; j < TERRAIN_CHUNK ; ++j)
+        {
+            c = first_col + j * spacing;
+            if (c >= last)
+                break;
+
+            h00 = terrain_height(r, c);
+            h01 = terrain_height(r, c + spacing);
+            h10 = terrain_height(r + spacing, c);
+            h11 = terrain_height(r + spacing, c + spacing);
+
+            e = fabsf(terrain_height(r, c + half) - (h00 + h01) * 0.5f);
+            e = fmaxf(e, fabsf(terrain_height(r + half, c) - (h00 + h10) * 0.5f));
+            e = fmaxf(e, fabsf(terrain_height(r + half, c + half) - (h00 + h11) * 0.5f));
+            e = fmaxf(e, fabsf(terrain_height(r + spacing, c + half) - (h10 + h11) * 0.5f));
+            e = fmaxf(e, fabsf(terrain_height(r + half, c + spacing) - (h01 + h11) * 0.5f));
+
+            if (e > node->error)
+                node->error = e;
+        }
     }
-#endif
 }
 
-static void generate_heightmap__circle(float* center_x, float* center_y,
-        float* size, float* displacement)
+/* Flag the nodes containing any of the vertices of the specified range as
+ * needing new bounds. A node shares its last row and column of vertices with
+ * its neighbours
+ */
+static void mark_terrain(int first_row, int last_row, int first_col, int last_col)
 {
-    float sign;
-    /* random value for element in between [0-1.0] */
-    *center_x = (MAP_SIZE * rand()) / (1.0f * RAND_MAX);
-    *center_y = (MAP_SIZE * rand()) / (1.0f * RAND_MAX);
-    *size = (MAX_CIRCLE_SIZE * rand()) / (1.0f * RAND_MAX);
-    sign = (1.0f * rand()) / (1.0f * RAND_MAX);
-    sign = (sign < DISPLACEMENT_SIGN_LIMIT) ? -1.0f : 1.0f;
-    *displacement = (sign * (MAX_DISPLACEMENT * rand())) / (1.0f * RAND_MAX);
+    int level, row, col, row0, row1, col0, col1;
+
+    for (level = 0 ; level < terrain.levels ; ++level)
+    {
+        const int extent = TERRAIN_CHUNK << level;
+        const int size = terrain.size[level];
+
+        row0 = first_row > 0 ? (first_row - 1) / extent : 0;
+        col0 = first_col > 0 ? (first_col - 1) / extent : 0;
+        row1 = last_row / extent < size - 1 ? last_row / extent : size - 1;
+        col1 = last_col / extent < size - 1 ? last_col / extent : size - 1;
+
+        for (row = row0 ; row <= row1 ; ++row)
+        {
+            for (col = col0 ; col <= col1 ; ++col)
+                terrain.dirty[level][row * size + col] = GL_TRUE;
+        }
+    }
 }
 
-/* Run the specified number of iterations of the generation process for the
- * heightmap
+/* Update the bounds of all flagged nodes, from the leaves up
  */
-static void update_map(int num_iter)
+static void refresh_terrain(void)
 {
-    assert(num_iter > 0);
-    while(num_iter)
-    {
-        /* center of the circle */
-        float center_x;
-        float center_z;
-        float circle_size;
-        float disp;
-        size_t ii;
-        generate_heightmap__circle(&center_x, &center_z, &circle_size, &disp);
-        disp = disp / 2.0f;
-        for (ii = 0u ; ii < MAP_NUM_TOTAL_VERTICES ; ++ii)
+    int level, row, col;
+
+    for (level = 0 ; level < terrain.levels ; ++level)
+    {
+        const int size = terrain.size[level];
+
+        for (row = 0 ; row < size ; ++row)
         {
-            GLfloat dx = center_x - map_vertices[0][ii];
-            GLfloat dz = center_z - map_vertices[2][ii];
-            GLfloat pd = (2.0f * sqrtf((dx * dx) + (dz * dz))) / circle_size;
-            if (fabs(pd) <= 1.0f)
+            for (col = 0 ; col < size ; ++col)
             {
-                /* tx,tz is within the circle */
-                GLfloat new_height = disp + (float) (cos(pd*3.14f)*disp);
-                map_vertices[1][ii] += new_height;
+                if (terrain.dirty[level][row * size + col])
+                {
+                    terrain_node_bounds(level, row, col);
+                    terrain.dirty[level][row * size + col] = GL_FALSE;
+                }
             }
         }
-        --num_iter;
     }
 }
 
+/* Upload the heights of the specified range of vertices to the texture
+ */
+static void upload_terrain(int first_row, int last_row, int first_col, int last_col)
+{
+    const int width = last_col - first_col + 1;
+    const int height = last_row - first_row + 1;
+
+    glBindTexture(GL_TEXTURE_2D, terrain.texture);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, map_num_vertices);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, first_col, first_row, width, height,
+                    GL_RED, GL_FLOAT,
+                    map_heights + (size_t) first_row * map_num_vertices + first_col);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+
+    map_bytes_uploaded += (double) sizeof(GLfloat) * width * height;
+}
+
+/* Create the height texture, the node grid and the quadtree of the terrain
+ * for the specified program object
+ */
+static int init_terrain(GLuint program)
+{
+    const int num_grid = (TERRAIN_CHUNK + 1) * (TERRAIN_CHUNK + 1);
+    GLubyte* vertices;
+    GLushort* indices;
+    GLuint attrloc;
+    int i, j, k, edge, level, quads, num_strips;
+
+    /* Add levels until a single node covers the map */
+    quads = map_num_vertices - 1;
+    for (level = 0 ; level < MAX_TERRAIN_LEVELS ; ++level)
+    {
+        const int extent = TERRAIN_CHUNK << level;
+
+        terrain.size[level] = (quads + extent - 1) / extent;
+        terrain.nodes[level] = malloc(sizeof(terrain_node) *
+                                      terrain.size[level] * terrain.size[level]);
+        terrain.dirty[level] = malloc(terrain.size[level] * terrain.size[level]);
+        if (!terrain.nodes[level] || !terrain.dirty[level])
+            return GL_FALSE;
+
+        memset(terrain.dirty[level], GL_TRUE, terrain.size[level] * terrain.size[level]);
+        terrain.levels = level + 1;
+
+        if (extent >= quads)
+            break;
+    }
+
+    refresh_terrain();
+
+    /* The grid of a node followed by the four skirts, as (column, row, skirt)
+     * with the skirt vertices below the edges of the node */
+    vertices = malloc(4 * (num_grid + 4 * (TERRAIN_CHUNK + 1)));
+    num_strips = grid_strip_index_count(TERRAIN_CHUNK + 1, TERRAIN_CHUNK + 1, GL_TRUE);
+    terrain.num_indices = num_strips + 4 * (1 + 2 * (TERRAIN_CHUNK + 1));
+    indices = malloc(sizeof(GLushort) * terrain.num_indices);
+    if (!vertices || !indices)
+    {
+        free(vertices);
+        free(indices);
+        return GL_FALSE;
+    }
+
+    k = 0;
+    for (i = 0 ; i <= TERRAIN_CHUNK ; ++i)
+    {
+        for (j = 0 ; j <= TERRAIN_CHUNK ; ++j)
+        {
+            vertices[k++] = (GLubyte) j;
+            vertices[k++] = (GLubyte) i;
+            vertices[k++] = 0;
+            vertices[k++] = 0;
+        }
+    }
+
+    for (edge = 0 ; edge < 4 ; ++edge)
+    {
+        for (i = 0 ; i <= TERRAIN_CHUNK ; ++i)
+        {
+            const int fixed = (edge & 1) ? TERRAIN_CHUNK : 0;
+            vertices[k++] = (GLubyte) ((edge & 2) ? i : fixed);
+            vertices[k++] = (GLubyte) ((edge & 2) ? fixed : i);
+            vertices[k++] = 1;
+            vertices[k++] = 0;
+        }
+    }
+
+    /* The grid is drawn as triangle strips split along the diagonal assumed
+     * by terrain_node_bounds, followed by one strip per skirt */
+    k = grid_strip_indices(indices, sizeof(GLushort),
+                           TERRAIN_CHUNK + 1, TERRAIN_CHUNK + 1, GL_TRUE);
+
+    for (edge = 0 ; edge < 4 ; ++edge)
+    {
+        const int fixed = (edge & 1) ? TERRAIN_CHUNK : 0;
+        const GLushort skirt = (GLushort) (num_grid + edge * (TERRAIN_CHUNK + 1));
+
+        indices[k++] = (GLushort) grid_restart_index(sizeof(GLushort));
+
+        for (i = 0 ; i <= TERRAIN_CHUNK ; ++i)
+        {
+            indices[k++] = (GLushort) ((edge & 2) ?
+                fixed * (TERRAIN_CHUNK + 1) + i : i * (TERRAIN_CHUNK + 1) + fixed);
+            indices[k++] = skirt + i;
+        }
+    }
+
+    glGenVertexArrays(1, &terrain.vao);
+    glGenBuffers(2, terrain.buffers);
+    glBindVertexArray(terrain.vao);
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, terrain.buffers[1]);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLushort) * terrain.num_indices,
+                 indices, GL_STATIC_DRAW);
+
+    attrloc = glGetAttribLocation(program, "grid");
+    glBindBuffer(GL_ARRAY_BUFFER, terrain.buffers[0]);
+    glBufferData(GL_ARRAY_BUFFER, 4 * (num_grid + 4 * (TERRAIN_CHUNK + 1)),
+                 vertices, GL_STATIC_DRAW);
+    glEnableVertexAttribArray(attrloc);
+    glVertexAttribPointer(attrloc, 3, GL_UNSIGNED_BYTE, GL_FALSE, 4, 0);
+
+    free(vertices);
+    free(indices);
+
+    /* The texture holds the heights of row i and column j at texel (j, i) */
+    glGenTextures(1, &terrain.texture);
+    glBindTexture(GL_TEXTURE_2D, terrain.texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, map_num_vertices, map_num_vertices, 0,
+                 GL_RED, GL_FLOAT, map_heights);
+    if (glGetError() != GL_NO_ERROR)
+        return GL_FALSE;
+
+    glUniform1i(glGetUniformLocation(program, "heights"), 0);
+    glUniform1f(glGetUniformLocation(program, "map_step"),
+                MAP_SIZE / (map_num_vertices - 1));
+    terrain.uloc_origin = glGetUniformLocation(program, "origin");
+    terrain.uloc_spacing = glGetUniformLocation(program, "spacing");
+    terrain.uloc_skirt = glGetUniformLocation(program, "skirt");
+
+    return GL_TRUE;
+}
+
+/* Derive the frustum planes, the position of the camera and the scale of the
+ * screen error from the matrices and the viewport height
+ */
+static void set_terrain_view(int viewport_height)
+{
+    const GLfloat* p = projection_matrix;
+    const GLfloat* m = modelview_matrix;
+    GLfloat mvp[16];
+    int i, j;
+
+    for (i = 0 ; i < 4 ; ++i)
+    {
+        for (j = 0 ; j < 4 ; ++j)
+        {
+            mvp[i * 4 + j] = p[j] * m[i * 4] + p[4 + j] * m[i * 4 + 1] +
+                             p[8 + j] * m[i * 4 + 2] + p[12 + j] * m[i * 4 + 3];
+        }
+    }
+
+    /* A point is inside if w +/- x, y or z is positive */
+    for (i = 0 ; i < 6 ; ++i)
+    {
+        const GLfloat sign = (i & 1) ? -1.0f : 1.0f;
+        for (j = 0 ; j < 4 ; ++j)
+            terrain.planes[i][j] = mvp[j * 4 + 3] + sign * mvp[j * 4 + i / 2];
+    }
+
+    /* The model view matrix is a rigid transform */
+    for (i = 0 ; i < 3 ; ++i)
+    {
+        terrain.camera[i] = -(m[i * 4] * m[12] + m[i * 4 + 1] * m[13] +
+                              m[i * 4 + 2] * m[14]);
+    }
+
+    terrain.pixels = p[5] * viewport_height / 2.0f;
+}
+
+/* Draw the specified node, or its children if it is not accurate enough
+ */
+static void draw_terrain__node(int level, int row, int col)
+{
+    const terrain_node* node = terrain.nodes[level] + row * terrain.size[level] + col;
+    const float step = MAP_SIZE / (map_num_vertices - 1);
+    const int extent = TERRAIN_CHUNK << level;
+    const int last = map_num_vertices - 1;
+    GLfloat low[3], high[3], skirt, distance = 0.0f, d;
+    int i, k;
+
+    /* The skirts need to reach the coarser neighbours */
+    skirt = 2.0f * (level + 1 < terrain.levels ?
+        terrain.nodes[level + 1][(row / 2) * terrain.size[level + 1] + col / 2].error :
+        node->error);
+
+    low[0] = row * extent * step;
+    low[1] = node->min_height - skirt;
+    low[2] = col * extent * step;
+    high[0] = (row * extent + extent < last ? row * extent + extent : last) * step;
+    high[1] = node->max_height;
+    high[2] = (col * extent + extent < last ? col * extent + extent : last) * step;
+
+    for (i = 0 ; i < 6 ; ++i)
+    {
+        const GLfloat* plane = terrain.planes[i];
+        if (plane[0] * (plane[0] > 0.0f ? high[0] : low[0]) +
+            plane[1] * (plane[1] > 0.0f ? high[1] : low[1]) +
+            plane[2] * (plane[2] > 0.0f ? high[2] : low[2]) + plane[3] < 0.0f)
+        {
+            return;
+        }
+    }
+
+    for (i = 0 ; i < 3 ; ++i)
+    {
+        d = fmaxf(fmaxf(low[i] - terrain.camera[i], terrain.camera[i] - high[i]), 0.0f);
+        distance += d * d;
+    }
+    distance = sqrtf(distance);
+
+    if (level > 0 && node->error * terrain.pixels > TERRAIN_PIXEL_ERROR * distance)
+    {
+        for (k = 0 ; k < 4 ; ++k)
+        {
+            const int child_row = row * 2 + k / 2, child_col = col * 2 + k % 2;
+
+            if (child_row < terrain.size[level - 1] && child_col < terrain.size[level - 1])
+                draw_terrain__node(level - 1, child_row, child_col);
+        }
+        return;
+    }
+
+    glUniform2i(terrain.uloc_origin, col * extent, row * extent);
+    glUniform1i(terrain.uloc_spacing, 1 << level);
+    glUniform1f(terrain.uloc_skirt, skirt);
+    glDrawElements(GL_TRIANGLE_STRIP, terrain.num_indices, GL_UNSIGNED_SHORT, 0);
+
+    terrain.nodes_drawn++;
+    terrain.triangles_drawn += 2 * TERRAIN_CHUNK * (TERRAIN_CHUNK + 4);
+}
+
+static void draw_terrain(void)
+{
+    glBindVertexArray(terrain.vao);
+    draw_terrain__node(terrain.levels - 1, 0, 0);
+}
+
+
 /**********************************************************************
  * OpenGL helper functions
  *********************************************************************/
@@ -338,42 +1054,197 @@ static void update_map(int num_iter)
 /* Create VBO, IBO and VAO objects for the heightmap geometry and bind them to
  * the specified program object
  */
-static void make_mesh(GLuint program)
+static int make_mesh(GLuint program)
 {
     GLuint attrloc;
+    GLfloat* coords;
+    int i, j, k;
+
+    /* The x and z coordinates of every vertex are expanded for the upload */
+    coords = malloc(sizeof(GLfloat) * map_num_total_vertices);
+    if (!coords)
+        return GL_FALSE;
 
     glGenVertexArrays(1, &mesh);
     glGenBuffers(4, mesh_vbo);
     glBindVertexArray(mesh);
     /* Prepare the data for drawing through a buffer inidices */
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh_vbo[3]);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint)* MAP_NUM_LINES * 2, map_line_indices, GL_STATIC_DRAW);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, (GLsizeiptr) map_index_size * map_num_indices, map_indices, GL_STATIC_DRAW);
 
     /* Prepare the attributes for rendering */
+    for (i = 0, k = 0 ; i < map_num_vertices ; ++i)
+    {
+        for (j = 0 ; j < map_num_vertices ; ++j)
+            coords[k++] = map_coords[i];
+    }
+
     attrloc = glGetAttribLocation(program, "x");
     glBindBuffer(GL_ARRAY_BUFFER, mesh_vbo[0]);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * MAP_NUM_TOTAL_VERTICES, &map_vertices[0][0], GL_STATIC_DRAW);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * map_num_total_vertices, coords, GL_STATIC_DRAW);
     glEnableVertexAttribArray(attrloc);
     glVertexAttribPointer(attrloc, 1, GL_FLOAT, GL_FALSE, 0, 0);
 
+    for (i = 0, k = 0 ; i < map_num_vertices ; ++i)
+    {
+        for (j = 0 ; j < map_num_vertices ; ++j)
+            coords[k++] = map_coords[j];
+    }
+
     attrloc = glGetAttribLocation(program, "z");
     glBindBuffer(GL_ARRAY_BUFFER, mesh_vbo[2]);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * MAP_NUM_TOTAL_VERTICES, &map_vertices[2][0], GL_STATIC_DRAW);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * map_num_total_vertices, coords, GL_STATIC_DRAW);
     glEnableVertexAttribArray(attrloc);
     glVertexAttribPointer(attrloc, 1, GL_FLOAT, GL_FALSE, 0, 0);
 
     attrloc = glGetAttribLocation(program, "y");
     glBindBuffer(GL_ARRAY_BUFFER, mesh_vbo[1]);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * MAP_NUM_TOTAL_VERTICES, &map_vertices[1][0], GL_DYNAMIC_DRAW);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * map_num_total_vertices, map_heights, GL_DYNAMIC_DRAW);
     glEnableVertexAttribArray(attrloc);
     glVertexAttribPointer(attrloc, 1, GL_FLOAT, GL_FALSE, 0, 0);
+
+    free(coords);
+    return GL_TRUE;
+}
+
+static int compare_spans(const void* a, const void* b)
+{
+    return ((const map_span*) a)->first_row - ((const map_span*) b)->first_row;
+}
+
+/* Upload the heights of the specified rows. Large ranges are written through
+ * a mapping that invalidates the range, so the driver does not have to keep
+ * the old contents around for draws still in flight or copy the data twice
+ */
+static void upload_rows(int first_row, int last_row)
+{
+    const GLintptr offset = sizeof(GLfloat) * (size_t) first_row * map_num_vertices;
+    const GLsizeiptr size = sizeof(GLfloat) * (size_t) (last_row - first_row + 1) *
+                            map_num_vertices;
+    const GLfloat* heights = map_heights + (size_t) first_row * map_num_vertices;
+    void* data;
+
+    if (size >= MAP_STREAM_THRESHOLD)
+    {
+        data = glMapBufferRange(GL_ARRAY_BUFFER, offset, size,
+                                GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+        if (data)
+        {
+            memcpy(data, heights, size);
+
+            /* The range is undefined if the mapping was lost, for example on
+             * a mode change, so it is uploaded again below */
+            if (glUnmapBuffer(GL_ARRAY_BUFFER))
+            {
+                map_bytes_uploaded += (double) size;
+                return;
+            }
+        }
+    }
+
+    glBufferSubData(GL_ARRAY_BUFFER, offset, size, heights);
+    map_bytes_uploaded += (double) size;
+}
+
+/* Upload the heights of the specified range. The lines need whole rows,
+ * while the terrain only needs the columns of the range
+ */
+static void upload_span(const map_span* span)
+{
+    if (draw_lines)
+        upload_rows(span->first_row, span->last_row);
+    else
+        upload_terrain(span->first_row, span->last_row, span->first_col, span->last_col);
 }
 
-/* Update VBO vertices from source data
+/* Update VBO vertices or the terrain from source data. Only the rows changed
+ * since the last update are uploaded, with overlapping and adjacent ranges
+ * merged
  */
 static void update_mesh(void)
 {
-    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(GLfloat) * MAP_NUM_TOTAL_VERTICES, &map_vertices[1][0]);
+    map_span merged;
+    int i;
+
+    if (map_dirty.count == 0)
+        return;
+
+    if (!draw_lines)
+    {
+        for (i = 0 ; i < map_dirty.count ; ++i)
+        {
+            const map_span* span = map_dirty.spans + i;
+            mark_terrain(span->first_row, span->last_row, span->first_col, span->last_col);
+        }
+
+        refresh_terrain();
+    }
+
+    qsort(map_dirty.spans, map_dirty.count, sizeof(map_span), compare_spans);
+
+    merged = map_dirty.spans[0];
+
+    for (i = 1 ; i < map_dirty.count ; ++i)
+    {
+        const map_span* span = map_dirty.spans + i;
+        if (span->first_row > merged.last_row + 1)
+        {
+            upload_span(&merged);
+            merged = *span;
+            continue;
+        }
+
+        if (span->last_row > merged.last_row)
+            merged.last_row = span->last_row;
+        if (span->first_col < merged.first_col)
+            merged.first_col = span->first_col;
+        if (span->last_col > merged.last_col)
+            merged.last_col = span->last_col;
+    }
+
+    upload_span(&merged);
+
+    map_dirty.count = 0;
+    ++map_uploads;
+}
+
+/**********************************************************************
+ * Command line and benchmarking functions
+ *********************************************************************/
+
+static void usage(void)
+{
+    printf("Usage: heightmap [-hl] [-b circles] [-j threads] [-n vertices]\n");
+    printf("Options:\n");
+    printf(" -b   Benchmark the generation of a map from the given number of circles\n");
+    printf(" -h   Display this help\n");
+    printf(" -j   Number of threads applying the circles (default is one per\n"
+           "      processor, maximum is %i)\n", MAX_MAP_THREADS);
+    printf(" -l   Draw every vertex of the map as lines instead of the terrain\n");
+    printf(" -n   Number of vertices along each side of the map (default is %i,\n"
+           "      maximum is %i)\n", DEFAULT_MAP_NUM_VERTICES, MAX_MAP_NUM_VERTICES);
+}
+
+/* Generate a map from the specified number of circles without a window and
+ * report the throughput
+ */
+static void benchmark(int circles)
+{
+    double start, elapsed, sum = 0.0;
+    int i;
+
+    start = get_time();
+    update_map(circles);
+    elapsed = get_time() - start;
+
+    /* Print a sum of the heights, so changes can be checked */
+    for (i = 0 ; i < map_num_total_vertices ; ++i)
+        sum += map_heights[i];
+
+    printf("%ix%i vertices, %i circles, %i threads\n",
+           map_num_vertices, map_num_vertices, circles, map_pool.count);
+    printf("%.3f s, %.4g circles/s, height sum %.9g\n",
+           elapsed, circles / elapsed, sum);
 }
 
 /**********************************************************************
@@ -399,16 +1270,76 @@ static void error_callback(int error, const char* description)
 int main(int argc, char** argv)
 {
     GLFWwindow* window;
-    int iter;
+    int ch, iter;
     double dt;
     double last_update_time;
     int frame;
     float f;
     GLint uloc_modelview;
     GLint uloc_project;
+    int circles = 0, frames = 0;
+    int width, height;
+    double start_time;
 
     GLuint shader_program;
 
+    map_threads = get_processor_count();
+    if (map_threads > MAX_MAP_THREADS)
+        map_threads = MAX_MAP_THREADS;
+
+    while ((ch = getopt(argc, argv, "b:hj:ln:")) != -1)
+    {
+        switch (ch)
+        {
+            case 'b':
+                circles = atoi(optarg);
+                break;
+            case 'h':
+                usage();
+                exit(EXIT_SUCCESS);
+            case 'j':
+                map_threads = atoi(optarg);
+                if (map_threads < 1 || map_threads > MAX_MAP_THREADS)
+                {
+                    usage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'l':
+                draw_lines = GL_TRUE;
+                break;
+            case 'n':
+                map_num_vertices = atoi(optarg);
+                if (map_num_vertices < 2 || map_num_vertices > MAX_MAP_NUM_VERTICES)
+                {
+                    usage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (!alloc_map(circles == 0 && draw_lines))
+    {
+        fprintf(stderr, "ERROR: Failed to allocate the map\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Without all of the workers the circles are applied by fewer threads */
+    work_pool_init(&map_pool, map_threads);
+
+    if (circles > 0)
+    {
+        init_map();
+        benchmark(circles);
+        work_pool_terminate(&map_pool);
+        free_map();
+        exit(EXIT_SUCCESS);
+    }
+
     glfwSetErrorCallback(error_callback);
 
     if (!glfwInit())
@@ -434,7 +1365,13 @@ int main(int argc, char** argv)
     gladLoadGLLoader((GLADloadproc) glfwGetProcAddress);
 
     /* Prepare opengl resources for rendering */
-    shader_program = make_shader_program(vertex_shader_text, fragment_shader_text);
+    if (draw_lines)
+        shader_program = make_shader_program(vertex_shader_text, fragment_shader_text);
+    else
+    {
+        shader_program = make_shader_program(terrain_vertex_shader_text,
+                                             terrain_fragment_shader_text);
+    }
 
     if (shader_program == 0u)
     {
@@ -463,7 +1400,15 @@ int main(int argc, char** argv)
 
     /* Create mesh data */
     init_map();
-    make_mesh(shader_program);
+    if (draw_lines ? !make_mesh(shader_program) : !init_terrain(shader_program))
+    {
+        fprintf(stderr, "ERROR: Failed to create the mesh\n");
+        glfwTerminate();
+        exit(EXIT_FAILURE);
+    }
+
+    glfwGetFramebufferSize(window, &width, &height);
+    set_terrain_view(height);
 
     /* Create vao + vbo to store the mesh */
     /* Create the vbo to store all the information for the grid and the height */
@@ -471,22 +1416,38 @@ int main(int argc, char** argv)
     /* setup the scene ready for rendering */
     glViewport(0, 0, 800, 600);
     glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+    if (draw_lines)
+        glPrimitiveRestartIndex(grid_restart_index(map_index_size));
+    else
+    {
+        glEnable(GL_DEPTH_TEST);
+        glPrimitiveRestartIndex(grid_restart_index(sizeof(GLushort)));
+    }
+    glEnable(GL_PRIMITIVE_RESTART);
 
     /* main loop */
     frame = 0;
     iter = 0;
     last_update_time = glfwGetTime();
+    start_time = last_update_time;
 
     while (!glfwWindowShouldClose(window))
     {
         ++frame;
         /* render the next frame */
-        glClear(GL_COLOR_BUFFER_BIT);
-        glDrawElements(GL_LINES, 2* MAP_NUM_LINES , GL_UNSIGNED_INT, 0);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        if (draw_lines)
+        {
+            glDrawElements(GL_LINE_STRIP, map_num_indices,
+                           map_index_size == 2 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT, 0);
+        }
+        else
+            draw_terrain();
 
         /* display and process events through callbacks */
         glfwSwapBuffers(window);
         glfwPollEvents();
+        ++frames;
         /* Check the frame rate and update the heightmap if needed */
         dt = glfwGetTime();
         if ((dt - last_update_time) > 0.2)
@@ -503,7 +1464,30 @@ int main(int argc, char** argv)
         }
     }
 
+    if (frames > 0)
+    {
+        printf("%i frames, %.3f ms average frame time\n",
+               frames, (glfwGetTime() - start_time) * 1000.0 / frames);
+    }
+
+    if (frames > 0 && !draw_lines)
+    {
+        printf("%i terrain levels, %.1f nodes and %.0f triangles drawn per frame\n",
+               terrain.levels, (double) terrain.nodes_drawn / frames,
+               terrain.triangles_drawn / frames);
+    }
+
+    if (map_uploads > 0)
+    {
+        printf("%i mesh updates, %.1f KB uploaded per update (%.2f%% of the map)\n",
+               map_uploads, map_bytes_uploaded / map_uploads / 1024.0,
+               100.0 * map_bytes_uploaded / map_uploads /
+               (sizeof(GLfloat) * (double) map_num_total_vertices));
+    }
+
+    work_pool_terminate(&map_pool);
     glfwTerminate();
+    free_map();
     exit(EXIT_SUCCESS);
 }
 
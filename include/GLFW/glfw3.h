@@ -638,6 +638,8 @@ extern "C" {
 #define GLFW_CURSOR                 0x00033001
 #define GLFW_STICKY_KEYS            0x00033002
 #define GLFW_STICKY_MOUSE_BUTTONS   0x00033003
+#define GLFW_EVENT_QUEUE            0x00033004
+#define GLFW_LATENCY_TRACKING       0x00033005
 
 #define GLFW_CURSOR_NORMAL          0x00034001
 #define GLFW_CURSOR_HIDDEN          0x00034002
@@ -686,6 +688,33 @@ extern "C" {
 #define GLFW_VRESIZE_CURSOR         0x00036006
 /*! @} */
 
+/*! @defgroup events Input event types
+ *
+ *  See [input event queue](@ref event_queue) for how these are used.
+ *
+ *  @ingroup input
+ *  @{ */
+
+/*! @brief A key was pressed, repeated or released.
+ */
+#define GLFW_KEY_EVENT              0x00037001
+/*! @brief A Unicode character was input.
+ */
+#define GLFW_CHAR_EVENT             0x00037002
+/*! @brief A mouse button was pressed or released.
+ */
+#define GLFW_MOUSE_BUTTON_EVENT     0x00037003
+/*! @brief The cursor was moved.
+ */
+#define GLFW_CURSOR_POS_EVENT       0x00037004
+/*! @brief The cursor entered or left the client area.
+ */
+#define GLFW_CURSOR_ENTER_EVENT     0x00037005
+/*! @brief The user scrolled.
+ */
+#define GLFW_SCROLL_EVENT           0x00037006
+/*! @} */
+
 #define GLFW_CONNECTED              0x00040001
 #define GLFW_DISCONNECTED           0x00040002
 
@@ -1041,6 +1070,52 @@ typedef struct GLFWimage
     unsigned char* pixels;
 } GLFWimage;
 
+/*! @brief Input event.
+ *
+ *  This describes a single input event, as returned by @ref glfwGetEvents.
+ *  Only the members listed for the type of the event are set, and they have
+ *  the same meaning as the arguments of the corresponding callback.
+ *
+ *  @sa @ref event_queue
+ *
+ *  @ingroup input
+ */
+typedef struct GLFWevent
+{
+    /*! The [type](@ref events) of this event.
+     */
+    int type;
+    /*! The time, in seconds, when the platform generated this event, on the
+     *  same timer as @ref glfwGetTime.  Where the platform provides no usable
+     *  timestamp, this is the time GLFW processed the event.  The times of
+     *  queued events never decrease.
+     */
+    double time;
+    /*! The [frame](@ref glfwGetFrameId) this event was processed for.
+     */
+    unsigned int frame;
+    /*! The key of a key event or the mouse button of a mouse button event.
+     */
+    int key;
+    /*! The scancode of a key event.
+     */
+    int scancode;
+    /*! The action of a key or mouse button event, or `GL_TRUE` if the cursor
+     *  entered the client area and `GL_FALSE` if it left it.
+     */
+    int action;
+    /*! The modifier keys of a key, character or mouse button event.
+     */
+    int mods;
+    /*! The Unicode code point of a character event.
+     */
+    unsigned int codepoint;
+    /*! The cursor position of a cursor position event or the scroll offset of
+     *  a scroll event.
+     */
+    double x, y;
+} GLFWevent;
+
 
 /*************************************************************************
  * GLFW API functions
@@ -2387,12 +2462,13 @@ GLFWAPI void glfwPostEmptyEvent(void);
 /*! @brief Returns the value of an input option for the specified window.
  *
  *  This function returns the value of an input option for the specified window.
- *  The mode must be one of `GLFW_CURSOR`, `GLFW_STICKY_KEYS` or
- *  `GLFW_STICKY_MOUSE_BUTTONS`.
+ *  The mode must be one of `GLFW_CURSOR`, `GLFW_STICKY_KEYS`,
+ *  `GLFW_STICKY_MOUSE_BUTTONS`, `GLFW_EVENT_QUEUE` or `GLFW_LATENCY_TRACKING`.
  *
  *  @param[in] window The window to query.
- *  @param[in] mode One of `GLFW_CURSOR`, `GLFW_STICKY_KEYS` or
- *  `GLFW_STICKY_MOUSE_BUTTONS`.
+ *  @param[in] mode One of `GLFW_CURSOR`, `GLFW_STICKY_KEYS`,
+ *  `GLFW_STICKY_MOUSE_BUTTONS`, `GLFW_EVENT_QUEUE` or
+ *  `GLFW_LATENCY_TRACKING`.
  *
  *  @par Thread Safety
  *  This function may only be called from the main thread.
@@ -2408,8 +2484,8 @@ GLFWAPI int glfwGetInputMode(GLFWwindow* window, int mode);
 /*! @brief Sets an input option for the specified window.
  *
  *  This function sets an input mode option for the specified window.  The mode
- *  must be one of `GLFW_CURSOR`, `GLFW_STICKY_KEYS` or
- *  `GLFW_STICKY_MOUSE_BUTTONS`.
+ *  must be one of `GLFW_CURSOR`, `GLFW_STICKY_KEYS`,
+ *  `GLFW_STICKY_MOUSE_BUTTONS`, `GLFW_EVENT_QUEUE` or `GLFW_LATENCY_TRACKING`.
  *
  *  If the mode is `GLFW_CURSOR`, the value must be one of the following cursor
  *  modes:
@@ -2435,9 +2511,21 @@ GLFWAPI int glfwGetInputMode(GLFWwindow* window, int mode);
  *  are only interested in whether mouse buttons have been pressed but not when
  *  or in which order.
  *
+ *  If the mode is `GLFW_EVENT_QUEUE`, the value must be either `GL_TRUE` to
+ *  enable the input event queue, or `GL_FALSE` to disable it.  If the event
+ *  queue is enabled, every input event is also added, with the time it was
+ *  processed, to a queue that can be read with @ref glfwGetEvents.  This is
+ *  useful when you need the order and timing of input within a frame.
+ *
+ *  If the mode is `GLFW_LATENCY_TRACKING`, the value must be either `GL_TRUE`
+ *  to enable input latency tracking, or `GL_FALSE` to disable it.  If latency
+ *  tracking is enabled, the time from the first input of every frame to its
+ *  presentation is measured, see @ref glfwGetFrameLatency.
+ *
  *  @param[in] window The window whose input mode to set.
- *  @param[in] mode One of `GLFW_CURSOR`, `GLFW_STICKY_KEYS` or
- *  `GLFW_STICKY_MOUSE_BUTTONS`.
+ *  @param[in] mode One of `GLFW_CURSOR`, `GLFW_STICKY_KEYS`,
+ *  `GLFW_STICKY_MOUSE_BUTTONS`, `GLFW_EVENT_QUEUE` or
+ *  `GLFW_LATENCY_TRACKING`.
  *  @param[in] value The new value of the specified input mode.
  *
  *  @par Thread Safety
@@ -2952,6 +3040,106 @@ GLFWAPI GLFWscrollfun glfwSetScrollCallback(GLFWwindow* window, GLFWscrollfun cb
  */
 GLFWAPI GLFWdropfun glfwSetDropCallback(GLFWwindow* window, GLFWdropfun cbfun);
 
+/*! @brief Retrieves queued input events for the specified window.
+ *
+ *  This function removes up to the specified number of events from the input
+ *  event queue of the specified window, oldest first, and copies them to the
+ *  specified array.  Events are only queued while the `GLFW_EVENT_QUEUE`
+ *  [input mode](@ref glfwSetInputMode) is enabled.
+ *
+ *  Events are added to the queue while events are processed, alongside any
+ *  callbacks being called.  If the queue is full, new events are discarded
+ *  until events have been retrieved, so this function should be called at
+ *  least once per frame.
+ *
+ *  @param[in] window The window whose events to retrieve.
+ *  @param[out] events The array to copy the events to.
+ *  @param[in] count The maximum number of events to retrieve.
+ *  @return The number of events retrieved, or zero if no events were queued
+ *  or the library had not been [initialized](@ref intro_init).
+ *
+ *  @par Thread Safety
+ *  This function may be called from any thread, but only from one thread at
+ *  a time for a given window.  It does not block event processing on the main
+ *  thread.  The window must not be destroyed while this function is running.
+ *
+ *  @sa @ref event_queue
+ *  @sa glfwSetInputMode
+ *
+ *  @ingroup input
+ */
+GLFWAPI int glfwGetEvents(GLFWwindow* window, GLFWevent* events, int count);
+
+/*! @brief Returns the identifier of the frame currently being built.
+ *
+ *  This function returns the identifier of the frame that the next call to
+ *  @ref glfwSwapBuffers for the specified window will present.  Input
+ *  processed now is attributed to this frame.  The identifier is incremented
+ *  by every buffer swap.
+ *
+ *  @param[in] window The window to query.
+ *  @return The identifier of the current frame, or zero if the library had not
+ *  been [initialized](@ref intro_init).
+ *
+ *  @par Thread Safety
+ *  This function may only be called from the main thread.
+ *
+ *  @sa @ref input_latency
+ *  @sa glfwGetFrameLatency
+ *
+ *  @ingroup input
+ */
+GLFWAPI unsigned int glfwGetFrameId(GLFWwindow* window);
+
+/*! @brief Returns the input latency of the specified frame.
+ *
+ *  This function returns the time, in seconds, from the first input event
+ *  processed for the specified frame to the presentation of that frame.  Only
+ *  the most recent frames are kept, and only while the `GLFW_LATENCY_TRACKING`
+ *  [input mode](@ref glfwSetInputMode) is enabled.
+ *
+ *  @param[in] window The window to query.
+ *  @param[in] frame The [frame](@ref glfwGetFrameId) to query.
+ *  @return The input latency of the frame, in seconds, or a negative value if
+ *  the frame had no input, has not been presented yet, is no longer kept or
+ *  the library had not been [initialized](@ref intro_init).
+ *
+ *  @par Thread Safety
+ *  This function may only be called from the main thread.
+ *
+ *  @sa @ref input_latency
+ *  @sa glfwGetLatencyHistogram
+ *
+ *  @ingroup input
+ */
+GLFWAPI double glfwGetFrameLatency(GLFWwindow* window, unsigned int frame);
+
+/*! @brief Returns the input latency histogram of the specified window.
+ *
+ *  This function returns the number of presented frames with input for each
+ *  whole number of milliseconds of [input latency](@ref glfwGetFrameLatency),
+ *  since latency tracking was enabled.  The last element counts every frame
+ *  with at least that latency.
+ *
+ *  @param[in] window The window to query.
+ *  @param[out] count Where to store the number of elements in the returned
+ *  array.
+ *  @return An array of frame counts, or `NULL` if the library had not been
+ *  [initialized](@ref intro_init).
+ *
+ *  @par Pointer Lifetime
+ *  The returned array is allocated and freed by GLFW.  You should not free it
+ *  yourself.  It is valid until the specified window is destroyed.
+ *
+ *  @par Thread Safety
+ *  This function may only be called from the main thread.
+ *
+ *  @sa @ref input_latency
+ *
+ *  @ingroup input
+ */
+GLFWAPI const unsigned int* glfwGetLatencyHistogram(GLFWwindow* window, int* count);
+
 /*! @brief Returns whether the specified joystick is present.
  *
  *  This function returns whether the specified joystick is present.
@@ -32,15 +32,40 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
 #include <math.h>
 #include <time.h>
+#include <stdint.h>
+#include <inttypes.h>
 
 #include <tinycthread.h>
+#include <workpool.h>
 #include <getopt.h>
 #include <linmath.h>
+#include <rng.h>
 
+// Building with PARTICLES_BENCH defined gives particles_bench, a headless
+// benchmark of the CPU simulation. It does not link against GLFW or OpenGL,
+// only their headers are used for the GL types.
+#define GLFW_INCLUDE_GLEXT
 #include <GLFW/glfw3.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+ // Enable the runtime-dispatched AVX and AVX-512 particle integrators
+ #define PARTICLES_X86_DISPATCH
+ #include <immintrin.h>
+#endif
+
+// Never fuse a multiplication and an addition into one FMA instruction. The
+// compiler only does so where FMA is enabled, which differs between the
+// integrators and with the compiler flags, and an FMA rounds only once, so the
+// particle state and its checksum would depend on both
+#if defined(__clang__)
+ #pragma STDC FP_CONTRACT OFF
+#elif defined(__GNUC__)
+ #pragma GCC optimize ("fp-contract=off")
+#endif
+
 // Define tokens for GL_EXT_separate_specular_color if not already defined
 #ifndef GL_EXT_separate_specular_color
 #define GL_LIGHT_MODEL_COLOR_CONTROL_EXT  0x81F8
@@ -48,7 +73,6 @@
 #define GL_SEPARATE_SPECULAR_COLOR_EXT    0x81FA
 #endif // GL_EXT_separate_specular_color
 
-
 //========================================================================
 // Type definitions
 //========================================================================
@@ -72,6 +96,33 @@ typedef struct
     GLfloat x, y, z;      // Vertex coordinates
 } Vertex;
 
+// This structure holds the state of a single particle as seen by the draw
+// thread
+typedef struct
+{
+    GLfloat x, y, z;      // Position in space
+    GLuint  rgba;         // Color and intensity (four ubytes packed into an uint)
+} Sprite;
+
+// A set of particles published by the physics thread
+typedef struct
+{
+    Sprite* sprites;
+    int     count;
+    float   glow_color[4];
+    float   glow_pos[4];
+} DrawBuffer;
+
+// A futex-style wait queue, used for waiting on an atomic value to change.
+// The condition variable is only used when spinning for a while did not help
+// and is only signalled when someone is actually sleeping on it.
+typedef struct
+{
+    mtx_t     lock;
+    cnd_t     changed;
+    int       sleepers;
+} Futex;
+
 
 //========================================================================
 // Program control global variables
@@ -83,17 +134,42 @@ float aspect_ratio;
 // "wireframe" flag (true if we use wireframe view)
 int wireframe;
 
-// Thread synchronization
+// Particle transparency mode
+#define TRANSPARENCY_ADDITIVE 0  // Additive blending in any order
+#define TRANSPARENCY_SORTED   1  // Alpha blending, sorted back to front
+#define TRANSPARENCY_WEIGHTED 2  // Weighted blended order-independent
+int transparency = TRANSPARENCY_ADDITIVE;
+
+// "fluid" flag (true if nearby particles push each other apart)
+int fluid;
+
+// Camera matrices of the current frame
+mat4x4 projection, modelview;
+
+// Thread synchronization. The frame numbers and the quit flag are only
+// accessed atomically.
 struct {
     double    t;         // Time (s)
     float     dt;        // Time since last frame (s)
     int       p_frame;   // Particle physics frame number
     int       d_frame;   // Particle draw frame number
-    cnd_t     p_done;    // Condition: particle physics done
-    cnd_t     d_done;    // Condition: particle draw done
-    mtx_t     particles_lock; // Particles data sharing mutex
+    int       quit;      // Tells the physics thread to exit
+    float     view_depth[4]; // Row of the view matrix of the last drawn frame
+                             // that gives view space depth, for sorting
+    Futex     frame_changed; // Wait queue for frame number changes
 } thread_sync;
 
+// Triple buffered particles for drawing. The physics thread fills the back
+// buffer while the draw thread reads the front buffer, and the latest
+// complete buffer is handed over through an atomic exchange of the ready
+// index, so neither thread ever holds a lock while using its buffer.
+#define DRAW_BUFFER_FRESH 4  // Set in the ready index until it is taken
+
+DrawBuffer draw_buffers[3];
+int draw_buffer_front = 0;
+int draw_buffer_back = 1;
+int draw_buffer_ready = 2;
+
 
 //========================================================================
 // Texture declarations (we hard-code them into the source code, since
@@ -146,15 +222,18 @@ const unsigned char floor_texture[ F_TEX_WIDTH * F_TEX_HEIGHT ] = {
 // modular world, these values should be variables...
 //========================================================================
 
-// Maximum number of particles
-#define MAX_PARTICLES   3000
+// Maximum number of particles (the actual number is selected at runtime)
+#define MAX_PARTICLES   (16 * 1024 * 1024)
+
+// Default number of particles
+#define DEFAULT_PARTICLES 3000
+
+// Default number of steps measured by the headless benchmark
+#define DEFAULT_BENCH_STEPS 600
 
 // Life span of a particle (in seconds)
 #define LIFE_SPAN       8.f
 
-// A new particle is born every [BIRTH_INTERVAL] second
-#define BIRTH_INTERVAL (LIFE_SPAN/(float)MAX_PARTICLES)
-
 // Particle size (meters)
 #define PARTICLE_SIZE   0.7f
 
@@ -173,26 +252,82 @@ const unsigned char floor_texture[ F_TEX_WIDTH * F_TEX_HEIGHT ] = {
 // Fountain radius (m)
 #define FOUNTAIN_RADIUS 1.6f
 
-// Minimum delta-time for particle phisics (s)
-#define MIN_DELTA_T     (BIRTH_INTERVAL * 0.5f)
+// Minimum delta-time for particle phisics (s). This is fixed to half the
+// birth interval of the default system, so that larger systems give birth to
+// several particles per step instead of taking ever smaller steps.
+#define MIN_DELTA_T     (LIFE_SPAN / (float) DEFAULT_PARTICLES * 0.5f)
+
+// Particle arrays are padded to a multiple of this many elements, so that the
+// SIMD integrators can always process whole vectors
+#define PARTICLE_PADDING 16
+
+// Number of particles updated by each job of the physics worker pool (must be
+// a multiple of PARTICLE_PADDING)
+#define PARTICLE_CHUNK  16384
+
+// Number of new-born particles initialized by each job of the worker pool
+#define BIRTH_CHUNK     256
+
+// Interaction radius of particles in fluid mode (m), which is also the cell
+// size of the spatial hash grid
+#define FLUID_RADIUS    0.5f
+
+// Rest density of the fluid (in units of the density sum, where a neighbour
+// at the very same spot counts as one)
+#define FLUID_DENSITY   2.f
+
+// Pressure per density difference and near pressure per near density of the
+// fluid (m/s^2)
+#define FLUID_STIFFNESS      20.f
+#define FLUID_NEAR_STIFFNESS 80.f
+
+// Maximum acceleration of a particle by its neighbours (m/s^2)
+#define FLUID_MAX_ACCELERATION 50.f
 
 
 //========================================================================
 // Particle system global variables
 //========================================================================
 
-// This structure holds all state for a single particle
-typedef struct {
-    float x,y,z;     // Position in space
-    float vx,vy,vz;  // Velocity vector
-    float r,g,b;     // Color of particle
-    float life;      // Life of particle (1.0 = newborn, < 0.0 = dead)
-    int   active;    // Tells if this particle is active
-} PARTICLE;
-
-// Global vectors holding all particles. We use two vectors for double
-// buffering.
-static PARTICLE particles[MAX_PARTICLES];
+// This structure holds all particle state as a structure of arrays, which
+// lets the integrator update several particles with each instruction. A
+// particle is active while its life is above zero. Active particles are kept
+// packed at the start of the arrays, so all particles at or beyond the live
+// count are dead and giving birth is just a matter of bumping the count.
+static struct {
+    float* x;  float* y;  float* z;   // Position in space
+    float* vx; float* vy; float* vz;  // Velocity vector
+    float* r;  float* g;  float* b;   // Color of particle
+    float* life;     // Life of particle (1.0 = newborn, <= 0.0 = dead)
+    int    capacity; // Number of particles in the system
+    int    live;     // Number of active particles
+} particles;
+
+// A new particle is born every [birth_interval] second
+static float birth_interval;
+
+// Per-step scratch data shared with the physics worker pool
+static int*   dead_particles; // Dead particle indices, by chunk
+static int*   dead_counts;    // Number of dead particles in each chunk
+
+// Parameters of the current physics step. The particle born as number j of
+// the step has serial number serial + j and is birth_start - (j + 1) *
+// birth_interval seconds old at the end of the step.
+static struct {
+    double   t;          // Time of the step (s)
+    float    dt;         // Length of the step (s)
+    int      first;      // Index of the first particle born in this step
+    int      births;     // Number of particles born in this step
+    uint64_t serial;     // Serial number of the first particle born in this step
+    float    birth_start; // Birth clock before the births of this step (s)
+} step;
+
+// Random number seed and serial number of the next particle to be born
+static uint32_t random_seed;
+static uint64_t birth_serial;
+
+// Total number of particle updates and births, used for benchmarking
+static double particle_updates, particle_births;
 
 // Global variable holding the age of the youngest particle
 static float min_age;
@@ -221,167 +356,2247 @@ const GLfloat fog_color[4]         = { 0.1f, 0.1f, 0.1f, 1.f };
 // Print usage information
 //========================================================================
 
+#if defined(PARTICLES_BENCH)
+
+static void usage(void)
+{
+    printf("Usage: particles_bench [-hw] [-d dt] [-e checksum] [-i integrator]\n"
+           "                       [-j threads] [-n count] [-r seed] [-s steps]\n"
+           "                       [-t mode]\n");
+    printf("Options:\n");
+    printf(" -d   Length of each step (default is 1/60 s)\n");
+    printf(" -e   Exit with failure unless the final state has the given checksum\n");
+    printf(" -h   Display this help\n");
+    printf(" -i   Particle integrator: c, avx or avx512 (default is the one measured\n"
+           "      to be fastest at startup)\n");
+    printf(" -j   Number of physics threads (default is one per processor)\n");
+    printf(" -n   Number of particles (default is %i, maximum is %i)\n",
+           DEFAULT_PARTICLES, MAX_PARTICLES);
+    printf(" -r   Random number seed (default is 0)\n");
+    printf(" -s   Number of steps to measure after filling up the system (default\n"
+           "      is %i)\n", DEFAULT_BENCH_STEPS);
+    printf(" -t   Particle transparency: add (the default) or sort (also depth sort\n"
+           "      the particles after each step)\n");
+    printf(" -w   Simulate the particles as a fluid\n");
+}
+
+#else
+
 static void usage(void)
 {
-    printf("Usage: particles [-bfhs]\n");
+    printf("Usage: particles [-fghlw] [-j threads] [-n count] [-t mode] [-b frames]\n"
+           "                 [-c frames]\n");
     printf("Options:\n");
+    printf(" -b   Benchmark the particle engine for the given number of frames\n");
+    printf(" -c   Check the GPU simulation against the CPU one after the given\n"
+           "      number of frames\n");
     printf(" -f   Run in full screen\n");
+    printf(" -g   Simulate the particles on the GPU\n");
     printf(" -h   Display this help\n");
-    printf(" -s   Run program as single thread (default is to use two threads)\n");
+    printf(" -j   Number of physics threads (default is one per processor)\n");
+    printf(" -l   Use the legacy vertex array particle renderer\n");
+    printf(" -n   Number of particles (default is %i, maximum is %i)\n",
+           DEFAULT_PARTICLES, MAX_PARTICLES);
+    printf(" -t   Particle transparency: add (additive, the default), sort (alpha\n"
+           "      blended back to front) or oit (weighted blended order-independent)\n");
+    printf(" -w   Simulate the particles as a fluid, where nearby particles push\n"
+           "      each other apart\n");
     printf("\n");
     printf("Program runtime controls:\n");
     printf(" W    Toggle wireframe mode\n");
     printf(" Esc  Exit program\n");
 }
 
+#endif // PARTICLES_BENCH
+
+
+#if !defined(PARTICLES_BENCH)
+
+//========================================================================
+// Futex-style waiting for an atomic value to change
+//========================================================================
+
+#define FUTEX_SPIN_COUNT 1000
+
+static void init_futex(Futex* futex)
+{
+    mtx_init(&futex->lock, mtx_plain);
+    cnd_init(&futex->changed);
+    futex->sleepers = 0;
+}
+
+// Wait until the value no longer equals the expected value
+static void futex_wait(Futex* futex, int* value, int expected)
+{
+    int i;
+
+    // The other thread is usually only a moment away, so spin for a while
+    // before going to sleep
+    for (i = 0;  i < FUTEX_SPIN_COUNT;  i++)
+    {
+        if (atomic_load_int(value) != expected)
+            return;
+    }
+
+    mtx_lock(&futex->lock);
+    atomic_add_int(&futex->sleepers, 1);
+
+    while (atomic_load_int(value) == expected)
+        cnd_wait(&futex->changed, &futex->lock);
+
+    atomic_add_int(&futex->sleepers, -1);
+    mtx_unlock(&futex->lock);
+}
+
+// Wake all waiters after changing a value. Either the waker sees the waiter
+// counted as a sleeper or the waiter sees the new value, so no wake-up can be
+// lost.
+static void futex_wake(Futex* futex)
+{
+    if (atomic_load_int(&futex->sleepers) > 0)
+    {
+        mtx_lock(&futex->lock);
+        cnd_broadcast(&futex->changed);
+        mtx_unlock(&futex->lock);
+    }
+}
+
+#endif // PARTICLES_BENCH
+
+
+//========================================================================
+// Allocate the particle arrays for the specified number of particles
+//========================================================================
+
+static int init_particles(int count)
+{
+    float** arrays[10];
+    size_t size;
+    int i;
+
+    arrays[0] = &particles.x;
+    arrays[1] = &particles.y;
+    arrays[2] = &particles.z;
+    arrays[3] = &particles.vx;
+    arrays[4] = &particles.vy;
+    arrays[5] = &particles.vz;
+    arrays[6] = &particles.r;
+    arrays[7] = &particles.g;
+    arrays[8] = &particles.b;
+    arrays[9] = &particles.life;
+
+    // Pad the arrays so that vectors may extend past the last particle. The
+    // padding is zeroed, i.e. it holds only dead particles.
+    size = ((count + PARTICLE_PADDING - 1) / PARTICLE_PADDING) *
+           PARTICLE_PADDING * sizeof(float);
+
+    for (i = 0;  i < 10;  i++)
+    {
+        *arrays[i] = calloc(1, size);
+        if (!*arrays[i])
+            return GL_FALSE;
+    }
+
+    dead_particles = calloc(count, sizeof(int));
+    dead_counts = calloc((count + PARTICLE_CHUNK - 1) / PARTICLE_CHUNK,
+                         sizeof(int));
+    if (!dead_particles || !dead_counts)
+        return GL_FALSE;
+
+    particles.capacity = count;
+    particles.live = 0;
+
+    birth_interval = LIFE_SPAN / (float) count;
+    return GL_TRUE;
+}
+
+
+//========================================================================
+// Color of a particle born at the specified time (it is time-varying)
+//========================================================================
+
+static void birth_color(double t, float* r, float* g, float* b)
+{
+    *r = 0.7f + 0.3f * (float) sin(0.34 * t + 0.1);
+    *g = 0.6f + 0.4f * (float) sin(0.63 * t + 1.1);
+    *b = 0.6f + 0.4f * (float) sin(0.91 * t + 2.1);
+}
+
 
 //========================================================================
 // Initialize a new particle
 //========================================================================
 
-static void init_particle(PARTICLE *p, double t)
+static void init_particle(int i, double t, uint32_t serial)
 {
     float xy_angle, velocity;
+    uint32_t r0, r1;
+    rng_stream rng;
+
+    // Each particle draws from its own random number stream, so its random
+    // numbers only depend on the seed and its serial number. This way they
+    // do not depend on which thread gives birth to it, and the GPU
+    // simulation generates exactly the same numbers.
+    rng_stream_init(&rng, random_seed, serial);
+    r0 = rng_next_u32(&rng);
+    r1 = rng_next_u32(&rng);
 
     // Start position of particle is at the fountain blow-out
-    p->x = 0.f;
-    p->y = 0.f;
-    p->z = FOUNTAIN_HEIGHT;
+    particles.x[i] = 0.f;
+    particles.y[i] = 0.f;
+    particles.z[i] = FOUNTAIN_HEIGHT;
 
     // Start velocity is up (Z)...
-    p->vz = 0.7f + (0.3f / 4096.f) * (float) (rand() & 4095);
+    particles.vz[i] = 0.7f + (0.3f / 4096.f) * (float) (r0 & 4095);
 
     // ...and a randomly chosen X/Y direction
-    xy_angle = (2.f * (float) M_PI / 4096.f) * (float) (rand() & 4095);
-    p->vx = 0.4f * (float) cos(xy_angle);
-    p->vy = 0.4f * (float) sin(xy_angle);
+    xy_angle = (2.f * (float) M_PI / 4096.f) * (float) (r1 & 4095);
+    particles.vx[i] = 0.4f * (float) cos(xy_angle);
+    particles.vy[i] = 0.4f * (float) sin(xy_angle);
 
     // Scale velocity vector according to a time-varying velocity
     velocity = VELOCITY * (0.8f + 0.1f * (float) (sin(0.5 * t) + sin(1.31 * t)));
-    p->vx *= velocity;
-    p->vy *= velocity;
-    p->vz *= velocity;
+    particles.vx[i] *= velocity;
+    particles.vy[i] *= velocity;
+    particles.vz[i] *= velocity;
+
+    birth_color(t, &particles.r[i], &particles.g[i], &particles.b[i]);
+
+    // The particle is new-born and active
+    particles.life[i] = 1.f;
+}
+
 
-    // Color is time-varying
-    p->r = 0.7f + 0.3f * (float) sin(0.34 * t + 0.1);
-    p->g = 0.6f + 0.4f * (float) sin(0.63 * t + 1.1);
-    p->b = 0.6f + 0.4f * (float) sin(0.91 * t + 2.1);
+//========================================================================
+// Set up fountain glow lighting from the latest born particle, born at the
+// specified time
+//========================================================================
 
-    // Store settings for fountain glow lighting
+static void set_glow(double t)
+{
     glow_pos[0] = 0.4f * (float) sin(1.34 * t);
     glow_pos[1] = 0.4f * (float) sin(3.11 * t);
     glow_pos[2] = FOUNTAIN_HEIGHT + 1.f;
     glow_pos[3] = 1.f;
-    glow_color[0] = p->r;
-    glow_color[1] = p->g;
-    glow_color[2] = p->b;
+    birth_color(t, &glow_color[0], &glow_color[1], &glow_color[2]);
     glow_color[3] = 1.f;
+}
 
-    // The particle is new-born and active
-    p->life = 1.f;
-    p->active = 1;
+
+//========================================================================
+// Advance the birth clock by one step and schedule the births of the step.
+// Births that do not fit in the system are skipped, but still use up their
+// serial numbers, so the following particles are the same regardless.
+//========================================================================
+
+static void schedule_births(float dt, int room)
+{
+    int count;
+
+    min_age += dt;
+    count = (int) (min_age / birth_interval);
+
+    step.birth_start = min_age;
+    step.serial = birth_serial;
+    step.births = count < room ? count : room;
+
+    min_age -= (float) count * birth_interval;
+    birth_serial += count;
+}
+
+// Age at the end of the step of a particle born in this step
+static float birth_age(int j)
+{
+    return step.birth_start - (float) (j + 1) * birth_interval;
 }
 
 
 //========================================================================
-// Update a particle
+// Update a range of particles
+//
+// The integrators below are all branch-free: gravity, integration and both
+// bounces are computed for every particle and the results are then selected
+// with masks. A dead particle keeps its state, apart from its life which just
+// becomes more negative.
 //========================================================================
 
 #define FOUNTAIN_R2 (FOUNTAIN_RADIUS+PARTICLE_SIZE/2)*(FOUNTAIN_RADIUS+PARTICLE_SIZE/2)
+#define FOUNTAIN_TOP (FOUNTAIN_HEIGHT + PARTICLE_SIZE / 2)
+#define FLOOR_TOP (PARTICLE_SIZE / 2)
 
-static void update_particle(PARTICLE *p, float dt)
+static void integrate_particles_c(int first, int last, float dt)
 {
-    // If the particle is not active, we need not do anything
-    if (!p->active)
-        return;
+    int i;
+
+    for (i = first;  i < last;  i++)
+    {
+        float x, y, z, vz, life, plane;
+        int active, falling, on_fountain, on_floor, bounce;
+
+        // The particle is getting older...
+        life = particles.life[i] - dt * (1.f / LIFE_SPAN);
+        active = life > 0.f;
+
+        // Apply gravity and update particle position
+        vz = particles.vz[i] - GRAVITY * dt;
+        x = particles.x[i] + particles.vx[i] * dt;
+        y = particles.y[i] + particles.vy[i] * dt;
+        z = particles.z[i] + vz * dt;
+
+        // Particles should bounce on the fountain or else on the floor (with
+        // friction)
+        falling = vz < 0.f;
+        on_fountain = falling & (x * x + y * y < FOUNTAIN_R2) & (z < FOUNTAIN_TOP);
+        on_floor = falling & !on_fountain & (z < FLOOR_TOP);
+        bounce = on_fountain | on_floor;
+        plane = on_fountain ? FOUNTAIN_TOP : FLOOR_TOP;
+
+        vz = bounce ? -FRICTION * vz : vz;
+        z = bounce ? plane + FRICTION * (plane - z) : z;
+
+        particles.life[i] = life;
+        particles.x[i] = active ? x : particles.x[i];
+        particles.y[i] = active ? y : particles.y[i];
+        particles.z[i] = active ? z : particles.z[i];
+        particles.vz[i] = active ? vz : particles.vz[i];
+    }
+}
+
+#if defined(PARTICLES_X86_DISPATCH)
 
-    // The particle is getting older...
-    p->life -= dt * (1.f / LIFE_SPAN);
+__attribute__((target("avx")))
+static void integrate_particles_avx(int first, int last, float dt)
+{
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 step = _mm256_set1_ps(dt);
+    const __m256 aging = _mm256_set1_ps(dt * (1.f / LIFE_SPAN));
+    const __m256 gravity = _mm256_set1_ps(GRAVITY * dt);
+    const __m256 friction = _mm256_set1_ps(FRICTION);
+    const __m256 neg_friction = _mm256_set1_ps(-FRICTION);
+    const __m256 fountain_r2 = _mm256_set1_ps(FOUNTAIN_R2);
+    const __m256 fountain_top = _mm256_set1_ps(FOUNTAIN_TOP);
+    const __m256 floor_top = _mm256_set1_ps(FLOOR_TOP);
+    int i;
 
-    // Did the particle die?
-    if (p->life <= 0.f)
+    for (i = first;  i < last;  i += 8)
     {
-        p->active = 0;
-        return;
+        __m256 x, y, z, vz, life, plane, active;
+        __m256 falling, on_fountain, on_floor, bounce;
+
+        life = _mm256_sub_ps(_mm256_loadu_ps(particles.life + i), aging);
+        active = _mm256_cmp_ps(life, zero, _CMP_GT_OQ);
+
+        vz = _mm256_sub_ps(_mm256_loadu_ps(particles.vz + i), gravity);
+        x = _mm256_add_ps(_mm256_loadu_ps(particles.x + i),
+                          _mm256_mul_ps(_mm256_loadu_ps(particles.vx + i), step));
+        y = _mm256_add_ps(_mm256_loadu_ps(particles.y + i),
+                          _mm256_mul_ps(_mm256_loadu_ps(particles.vy + i), step));
+        z = _mm256_add_ps(_mm256_loadu_ps(particles.z + i),
+                          _mm256_mul_ps(vz, step));
+
+        falling = _mm256_cmp_ps(vz, zero, _CMP_LT_OQ);
+        on_fountain = _mm256_and_ps(falling,
+            _mm256_and_ps(_mm256_cmp_ps(_mm256_add_ps(_mm256_mul_ps(x, x),
+                                                      _mm256_mul_ps(y, y)),
+                                        fountain_r2, _CMP_LT_OQ),
+                          _mm256_cmp_ps(z, fountain_top, _CMP_LT_OQ)));
+        on_floor = _mm256_andnot_ps(on_fountain,
+            _mm256_and_ps(falling, _mm256_cmp_ps(z, floor_top, _CMP_LT_OQ)));
+        bounce = _mm256_or_ps(on_fountain, on_floor);
+        plane = _mm256_blendv_ps(floor_top, fountain_top, on_fountain);
+
+        vz = _mm256_blendv_ps(vz, _mm256_mul_ps(neg_friction, vz), bounce);
+        z = _mm256_blendv_ps(z,
+                             _mm256_add_ps(plane,
+                                           _mm256_mul_ps(friction,
+                                                         _mm256_sub_ps(plane, z))),
+                             bounce);
+
+        _mm256_storeu_ps(particles.life + i, life);
+        _mm256_storeu_ps(particles.x + i,
+                         _mm256_blendv_ps(_mm256_loadu_ps(particles.x + i), x, active));
+        _mm256_storeu_ps(particles.y + i,
+                         _mm256_blendv_ps(_mm256_loadu_ps(particles.y + i), y, active));
+        _mm256_storeu_ps(particles.z + i,
+                         _mm256_blendv_ps(_mm256_loadu_ps(particles.z + i), z, active));
+        _mm256_storeu_ps(particles.vz + i,
+                         _mm256_blendv_ps(_mm256_loadu_ps(particles.vz + i), vz, active));
+    }
+}
+
+__attribute__((target("avx512f")))
+static void integrate_particles_avx512(int first, int last, float dt)
+{
+    const __m512 zero = _mm512_setzero_ps();
+    const __m512 step = _mm512_set1_ps(dt);
+    const __m512 aging = _mm512_set1_ps(dt * (1.f / LIFE_SPAN));
+    const __m512 gravity = _mm512_set1_ps(GRAVITY * dt);
+    const __m512 friction = _mm512_set1_ps(FRICTION);
+    const __m512 neg_friction = _mm512_set1_ps(-FRICTION);
+    const __m512 fountain_r2 = _mm512_set1_ps(FOUNTAIN_R2);
+    const __m512 fountain_top = _mm512_set1_ps(FOUNTAIN_TOP);
+    const __m512 floor_top = _mm512_set1_ps(FLOOR_TOP);
+    int i;
+
+    for (i = first;  i < last;  i += 16)
+    {
+        __m512 x, y, z, vz, life, plane;
+        __mmask16 active, falling, on_fountain, on_floor, bounce;
+
+        life = _mm512_sub_ps(_mm512_loadu_ps(particles.life + i), aging);
+        active = _mm512_cmp_ps_mask(life, zero, _CMP_GT_OQ);
+
+        vz = _mm512_sub_ps(_mm512_loadu_ps(particles.vz + i), gravity);
+        x = _mm512_add_ps(_mm512_loadu_ps(particles.x + i),
+                          _mm512_mul_ps(_mm512_loadu_ps(particles.vx + i), step));
+        y = _mm512_add_ps(_mm512_loadu_ps(particles.y + i),
+                          _mm512_mul_ps(_mm512_loadu_ps(particles.vy + i), step));
+        z = _mm512_add_ps(_mm512_loadu_ps(particles.z + i),
+                          _mm512_mul_ps(vz, step));
+
+        falling = _mm512_cmp_ps_mask(vz, zero, _CMP_LT_OQ);
+        on_fountain = falling &
+            _mm512_cmp_ps_mask(_mm512_add_ps(_mm512_mul_ps(x, x),
+                                             _mm512_mul_ps(y, y)),
+                               fountain_r2, _CMP_LT_OQ) &
+            _mm512_cmp_ps_mask(z, fountain_top, _CMP_LT_OQ);
+        on_floor = falling & (__mmask16) ~on_fountain &
+            _mm512_cmp_ps_mask(z, floor_top, _CMP_LT_OQ);
+        bounce = on_fountain | on_floor;
+        plane = _mm512_mask_blend_ps(on_fountain, floor_top, fountain_top);
+
+        vz = _mm512_mask_mul_ps(vz, bounce, neg_friction, vz);
+        z = _mm512_mask_add_ps(z, bounce, plane,
+                               _mm512_mul_ps(friction, _mm512_sub_ps(plane, z)));
+
+        _mm512_storeu_ps(particles.life + i, life);
+        _mm512_mask_storeu_ps(particles.x + i, active, x);
+        _mm512_mask_storeu_ps(particles.y + i, active, y);
+        _mm512_mask_storeu_ps(particles.z + i, active, z);
+        _mm512_mask_storeu_ps(particles.vz + i, active, vz);
+    }
+}
+
+#endif // PARTICLES_X86_DISPATCH
+
+// The integrator used for the whole live range, selected at runtime. It may
+// process up to PARTICLE_PADDING - 1 particles past the end of the range.
+static void (*integrate_particles)(int first, int last, float dt) =
+    integrate_particles_c;
+static const char* integrator_name = "C";
+
+#if defined(PARTICLES_X86_DISPATCH)
+
+// Time the specified integrator on the particle arrays, which must not hold
+// any live particles yet. The integrators are branch-free, so dead particles
+// take as long as live ones. Particles are integrated in chunks of at most
+// PARTICLE_CHUNK, so that is the range that is timed.
+static double time_integrator(void (*integrate)(int first, int last, float dt))
+{
+    const int count = particles.capacity < PARTICLE_CHUNK ?
+                      particles.capacity : PARTICLE_CHUNK;
+    const int repeats = 1 + (1 << 20) / count;
+    double best = 0.0;
+    int i, j;
+
+    for (i = 0;  i < 3;  i++)
+    {
+        const double start = get_time();
+        double elapsed;
+
+        for (j = 0;  j < repeats;  j++)
+            integrate(0, count, 1.f / 60.f);
+
+        elapsed = get_time() - start;
+        if (i == 0 || elapsed < best)
+            best = elapsed;
     }
 
-    // Apply gravity
-    p->vz = p->vz - GRAVITY * dt;
+    // Dead particles only got older, so make them as new again
+    memset(particles.life, 0,
+           ((count + PARTICLE_PADDING - 1) / PARTICLE_PADDING) *
+           PARTICLE_PADDING * sizeof(float));
+
+    return best;
+}
+
+#endif // PARTICLES_X86_DISPATCH
+
+// Select the named integrator (c, avx or avx512), or if no name is given the
+// one that is fastest on this processor, for the allocated system size. All of
+// them give the same results.
+static int select_integrator(const char* name)
+{
+#if defined(PARTICLES_X86_DISPATCH)
+    double fastest;
+#endif
+
+    if (name && strcmp(name, "c") == 0)
+        return GL_TRUE;
+
+#if defined(PARTICLES_X86_DISPATCH)
+    __builtin_cpu_init();
+
+    if (name)
+    {
+        if (strcmp(name, "avx512") == 0 && __builtin_cpu_supports("avx512f"))
+        {
+            integrate_particles = integrate_particles_avx512;
+            integrator_name = "AVX-512";
+            return GL_TRUE;
+        }
+
+        if (strcmp(name, "avx") == 0 && __builtin_cpu_supports("avx"))
+        {
+            integrate_particles = integrate_particles_avx;
+            integrator_name = "AVX";
+            return GL_TRUE;
+        }
+
+        return GL_FALSE;
+    }
 
-    // Update particle position
-    p->x = p->x + p->vx * dt;
-    p->y = p->y + p->vy * dt;
-    p->z = p->z + p->vz * dt;
+    // A wider kernel is not always faster, e.g. for small systems or where
+    // wide vectors lower the clock rate, so measure them
+    fastest = time_integrator(integrate_particles_c);
 
-    // Simple collision detection + response
-    if (p->vz < 0.f)
+    if (__builtin_cpu_supports("avx"))
     {
-        // Particles should bounce on the fountain (with friction)
-        if ((p->x * p->x + p->y * p->y) < FOUNTAIN_R2 &&
-            p->z < (FOUNTAIN_HEIGHT + PARTICLE_SIZE / 2))
+        const double elapsed = time_integrator(integrate_particles_avx);
+        if (elapsed < fastest)
         {
-            p->vz = -FRICTION * p->vz;
-            p->z  = FOUNTAIN_HEIGHT + PARTICLE_SIZE / 2 +
-                    FRICTION * (FOUNTAIN_HEIGHT +
-                    PARTICLE_SIZE / 2 - p->z);
+            integrate_particles = integrate_particles_avx;
+            integrator_name = "AVX";
+            fastest = elapsed;
         }
+    }
 
-        // Particles should bounce on the floor (with friction)
-        else if (p->z < PARTICLE_SIZE / 2)
+    if (__builtin_cpu_supports("avx512f"))
+    {
+        const double elapsed = time_integrator(integrate_particles_avx512);
+        if (elapsed < fastest)
         {
-            p->vz = -FRICTION * p->vz;
-            p->z  = PARTICLE_SIZE / 2 +
-                    FRICTION * (PARTICLE_SIZE / 2 - p->z);
+            integrate_particles = integrate_particles_avx512;
+            integrator_name = "AVX-512";
+            fastest = elapsed;
         }
     }
+#endif
+
+    return !name;
 }
 
 
 //========================================================================
-// The main frame for the particle engine. Called once per frame.
+// Worker pool for the particle physics. The physics thread hands out a batch
+// of jobs and then works on it together with the workers.
 //========================================================================
 
-static void particle_engine(double t, float dt)
+static work_pool job_pool;
+
+
+//========================================================================
+// Physics jobs, each working on a fixed range of particles. The results do
+// not depend on how the jobs are spread over threads.
+//========================================================================
+
+// Update one chunk of the live range and list the particles that died
+static void integrate_job(int chunk)
 {
-    int i;
-    float dt2;
+    const int first = chunk * PARTICLE_CHUNK;
+    int i, last, count = 0;
 
-    // Update particles (iterated several times per frame if dt is too large)
-    while (dt > 0.f)
+    last = first + PARTICLE_CHUNK;
+    if (last > particles.live)
+        last = particles.live;
+
+    integrate_particles(first,
+                        (last + PARTICLE_PADDING - 1) / PARTICLE_PADDING *
+                        PARTICLE_PADDING,
+                        step.dt);
+
+    for (i = first;  i < last;  i++)
     {
-        // Calculate delta time for this iteration
-        dt2 = dt < MIN_DELTA_T ? dt : MIN_DELTA_T;
+        dead_particles[first + count] = i;
+        count += particles.life[i] <= 0.f;
+    }
+
+    dead_counts[chunk] = count;
+}
+
+// Initialize one chunk of the particles born in this step
+static void birth_job(int chunk)
+{
+    int i, first, last;
+    float age;
 
-        for (i = 0;  i < MAX_PARTICLES;  i++)
-            update_particle(&particles[i], dt2);
+    first = chunk * BIRTH_CHUNK;
+    last = first + BIRTH_CHUNK;
+    if (last > step.births)
+        last = step.births;
 
-        min_age += dt2;
+    for (i = first;  i < last;  i++)
+    {
+        age = birth_age(i);
+        init_particle(step.first + i, step.t + age, (uint32_t) (step.serial + i));
+        integrate_particles_c(step.first + i, step.first + i + 1, age);
+    }
+}
+
+
+//========================================================================
+// Remove dead particles by moving the last active particle into their slot
+//========================================================================
+
+static void remove_dead_particles(int chunks)
+{
+    int chunk, k, i, last;
 
-        // Should we create any new particle(s)?
-        while (min_age >= BIRTH_INTERVAL)
+    // The dead particles are visited in index order
+    for (chunk = 0;  chunk < chunks;  chunk++)
+    {
+        for (k = 0;  k < dead_counts[chunk];  k++)
         {
-            min_age -= BIRTH_INTERVAL;
+            i = dead_particles[chunk * PARTICLE_CHUNK + k];
 
-            // Find a dead particle to replace with a new one
-            for (i = 0;  i < MAX_PARTICLES;  i++)
+            // Drop any dead particles at the end of the live range
+            while (particles.live > i &&
+                   particles.life[particles.live - 1] <= 0.f)
             {
-                if (!particles[i].active)
-                {
-                    init_particle(&particles[i], t + min_age);
-                    update_particle(&particles[i], min_age);
-                    break;
-                }
+                particles.live--;
+            }
+
+            // Are all remaining dead particles past the live range?
+            if (i >= particles.live)
+                return;
+
+            last = --particles.live;
+
+            particles.x[i]    = particles.x[last];
+            particles.y[i]    = particles.y[last];
+            particles.z[i]    = particles.z[last];
+            particles.vx[i]   = particles.vx[last];
+            particles.vy[i]   = particles.vy[last];
+            particles.vz[i]   = particles.vz[last];
+            particles.r[i]    = particles.r[last];
+            particles.g[i]    = particles.g[last];
+            particles.b[i]    = particles.b[last];
+            particles.life[i] = particles.life[last];
+
+            particles.life[last] = 0.f;
+        }
+    }
+}
+
+
+//========================================================================
+// Parallel least significant digit radix sort of the live particles by
+// integer keys, used for depth sorting and for the spatial hash grid. The
+// caller fills in the first key and order arrays. Each pass counts the
+// digits in every chunk, turns the counts into the output position of each
+// digit of each chunk and then lets all chunks scatter their particles at
+// once. Every pass is stable, so the order never depends on the number of
+// threads.
+//========================================================================
+
+#define SORT_DIGIT_BITS 8
+#define SORT_BUCKETS    (1 << SORT_DIGIT_BITS)
+
+static struct {
+    uint32_t* keys[2];    // Sort keys, ping-ponged between passes
+    int*      order[2];   // Particle indices, moved along with the keys
+    int*      counts;     // Digit counts and then output positions, by chunk
+    int       pass;       // Current pass, which reads keys[pass & 1]
+} radix_sort;
+
+static int init_radix_sort(void)
+{
+    const int chunks = (particles.capacity + PARTICLE_CHUNK - 1) / PARTICLE_CHUNK;
+    int i;
+
+    if (radix_sort.counts)
+        return GL_TRUE;
+
+    for (i = 0;  i < 2;  i++)
+    {
+        radix_sort.keys[i] = calloc(particles.capacity, sizeof(uint32_t));
+        radix_sort.order[i] = calloc(particles.capacity, sizeof(int));
+        if (!radix_sort.keys[i] || !radix_sort.order[i])
+            return GL_FALSE;
+    }
+
+    radix_sort.counts = calloc(chunks * SORT_BUCKETS, sizeof(int));
+    return radix_sort.counts != NULL;
+}
+
+// Count the digits of the current pass in one chunk
+static void sort_count_job(int chunk)
+{
+    const uint32_t* keys = radix_sort.keys[radix_sort.pass & 1];
+    const int shift = radix_sort.pass * SORT_DIGIT_BITS;
+    const int first = chunk * PARTICLE_CHUNK;
+    int* counts = radix_sort.counts + chunk * SORT_BUCKETS;
+    int i, last;
+
+    last = first + PARTICLE_CHUNK;
+    if (last > particles.live)
+        last = particles.live;
+
+    memset(counts, 0, SORT_BUCKETS * sizeof(int));
+
+    for (i = first;  i < last;  i++)
+        counts[(keys[i] >> shift) & (SORT_BUCKETS - 1)]++;
+}
+
+// Move the particles of one chunk to their positions for the current pass
+static void sort_scatter_job(int chunk)
+{
+    const int pass = radix_sort.pass;
+    const int shift = pass * SORT_DIGIT_BITS;
+    const uint32_t* keys = radix_sort.keys[pass & 1];
+    const int* order = radix_sort.order[pass & 1];
+    uint32_t* sorted_keys = radix_sort.keys[(pass & 1) ^ 1];
+    int* sorted_order = radix_sort.order[(pass & 1) ^ 1];
+    const int first = chunk * PARTICLE_CHUNK;
+    int* positions = radix_sort.counts + chunk * SORT_BUCKETS;
+    int i, last, k;
+
+    last = first + PARTICLE_CHUNK;
+    if (last > particles.live)
+        last = particles.live;
+
+    for (i = first;  i < last;  i++)
+    {
+        k = positions[(keys[i] >> shift) & (SORT_BUCKETS - 1)]++;
+        sorted_keys[k] = keys[i];
+        sorted_order[k] = order[i];
+    }
+}
+
+// Sort the live particles by the lowest digits of their keys, returning the
+// index of the key and order arrays holding the result
+static int sort_particle_keys(int digits)
+{
+    const int chunks = (particles.live + PARTICLE_CHUNK - 1) / PARTICLE_CHUNK;
+    int digit, chunk, position, count;
+
+    for (radix_sort.pass = 0;  radix_sort.pass < digits;  radix_sort.pass++)
+    {
+        work_pool_run(&job_pool, sort_count_job, chunks);
+
+        // The particles with lower digits go first and, within a digit,
+        // those of earlier chunks
+        position = 0;
+
+        for (digit = 0;  digit < SORT_BUCKETS;  digit++)
+        {
+            for (chunk = 0;  chunk < chunks;  chunk++)
+            {
+                count = radix_sort.counts[chunk * SORT_BUCKETS + digit];
+                radix_sort.counts[chunk * SORT_BUCKETS + digit] = position;
+                position += count;
             }
         }
 
-        dt -= dt2;
+        work_pool_run(&job_pool, sort_scatter_job, chunks);
+    }
+
+    return digits & 1;
+}
+
+
+//========================================================================
+// Spatial hash grid for particle interactions. The particles are sorted by
+// the hash of the grid cell they are in, so the particles of a cell are
+// contiguous and each cell only needs the index of its first particle. Their
+// positions are gathered in the same order, so a neighbour query reads a few
+// contiguous ranges instead of chasing pointers.
+//========================================================================
+
+static struct {
+    int       digits;        // Sort digits covering the hash
+    uint32_t  mask;          // Hash table size minus one
+    const uint32_t* cells;   // Cell hash of each sorted particle
+    const int* order;        // Particle index of each sorted particle
+    int*      cell_start;    // First sorted particle of each cell, which is
+                             // only valid if that particle is in the cell
+    float*    x;  float* y;  float* z;  // Positions in sorted order
+    float*    pressure;      // Pressures in sorted order
+    float*    near_pressure;
+    int*      pair_counts;   // Number of neighbour pairs found, by chunk
+    double    pairs;         // Total number of neighbour pairs found (each
+                             // is visited twice, by the pressure and relax jobs)
+    double    build_time;    // Total time spent building the grid (s)
+    double    search_time;   // Total time spent on neighbour queries (s)
+} grid;
+
+static int init_grid(void)
+{
+    const int chunks = (particles.capacity + PARTICLE_CHUNK - 1) / PARTICLE_CHUNK;
+    float** arrays[5];
+    int i, bits = SORT_DIGIT_BITS;
+
+    // Sparse particles mostly have a cell each, so use a few times more slots
+    // than particles to keep the unrelated ones that share a slot rare
+    while ((1 << bits) < particles.capacity * 4)
+        bits++;
+
+    grid.digits = (bits + SORT_DIGIT_BITS - 1) / SORT_DIGIT_BITS;
+    grid.mask = (1u << bits) - 1u;
+
+    arrays[0] = &grid.x;
+    arrays[1] = &grid.y;
+    arrays[2] = &grid.z;
+    arrays[3] = &grid.pressure;
+    arrays[4] = &grid.near_pressure;
+
+    for (i = 0;  i < 5;  i++)
+    {
+        *arrays[i] = calloc(particles.capacity, sizeof(float));
+        if (!*arrays[i])
+            return GL_FALSE;
     }
+
+    grid.cell_start = calloc((size_t) grid.mask + 1, sizeof(int));
+    grid.pair_counts = calloc(chunks, sizeof(int));
+    if (!grid.cell_start || !grid.pair_counts)
+        return GL_FALSE;
+
+    return init_radix_sort();
+}
+
+// Spatial hash of Teschner et al., "Optimized Spatial Hashing for Collision
+// Detection of Deformable Objects" (VMV 2003)
+static uint32_t hash_cell(int x, int y, int z)
+{
+    return ((uint32_t) x * 73856093u ^
+            (uint32_t) y * 19349663u ^
+            (uint32_t) z * 83492791u) & grid.mask;
+}
+
+static void grid_key_job(int chunk)
+{
+    const float scale = 1.f / FLUID_RADIUS;
+    const int first = chunk * PARTICLE_CHUNK;
+    int i, last;
+
+    last = first + PARTICLE_CHUNK;
+    if (last > particles.live)
+        last = particles.live;
+
+    for (i = first;  i < last;  i++)
+    {
+        radix_sort.keys[0][i] =
+            hash_cell((int) floorf(particles.x[i] * scale),
+                      (int) floorf(particles.y[i] * scale),
+                      (int) floorf(particles.z[i] * scale));
+        radix_sort.order[0][i] = i;
+    }
+}
+
+// Gather the positions of one chunk in sorted order and find the cells that
+// start in it
+static void grid_gather_job(int chunk)
+{
+    const int first = chunk * PARTICLE_CHUNK;
+    int k, i, last;
+
+    last = first + PARTICLE_CHUNK;
+    if (last > particles.live)
+        last = particles.live;
+
+    for (k = first;  k < last;  k++)
+    {
+        i = grid.order[k];
+        grid.x[k] = particles.x[i];
+        grid.y[k] = particles.y[i];
+        grid.z[k] = particles.z[i];
+
+        if (k == 0 || grid.cells[k] != grid.cells[k - 1])
+            grid.cell_start[grid.cells[k]] = k;
+    }
+}
+
+// Rebuild the grid for the current particle positions
+static void build_grid(void)
+{
+    const int chunks = (particles.live + PARTICLE_CHUNK - 1) / PARTICLE_CHUNK;
+    const double start = get_time();
+    int result;
+
+    work_pool_run(&job_pool, grid_key_job, chunks);
+    result = sort_particle_keys(grid.digits);
+    grid.cells = radix_sort.keys[result];
+    grid.order = radix_sort.order[result];
+    work_pool_run(&job_pool, grid_gather_job, chunks);
+
+    grid.build_time += get_time() - start;
+}
+
+
+//========================================================================
+// Fluid mode. Nearby particles push each other apart with the double
+// density relaxation of Clavet et al., "Particle-based Viscoelastic Fluid
+// Simulation" (SCA 2005), a position based variant of SPH. The pressures of
+// all particles are computed first and then every particle moves itself
+// based on them, so the jobs never write to the same particle.
+//========================================================================
+
+// List the hashes of the 27 cells around sorted particle k. Cells that hash
+// to the same slot as another cell are visited twice, which is rare with at
+// least one cell per particle and only means some neighbours count double.
+static void get_neighbour_cells(int k, uint32_t* cells)
+{
+    const float scale = 1.f / FLUID_RADIUS;
+    const int x = (int) floorf(grid.x[k] * scale);
+    const int y = (int) floorf(grid.y[k] * scale);
+    const int z = (int) floorf(grid.z[k] * scale);
+    int dx, dy, dz;
+
+    for (dz = -1;  dz <= 1;  dz++)
+    {
+        for (dy = -1;  dy <= 1;  dy++)
+        {
+            for (dx = -1;  dx <= 1;  dx++)
+                *cells++ = hash_cell(x + dx, y + dy, z + dz);
+        }
+    }
+}
+
+// Compute the pressures of one chunk of sorted particles
+static void pressure_job(int chunk)
+{
+    const float scale = 1.f / FLUID_RADIUS;
+    const int first = chunk * PARTICLE_CHUNK;
+    uint32_t cells[27];
+    int c, j, k, last, pairs = 0;
+    float rx, ry, rz, q, density, near_density;
+
+    last = first + PARTICLE_CHUNK;
+    if (last > particles.live)
+        last = particles.live;
+
+    for (k = first;  k < last;  k++)
+    {
+        density = near_density = 0.f;
+        get_neighbour_cells(k, cells);
+
+        for (c = 0;  c < 27;  c++)
+        {
+            // The particles of a cell are contiguous
+            for (j = grid.cell_start[cells[c]];
+                 j < particles.live && grid.cells[j] == cells[c];
+                 j++)
+            {
+                rx = grid.x[j] - grid.x[k];
+                ry = grid.y[j] - grid.y[k];
+                rz = grid.z[j] - grid.z[k];
+
+                q = 1.f - sqrtf(rx * rx + ry * ry + rz * rz) * scale;
+                if (q > 0.f)
+                {
+                    density += q * q;
+                    near_density += q * q * q;
+                    pairs++;
+                }
+            }
+        }
+
+        grid.pressure[k] = FLUID_STIFFNESS * (density - FLUID_DENSITY);
+        grid.near_pressure[k] = FLUID_NEAR_STIFFNESS * near_density;
+    }
+
+    grid.pair_counts[chunk] = pairs;
+}
+
+// Move one chunk of sorted particles away from (or towards) their neighbours
+// and change their velocities to match
+static void relax_job(int chunk)
+{
+    const float scale = 1.f / FLUID_RADIUS;
+    const float dt = step.dt;
+    const float max_move = FLUID_MAX_ACCELERATION * dt * dt;
+    const int first = chunk * PARTICLE_CHUNK;
+    uint32_t cells[27];
+    int c, i, j, k, last;
+    float rx, ry, rz, r, q, d, dx, dy, dz;
+
+    last = first + PARTICLE_CHUNK;
+    if (last > particles.live)
+        last = particles.live;
+
+    for (k = first;  k < last;  k++)
+    {
+        dx = dy = dz = 0.f;
+        get_neighbour_cells(k, cells);
+
+        for (c = 0;  c < 27;  c++)
+        {
+            for (j = grid.cell_start[cells[c]];
+                 j < particles.live && grid.cells[j] == cells[c];
+                 j++)
+            {
+                rx = grid.x[j] - grid.x[k];
+                ry = grid.y[j] - grid.y[k];
+                rz = grid.z[j] - grid.z[k];
+                r = sqrtf(rx * rx + ry * ry + rz * rz);
+
+                // The particle itself (or one at the very same spot) gives
+                // no direction to move in
+                q = 1.f - r * scale;
+                if (q <= 0.f || r == 0.f)
+                    continue;
+
+                d = 0.5f * dt * dt *
+                    ((grid.pressure[k] + grid.pressure[j]) * q +
+                     (grid.near_pressure[k] + grid.near_pressure[j]) * q * q) / r;
+                dx -= d * rx;
+                dy -= d * ry;
+                dz -= d * rz;
+            }
+        }
+
+        // Keep crowded particles, e.g. those just out of the fountain, from
+        // being shot away by limiting their acceleration
+        d = dx * dx + dy * dy + dz * dz;
+        if (d > max_move * max_move)
+        {
+            d = max_move / sqrtf(d);
+            dx *= d;
+            dy *= d;
+            dz *= d;
+        }
+
+        // Never push particles into the floor
+        if (grid.z[k] + dz < FLOOR_TOP)
+            dz = FLOOR_TOP - grid.z[k];
+
+        i = grid.order[k];
+        particles.x[i] = grid.x[k] + dx;
+        particles.y[i] = grid.y[k] + dy;
+        particles.z[i] = grid.z[k] + dz;
+        particles.vx[i] += dx / dt;
+        particles.vy[i] += dy / dt;
+        particles.vz[i] += dz / dt;
+    }
+}
+
+static void relax_fluid(void)
+{
+    const int chunks = (particles.live + PARTICLE_CHUNK - 1) / PARTICLE_CHUNK;
+    double start;
+    int chunk;
+
+    build_grid();
+
+    start = get_time();
+    work_pool_run(&job_pool, pressure_job, chunks);
+    work_pool_run(&job_pool, relax_job, chunks);
+    grid.search_time += get_time() - start;
+
+    for (chunk = 0;  chunk < chunks;  chunk++)
+        grid.pairs += grid.pair_counts[chunk];
+}
+
+
+//========================================================================
+// The main frame for the particle engine. Called once per frame.
+//========================================================================
+
+static void particle_engine(double t, float dt)
+{
+    int chunks;
+    float dt2;
+
+    // Update particles (iterated several times per frame if dt is too large)
+    while (dt > 0.f)
+    {
+        // Calculate delta time for this iteration
+        dt2 = dt < MIN_DELTA_T ? dt : MIN_DELTA_T;
+
+        step.t = t;
+        step.dt = dt2;
+
+        chunks = (particles.live + PARTICLE_CHUNK - 1) / PARTICLE_CHUNK;
+        work_pool_run(&job_pool, integrate_job, chunks);
+        particle_updates += particles.live;
+
+        remove_dead_particles(chunks);
+
+        // Should we create any new particle(s)? The first dead particle is
+        // always the one past the live count.
+        schedule_births(dt2, particles.capacity - particles.live);
+        step.first = particles.live;
+
+        if (step.births)
+        {
+            particles.live += step.births;
+            work_pool_run(&job_pool, birth_job,
+                          (step.births + BIRTH_CHUNK - 1) / BIRTH_CHUNK);
+            set_glow(t + birth_age(step.births - 1));
+
+            particle_births += step.births;
+        }
+
+        if (fluid)
+            relax_fluid();
+
+        dt -= dt2;
+    }
+}
+
+
+//========================================================================
+// Checksum of the particle state (64-bit FNV-1a over the bits of the live
+// particles), used to check that a change to the engine does not change its
+// results. It depends on neither the number of threads nor the integrator.
+//========================================================================
+
+static uint64_t particle_checksum(void)
+{
+    const float* arrays[10];
+    const unsigned char* bytes;
+    uint64_t hash = 14695981039346656037ull;
+    size_t i, size;
+    int j;
+
+    arrays[0] = particles.x;
+    arrays[1] = particles.y;
+    arrays[2] = particles.z;
+    arrays[3] = particles.vx;
+    arrays[4] = particles.vy;
+    arrays[5] = particles.vz;
+    arrays[6] = particles.r;
+    arrays[7] = particles.g;
+    arrays[8] = particles.b;
+    arrays[9] = particles.life;
+
+    size = (size_t) particles.live * sizeof(float);
+
+    for (j = 0;  j < 10;  j++)
+    {
+        bytes = (const unsigned char*) arrays[j];
+
+        for (i = 0;  i < size;  i++)
+            hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+
+    return hash;
+}
+
+//========================================================================
+// Depth sorting for alpha blended particles, by their view depths quantized
+// to 16 bits
+//========================================================================
+
+// View depth covered by the keys (m). This is the far plane, so everything
+// farther away is clipped anyway and can share the last key.
+#define SORT_MAX_DEPTH  60.f
+
+static struct {
+    const int* order;     // Particle indices, back to front
+    double     time;      // Total time spent sorting (s)
+} depth_sort;
+
+// Compute the keys of one chunk, so that the farthest particle comes first
+static void depth_key_job(int chunk)
+{
+    const float* view = thread_sync.view_depth;
+    const float scale = 65535.f / SORT_MAX_DEPTH;
+    const int first = chunk * PARTICLE_CHUNK;
+    int i, last, key;
+    float depth;
+
+    last = first + PARTICLE_CHUNK;
+    if (last > particles.live)
+        last = particles.live;
+
+    for (i = first;  i < last;  i++)
+    {
+        // The camera looks down the negative z axis of view space
+        depth = -(view[0] * particles.x[i] + view[1] * particles.y[i] +
+                  view[2] * particles.z[i] + view[3]);
+
+        key = (int) ((SORT_MAX_DEPTH - depth) * scale);
+        if (key < 0)
+            key = 0;
+        else if (key > 65535)
+            key = 65535;
+
+        radix_sort.keys[0][i] = (uint32_t) key;
+        radix_sort.order[0][i] = i;
+    }
+}
+
+static void sort_particles(void)
+{
+    const double start = get_time();
+
+    work_pool_run(&job_pool, depth_key_job,
+                  (particles.live + PARTICLE_CHUNK - 1) / PARTICLE_CHUNK);
+    depth_sort.order = radix_sort.order[sort_particle_keys(2)];
+
+    depth_sort.time += get_time() - start;
+}
+
+
+//========================================================================
+// Publish the current particles for drawing
+//========================================================================
+
+static int init_draw_buffers(void)
+{
+    int i;
+
+    for (i = 0;  i < 3;  i++)
+    {
+        draw_buffers[i].sprites = calloc(particles.capacity, sizeof(Sprite));
+        if (!draw_buffers[i].sprites)
+            return GL_FALSE;
+    }
+
+    if (transparency == TRANSPARENCY_SORTED)
+        return init_radix_sort();
+
+    return GL_TRUE;
+}
+
+static void publish_job(int chunk)
+{
+    Sprite* sprites = draw_buffers[draw_buffer_back].sprites;
+    const int* order = NULL;
+    const int first = chunk * PARTICLE_CHUNK;
+    int i, j, last;
+    float alpha;
+
+    // Sorted particles are gathered in drawing order
+    if (transparency == TRANSPARENCY_SORTED)
+        order = depth_sort.order;
+
+    last = first + PARTICLE_CHUNK;
+    if (last > particles.live)
+        last = particles.live;
+
+    for (i = first;  i < last;  i++)
+    {
+        j = order ? order[i] : i;
+
+        // Calculate particle intensity (we set it to max during 75% of its
+        // life, then it fades out)
+        alpha =  4.f * particles.life[j];
+        if (alpha > 1.f)
+            alpha = 1.f;
+
+        // Convert color from float to 8-bit (store it in a 32-bit integer
+        // using endian independent type casting)
+        ((GLubyte*) &sprites[i].rgba)[0] = (GLubyte)(particles.r[j] * 255.f);
+        ((GLubyte*) &sprites[i].rgba)[1] = (GLubyte)(particles.g[j] * 255.f);
+        ((GLubyte*) &sprites[i].rgba)[2] = (GLubyte)(particles.b[j] * 255.f);
+        ((GLubyte*) &sprites[i].rgba)[3] = (GLubyte)(alpha * 255.f);
+
+        sprites[i].x = particles.x[j];
+        sprites[i].y = particles.y[j];
+        sprites[i].z = particles.z[j];
+    }
+}
+
+// Called by the physics thread after each frame. Sorting uses the view of the
+// last frame taken by the draw thread, which lags one frame behind the one
+// these particles will be drawn with.
+static void publish_particles(void)
+{
+    DrawBuffer* buffer = draw_buffers + draw_buffer_back;
+
+    if (transparency == TRANSPARENCY_SORTED)
+        sort_particles();
+
+    work_pool_run(&job_pool, publish_job,
+                  (particles.live + PARTICLE_CHUNK - 1) / PARTICLE_CHUNK);
+
+    buffer->count = particles.live;
+    memcpy(buffer->glow_color, glow_color, sizeof(glow_color));
+    memcpy(buffer->glow_pos, glow_pos, sizeof(glow_pos));
+
+    draw_buffer_back =
+        atomic_exchange_int(&draw_buffer_ready,
+                            draw_buffer_back | DRAW_BUFFER_FRESH) & 3;
+}
+
+#if !defined(PARTICLES_BENCH)
+
+// Called by the draw thread to take the latest published particles, if any
+static void acquire_particles(void)
+{
+    if (atomic_load_int(&draw_buffer_ready) & DRAW_BUFFER_FRESH)
+    {
+        draw_buffer_front =
+            atomic_exchange_int(&draw_buffer_ready, draw_buffer_front) & 3;
+    }
+}
+
+#endif // PARTICLES_BENCH
+
+
+// Nothing below this point is needed by the headless benchmark, except the
+// benchmark itself
+#if !defined(PARTICLES_BENCH)
+
+//========================================================================
+// Instanced billboard renderer. Each particle is uploaded once per frame as
+// a single sprite and the vertex shader expands it into a view-aligned quad,
+// so the whole system is drawn with one call. This only needs OpenGL 3.3
+// functionality and is used whenever the context provides it.
+//========================================================================
+
+static PFNGLCREATESHADERPROC glCreateShader;
+static PFNGLSHADERSOURCEPROC glShaderSource;
+static PFNGLCOMPILESHADERPROC glCompileShader;
+static PFNGLGETSHADERIVPROC glGetShaderiv;
+static PFNGLGETSHADERINFOLOGPROC glGetShaderInfoLog;
+static PFNGLCREATEPROGRAMPROC glCreateProgram;
+static PFNGLATTACHSHADERPROC glAttachShader;
+static PFNGLBINDATTRIBLOCATIONPROC glBindAttribLocation;
+static PFNGLLINKPROGRAMPROC glLinkProgram;
+static PFNGLGETPROGRAMIVPROC glGetProgramiv;
+static PFNGLGETPROGRAMINFOLOGPROC glGetProgramInfoLog;
+static PFNGLUSEPROGRAMPROC glUseProgram;
+static PFNGLGETUNIFORMLOCATIONPROC glGetUniformLocation;
+static PFNGLUNIFORM1IPROC glUniform1i;
+static PFNGLUNIFORM1FPROC glUniform1f;
+static PFNGLUNIFORMMATRIX4FVPROC glUniformMatrix4fv;
+static PFNGLGENBUFFERSPROC glGenBuffers;
+static PFNGLBINDBUFFERPROC glBindBuffer;
+static PFNGLBUFFERDATAPROC glBufferData;
+static PFNGLGENVERTEXARRAYSPROC glGenVertexArrays;
+static PFNGLBINDVERTEXARRAYPROC glBindVertexArray;
+static PFNGLENABLEVERTEXATTRIBARRAYPROC glEnableVertexAttribArray;
+static PFNGLVERTEXATTRIBPOINTERPROC glVertexAttribPointer;
+static PFNGLVERTEXATTRIBDIVISORPROC glVertexAttribDivisor;
+static PFNGLDRAWARRAYSINSTANCEDPROC glDrawArraysInstanced;
+
+static const char* sprite_vertex_shader_text =
+"#version 330\n"
+"uniform mat4 projection;\n"
+"uniform mat4 modelview;\n"
+"uniform float size;\n"
+"uniform float alpha_scale;\n"
+"in vec3 position;\n"
+"in vec4 color;\n"
+"out vec2 texcoord;\n"
+"out vec4 sprite_color;\n"
+"out float depth;\n"
+"void main()\n"
+"{\n"
+"    vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);\n"
+"    vec4 center = modelview * vec4(position, 1.0);\n"
+"    texcoord = corner;\n"
+"    sprite_color = vec4(color.rgb, clamp(color.a * alpha_scale, 0.0, 1.0));\n"
+"    depth = -center.z;\n"
+"    gl_Position = projection * (center + vec4((corner - 0.5) * size, 0.0, 0.0));\n"
+"}\n";
+
+// The texture is used as intensity for additive blending and as coverage for
+// alpha blending
+static const char* sprite_fragment_shader_text =
+"#version 330\n"
+"uniform sampler2D tex;\n"
+"uniform bool textured;\n"
+"uniform bool coverage;\n"
+"in vec2 texcoord;\n"
+"in vec4 sprite_color;\n"
+"out vec4 frag_color;\n"
+"void main()\n"
+"{\n"
+"    float luminance = textured ? texture(tex, texcoord).r : 1.0;\n"
+"    if (coverage)\n"
+"        frag_color = vec4(sprite_color.rgb, sprite_color.a * luminance);\n"
+"    else\n"
+"        frag_color = vec4(sprite_color.rgb * luminance, sprite_color.a);\n"
+"}\n";
+
+// Weighted blended order-independent transparency (McGuire & Bavoil, JCGT
+// 2013). The first target sums the weighted colors and multiplies up the
+// revealage in alpha, the second sums the weights.
+static const char* weighted_fragment_shader_text =
+"#version 330\n"
+"uniform sampler2D tex;\n"
+"uniform bool textured;\n"
+"in vec2 texcoord;\n"
+"in vec4 sprite_color;\n"
+"in float depth;\n"
+"layout(location = 0) out vec4 accum;\n"
+"layout(location = 1) out vec4 weight;\n"
+"void main()\n"
+"{\n"
+"    float luminance = textured ? texture(tex, texcoord).r : 1.0;\n"
+"    float alpha = sprite_color.a * luminance;\n"
+"    float w = alpha * clamp(10.0 / (1e-5 + pow(depth / 5.0, 2.0) +\n"
+"                                    pow(depth / 200.0, 6.0)), 1e-2, 3e3);\n"
+"    accum = vec4(sprite_color.rgb * alpha * w, alpha);\n"
+"    weight = vec4(alpha * w);\n"
+"}\n";
+
+// A linked sprite program and the locations of its per-frame uniforms
+typedef struct
+{
+    GLuint  program;        // Zero if the program is not available
+    GLint   projection_location;
+    GLint   modelview_location;
+    GLint   textured_location;
+    GLint   alpha_scale_location;
+    GLint   coverage_location;
+} SpriteProgram;
+
+static struct {
+    SpriteProgram blended;  // For additive and alpha blending
+    SpriteProgram weighted; // For weighted blended OIT
+    GLuint  vertex_array;
+    GLuint  sprite_buffer;
+} sprite_renderer;
+
+#define LOAD_GL_FUNCTION(type, name) \
+    if (!(name = (type) glfwGetProcAddress(#name))) return GL_FALSE
+
+static int load_sprite_functions(void)
+{
+    LOAD_GL_FUNCTION(PFNGLCREATESHADERPROC, glCreateShader);
+    LOAD_GL_FUNCTION(PFNGLSHADERSOURCEPROC, glShaderSource);
+    LOAD_GL_FUNCTION(PFNGLCOMPILESHADERPROC, glCompileShader);
+    LOAD_GL_FUNCTION(PFNGLGETSHADERIVPROC, glGetShaderiv);
+    LOAD_GL_FUNCTION(PFNGLGETSHADERINFOLOGPROC, glGetShaderInfoLog);
+    LOAD_GL_FUNCTION(PFNGLCREATEPROGRAMPROC, glCreateProgram);
+    LOAD_GL_FUNCTION(PFNGLATTACHSHADERPROC, glAttachShader);
+    LOAD_GL_FUNCTION(PFNGLBINDATTRIBLOCATIONPROC, glBindAttribLocation);
+    LOAD_GL_FUNCTION(PFNGLLINKPROGRAMPROC, glLinkProgram);
+    LOAD_GL_FUNCTION(PFNGLGETPROGRAMIVPROC, glGetProgramiv);
+    LOAD_GL_FUNCTION(PFNGLGETPROGRAMINFOLOGPROC, glGetProgramInfoLog);
+    LOAD_GL_FUNCTION(PFNGLUSEPROGRAMPROC, glUseProgram);
+    LOAD_GL_FUNCTION(PFNGLGETUNIFORMLOCATIONPROC, glGetUniformLocation);
+    LOAD_GL_FUNCTION(PFNGLUNIFORM1IPROC, glUniform1i);
+    LOAD_GL_FUNCTION(PFNGLUNIFORM1FPROC, glUniform1f);
+    LOAD_GL_FUNCTION(PFNGLUNIFORMMATRIX4FVPROC, glUniformMatrix4fv);
+    LOAD_GL_FUNCTION(PFNGLGENBUFFERSPROC, glGenBuffers);
+    LOAD_GL_FUNCTION(PFNGLBINDBUFFERPROC, glBindBuffer);
+    LOAD_GL_FUNCTION(PFNGLBUFFERDATAPROC, glBufferData);
+    LOAD_GL_FUNCTION(PFNGLGENVERTEXARRAYSPROC, glGenVertexArrays);
+    LOAD_GL_FUNCTION(PFNGLBINDVERTEXARRAYPROC, glBindVertexArray);
+    LOAD_GL_FUNCTION(PFNGLENABLEVERTEXATTRIBARRAYPROC, glEnableVertexAttribArray);
+    LOAD_GL_FUNCTION(PFNGLVERTEXATTRIBPOINTERPROC, glVertexAttribPointer);
+    LOAD_GL_FUNCTION(PFNGLVERTEXATTRIBDIVISORPROC, glVertexAttribDivisor);
+    LOAD_GL_FUNCTION(PFNGLDRAWARRAYSINSTANCEDPROC, glDrawArraysInstanced);
+    return GL_TRUE;
+}
+
+static GLuint compile_shader(GLenum type, const char* text)
+{
+    GLint status;
+    GLchar log[1024];
+    GLuint shader = glCreateShader(type);
+
+    glShaderSource(shader, 1, &text, NULL);
+    glCompileShader(shader);
+
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    if (status != GL_TRUE)
+    {
+        glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+        fprintf(stderr, "Failed to compile particle shader:\n%s\n", log);
+        return 0;
+    }
+
+    return shader;
+}
+
+static GLuint link_program(GLuint vertex_shader, GLuint fragment_shader)
+{
+    GLint status;
+    GLchar log[1024];
+    GLuint program = glCreateProgram();
+
+    glAttachShader(program, vertex_shader);
+    glAttachShader(program, fragment_shader);
+    glBindAttribLocation(program, 0, "position");
+    glBindAttribLocation(program, 1, "color");
+    glLinkProgram(program);
+
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (status != GL_TRUE)
+    {
+        glGetProgramInfoLog(program, sizeof(log), NULL, log);
+        fprintf(stderr, "Failed to link particle shader:\n%s\n", log);
+        return 0;
+    }
+
+    return program;
+}
+
+// Link a sprite program with the specified fragment shader, leaving the
+// program at zero on failure
+static void init_sprite_program(SpriteProgram* sprite_program,
+                                GLuint vertex_shader,
+                                const char* fragment_shader_text)
+{
+    GLuint program, fragment_shader;
+
+    fragment_shader = compile_shader(GL_FRAGMENT_SHADER, fragment_shader_text);
+    if (!fragment_shader)
+        return;
+
+    program = link_program(vertex_shader, fragment_shader);
+    if (!program)
+        return;
+
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "tex"), 0);
+    glUniform1f(glGetUniformLocation(program, "size"), PARTICLE_SIZE);
+    glUseProgram(0);
+
+    sprite_program->projection_location = glGetUniformLocation(program, "projection");
+    sprite_program->modelview_location = glGetUniformLocation(program, "modelview");
+    sprite_program->textured_location = glGetUniformLocation(program, "textured");
+    sprite_program->alpha_scale_location = glGetUniformLocation(program, "alpha_scale");
+    sprite_program->coverage_location = glGetUniformLocation(program, "coverage");
+    sprite_program->program = program;
+}
+
+// Set up the instanced renderer, leaving its programs at zero on failure
+static void init_sprite_renderer(GLFWwindow* window)
+{
+    GLuint vertex_shader;
+    const int major = glfwGetWindowAttrib(window, GLFW_CONTEXT_VERSION_MAJOR);
+    const int minor = glfwGetWindowAttrib(window, GLFW_CONTEXT_VERSION_MINOR);
+
+    if (major < 3 || (major == 3 && minor < 3))
+        return;
+
+    if (!load_sprite_functions())
+        return;
+
+    vertex_shader = compile_shader(GL_VERTEX_SHADER, sprite_vertex_shader_text);
+    if (!vertex_shader)
+        return;
+
+    if (transparency == TRANSPARENCY_WEIGHTED)
+    {
+        init_sprite_program(&sprite_renderer.weighted, vertex_shader,
+                            weighted_fragment_shader_text);
+    }
+
+    init_sprite_program(&sprite_renderer.blended, vertex_shader,
+                        sprite_fragment_shader_text);
+    if (!sprite_renderer.blended.program)
+        return;
+
+    // The sprites are per-instance attributes, while the corner of each quad
+    // is derived from gl_VertexID
+    glGenVertexArrays(1, &sprite_renderer.vertex_array);
+    glBindVertexArray(sprite_renderer.vertex_array);
+
+    glGenBuffers(1, &sprite_renderer.sprite_buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, sprite_renderer.sprite_buffer);
+
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Sprite),
+                          (void*) offsetof(Sprite, x));
+    glVertexAttribDivisor(0, 1);
+
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(Sprite),
+                          (void*) offsetof(Sprite, rgba));
+    glVertexAttribDivisor(1, 1);
+
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// Stream the sprites of this frame into a freshly orphaned buffer, so the
+// upload does not have to wait for the previous draw to finish
+static void upload_sprites(const DrawBuffer* buffer)
+{
+    glBindBuffer(GL_ARRAY_BUFFER, sprite_renderer.sprite_buffer);
+    glBufferData(GL_ARRAY_BUFFER, buffer->count * sizeof(Sprite),
+                 buffer->sprites, GL_STREAM_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// Draw the sprites of the specified vertex array with the program for the
+// current transparency mode. The alpha of each sprite is multiplied by the
+// alpha scale and then clamped to [0, 1].
+static void draw_sprites(GLuint vertex_array, int count, float alpha_scale)
+{
+    const SpriteProgram* program = &sprite_renderer.blended;
+
+    if (!count)
+        return;
+
+    if (transparency == TRANSPARENCY_WEIGHTED)
+        program = &sprite_renderer.weighted;
+
+    glUseProgram(program->program);
+    glUniformMatrix4fv(program->projection_location, 1, GL_FALSE,
+                       (const GLfloat*) projection);
+    glUniformMatrix4fv(program->modelview_location, 1, GL_FALSE,
+                       (const GLfloat*) modelview);
+    glUniform1i(program->textured_location, !wireframe);
+    glUniform1f(program->alpha_scale_location, alpha_scale);
+    glUniform1i(program->coverage_location,
+                transparency != TRANSPARENCY_ADDITIVE);
+
+    glBindVertexArray(vertex_array);
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, count);
+    glBindVertexArray(0);
+
+    glUseProgram(0);
+}
+
+
+//========================================================================
+// Weighted blended order-independent transparency. The scene is drawn into
+// an offscreen framebuffer, the particles are accumulated into floating point
+// targets sharing its depth buffer and are then composited over the scene in
+// a single full screen pass, so they can be drawn in any order.
+//========================================================================
+
+static PFNGLGENFRAMEBUFFERSPROC glGenFramebuffers;
+static PFNGLBINDFRAMEBUFFERPROC glBindFramebuffer;
+static PFNGLFRAMEBUFFERTEXTURE2DPROC glFramebufferTexture2D;
+static PFNGLFRAMEBUFFERRENDERBUFFERPROC glFramebufferRenderbuffer;
+static PFNGLCHECKFRAMEBUFFERSTATUSPROC glCheckFramebufferStatus;
+static PFNGLGENRENDERBUFFERSPROC glGenRenderbuffers;
+static PFNGLBINDRENDERBUFFERPROC glBindRenderbuffer;
+static PFNGLRENDERBUFFERSTORAGEPROC glRenderbufferStorage;
+static PFNGLDRAWBUFFERSPROC glDrawBuffers;
+static PFNGLCLEARBUFFERFVPROC glClearBufferfv;
+static PFNGLBLITFRAMEBUFFERPROC glBlitFramebuffer;
+static PFNGLBLENDFUNCSEPARATEPROC glBlendFuncSeparate;
+
+// Declared by some versions of gl.h but not all, so it gets a name of its own
+static PFNGLACTIVETEXTUREPROC active_texture;
+
+static const char* composite_vertex_shader_text =
+"#version 330\n"
+"void main()\n"
+"{\n"
+"    vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);\n"
+"    gl_Position = vec4(corner * 2.0 - 1.0, 0.0, 1.0);\n"
+"}\n";
+
+static const char* composite_fragment_shader_text =
+"#version 330\n"
+"uniform sampler2D accum;\n"
+"uniform sampler2D weight;\n"
+"out vec4 frag_color;\n"
+"void main()\n"
+"{\n"
+"    ivec2 texel = ivec2(gl_FragCoord.xy);\n"
+"    vec4 sum = texelFetch(accum, texel, 0);\n"
+"    float w = max(texelFetch(weight, texel, 0).r, 1e-5);\n"
+"    frag_color = vec4(sum.rgb / w, 1.0 - sum.a);\n"
+"}\n";
+
+static struct {
+    GLuint  composite_program; // Zero if not in use
+    GLuint  vertex_array;      // Empty, for the full screen triangle
+    GLuint  scene_framebuffer;
+    GLuint  particle_framebuffer;
+    GLuint  scene_color;       // Renderbuffer
+    GLuint  depth;             // Renderbuffer, shared by both framebuffers
+    GLuint  accum_texture;     // Weighted color sum and revealage
+    GLuint  weight_texture;    // Weight sum
+    int     width, height;     // Size of the targets
+} oit;
+
+static int load_oit_functions(void)
+{
+    LOAD_GL_FUNCTION(PFNGLGENFRAMEBUFFERSPROC, glGenFramebuffers);
+    LOAD_GL_FUNCTION(PFNGLBINDFRAMEBUFFERPROC, glBindFramebuffer);
+    LOAD_GL_FUNCTION(PFNGLFRAMEBUFFERTEXTURE2DPROC, glFramebufferTexture2D);
+    LOAD_GL_FUNCTION(PFNGLFRAMEBUFFERRENDERBUFFERPROC, glFramebufferRenderbuffer);
+    LOAD_GL_FUNCTION(PFNGLCHECKFRAMEBUFFERSTATUSPROC, glCheckFramebufferStatus);
+    LOAD_GL_FUNCTION(PFNGLGENRENDERBUFFERSPROC, glGenRenderbuffers);
+    LOAD_GL_FUNCTION(PFNGLBINDRENDERBUFFERPROC, glBindRenderbuffer);
+    LOAD_GL_FUNCTION(PFNGLRENDERBUFFERSTORAGEPROC, glRenderbufferStorage);
+    LOAD_GL_FUNCTION(PFNGLDRAWBUFFERSPROC, glDrawBuffers);
+    LOAD_GL_FUNCTION(PFNGLCLEARBUFFERFVPROC, glClearBufferfv);
+    LOAD_GL_FUNCTION(PFNGLBLITFRAMEBUFFERPROC, glBlitFramebuffer);
+    LOAD_GL_FUNCTION(PFNGLBLENDFUNCSEPARATEPROC, glBlendFuncSeparate);
+
+    active_texture = (PFNGLACTIVETEXTUREPROC) glfwGetProcAddress("glActiveTexture");
+    return active_texture != NULL;
+}
+
+static GLuint create_target_texture(void)
+{
+    GLuint texture;
+
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    return texture;
+}
+
+// (Re)allocate the targets for the specified framebuffer size
+static int resize_oit_targets(int width, int height)
+{
+    const GLenum draw_buffers[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+
+    glBindRenderbuffer(GL_RENDERBUFFER, oit.scene_color);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, oit.depth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    glBindTexture(GL_TEXTURE_2D, oit.accum_texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, width, height, 0,
+                 GL_RGBA, GL_FLOAT, NULL);
+    glBindTexture(GL_TEXTURE_2D, oit.weight_texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R16F, width, height, 0,
+                 GL_RED, GL_FLOAT, NULL);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, oit.scene_framebuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                              GL_RENDERBUFFER, oit.scene_color);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                              GL_RENDERBUFFER, oit.depth);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        return GL_FALSE;
+
+    glBindFramebuffer(GL_FRAMEBUFFER, oit.particle_framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                           GL_TEXTURE_2D, oit.accum_texture, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1,
+                           GL_TEXTURE_2D, oit.weight_texture, 0);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                              GL_RENDERBUFFER, oit.depth);
+    glDrawBuffers(2, draw_buffers);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        return GL_FALSE;
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    oit.width = width;
+    oit.height = height;
+    return GL_TRUE;
+}
+
+// Set up weighted blended OIT, which needs the weighted sprite program
+static int init_oit(GLFWwindow* window)
+{
+    GLuint program, vertex_shader, fragment_shader;
+    int width, height;
+
+    if (!sprite_renderer.weighted.program || !load_oit_functions())
+        return GL_FALSE;
+
+    vertex_shader = compile_shader(GL_VERTEX_SHADER, composite_vertex_shader_text);
+    fragment_shader = compile_shader(GL_FRAGMENT_SHADER, composite_fragment_shader_text);
+    if (!vertex_shader || !fragment_shader)
+        return GL_FALSE;
+
+    program = link_program(vertex_shader, fragment_shader);
+    if (!program)
+        return GL_FALSE;
+
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "accum"), 0);
+    glUniform1i(glGetUniformLocation(program, "weight"), 1);
+    glUseProgram(0);
+
+    glGenVertexArrays(1, &oit.vertex_array);
+    glGenFramebuffers(1, &oit.scene_framebuffer);
+    glGenFramebuffers(1, &oit.particle_framebuffer);
+    glGenRenderbuffers(1, &oit.scene_color);
+    glGenRenderbuffers(1, &oit.depth);
+    oit.accum_texture = create_target_texture();
+    oit.weight_texture = create_target_texture();
+
+    glfwGetFramebufferSize(window, &width, &height);
+    if (!resize_oit_targets(width, height))
+        return GL_FALSE;
+
+    oit.composite_program = program;
+    return GL_TRUE;
+}
+
+// Direct the scene into the offscreen framebuffer
+static void begin_oit_scene(GLFWwindow* window)
+{
+    int width, height;
+
+    glfwGetFramebufferSize(window, &width, &height);
+    if (width != oit.width || height != oit.height)
+        resize_oit_targets(width, height);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, oit.scene_framebuffer);
+}
+
+// Direct the particles into the accumulation targets
+static void begin_oit_particles(void)
+{
+    const GLfloat accum_clear[4] = { 0.f, 0.f, 0.f, 1.f };
+    const GLfloat weight_clear[4] = { 0.f, 0.f, 0.f, 0.f };
+
+    glBindFramebuffer(GL_FRAMEBUFFER, oit.particle_framebuffer);
+    glClearBufferfv(GL_COLOR, 0, accum_clear);
+    glClearBufferfv(GL_COLOR, 1, weight_clear);
+
+    // Colors and weights are summed, while the revealage is multiplied by
+    // one minus the alpha of every particle
+    glBlendFuncSeparate(GL_ONE, GL_ONE, GL_ZERO, GL_ONE_MINUS_SRC_ALPHA);
+}
+
+// Blend the average particle color over the scene by their total coverage
+static void composite_oit_particles(void)
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, oit.scene_framebuffer);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glDisable(GL_DEPTH_TEST);
+    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+
+    active_texture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, oit.weight_texture);
+    active_texture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, oit.accum_texture);
+
+    glUseProgram(oit.composite_program);
+    glBindVertexArray(oit.vertex_array);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    glBindVertexArray(0);
+    glUseProgram(0);
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+    active_texture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    active_texture(GL_TEXTURE0);
+
+    glPolygonMode(GL_FRONT_AND_BACK, wireframe ? GL_LINE : GL_FILL);
+    glEnable(GL_DEPTH_TEST);
+}
+
+// Copy the finished scene to the window
+static void end_oit_scene(void)
+{
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, oit.scene_framebuffer);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    glBlitFramebuffer(0, 0, oit.width, oit.height,
+                      0, 0, oit.width, oit.height,
+                      GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+
+//========================================================================
+// GPU particle simulation. The particle state lives in two buffers on the
+// GPU and each step is a transform feedback pass from one buffer into the
+// other, running the same integrator and birth schedule as the CPU engine.
+// The particle with serial number n lives in slot n % capacity, so dead
+// particles are simply overwritten and nothing ever has to be moved.
+//========================================================================
+
+static PFNGLTRANSFORMFEEDBACKVARYINGSPROC glTransformFeedbackVaryings;
+static PFNGLBINDBUFFERBASEPROC glBindBufferBase;
+static PFNGLBEGINTRANSFORMFEEDBACKPROC glBeginTransformFeedback;
+static PFNGLENDTRANSFORMFEEDBACKPROC glEndTransformFeedback;
+static PFNGLUNIFORM1UIPROC glUniform1ui;
+static PFNGLGETBUFFERSUBDATAPROC glGetBufferSubData;
+
+// The layout of a particle in the GPU buffers
+typedef struct
+{
+    GLfloat x, y, z;      // Position in space
+    GLfloat vx, vy, vz;   // Velocity vector
+    GLfloat r, g, b;      // Color of particle
+    GLfloat life;         // Life of particle (1.0 = newborn, <= 0.0 = dead)
+} GPUParticle;
+
+#define STRINGIFY(x) #x
+#define EXPAND_STRINGIFY(x) STRINGIFY(x)
+
+static const char* simulation_vertex_shader_text =
+"#version 330\n"
+"#define M_PI " EXPAND_STRINGIFY(M_PI) "\n"
+"#define LIFE_SPAN " EXPAND_STRINGIFY(LIFE_SPAN) "\n"
+"#define GRAVITY " EXPAND_STRINGIFY(GRAVITY) "\n"
+"#define VELOCITY " EXPAND_STRINGIFY(VELOCITY) "\n"
+"#define FRICTION " EXPAND_STRINGIFY(FRICTION) "\n"
+"#define FOUNTAIN_HEIGHT " EXPAND_STRINGIFY(FOUNTAIN_HEIGHT) "\n"
+"#define FOUNTAIN_R2 " EXPAND_STRINGIFY(FOUNTAIN_R2) "\n"
+"#define FOUNTAIN_TOP " EXPAND_STRINGIFY(FOUNTAIN_TOP) "\n"
+"#define FLOOR_TOP " EXPAND_STRINGIFY(FLOOR_TOP) "\n"
+"uniform float t;\n"
+"uniform float dt;\n"
+"uniform int capacity;\n"
+"uniform int first_slot;\n"
+"uniform int births;\n"
+"uniform uint first_serial;\n"
+"uniform uint seed_key;\n"
+"uniform float birth_start;\n"
+"uniform float birth_interval;\n"
+"in vec3 position;\n"
+"in vec3 velocity;\n"
+"in vec4 color;\n"
+"out vec3 next_position;\n"
+"out vec3 next_velocity;\n"
+"out vec4 next_color;\n"
+"uint rng_hash(uint v)\n"
+"{\n"
+"    uint state = v * 747796405u + 2891336453u;\n"
+"    uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;\n"
+"    return (word >> 22u) ^ word;\n"
+"}\n"
+"void main()\n"
+"{\n"
+"    vec3 p = position;\n"
+"    vec3 v = velocity;\n"
+"    vec4 c = color;\n"
+"    float h = dt;\n"
+"    int j = gl_VertexID - first_slot;\n"
+"    if (j < 0)\n"
+"        j += capacity;\n"
+"    if (j < births)\n"
+"    {\n"
+"        float age = birth_start - float(j + 1) * birth_interval;\n"
+"        float bt = t + age;\n"
+"        uint key = rng_hash((first_serial + uint(j)) ^ seed_key);\n"
+"        uint r0 = rng_hash(key);\n"
+"        uint r1 = rng_hash(1u ^ key);\n"
+"        float xy_angle = (2.0 * M_PI / 4096.0) * float(r1 & 4095u);\n"
+"        float speed = VELOCITY * (0.8 + 0.1 * (sin(0.5 * bt) + sin(1.31 * bt)));\n"
+"        p = vec3(0.0, 0.0, FOUNTAIN_HEIGHT);\n"
+"        v = vec3(0.4 * cos(xy_angle), 0.4 * sin(xy_angle),\n"
+"                 0.7 + (0.3 / 4096.0) * float(r0 & 4095u)) * speed;\n"
+"        c = vec4(0.7 + 0.3 * sin(0.34 * bt + 0.1),\n"
+"                 0.6 + 0.4 * sin(0.63 * bt + 1.1),\n"
+"                 0.6 + 0.4 * sin(0.91 * bt + 2.1),\n"
+"                 1.0);\n"
+"        h = age;\n"
+"    }\n"
+"    float life = c.a - h * (1.0 / LIFE_SPAN);\n"
+"    float vz = v.z - GRAVITY * h;\n"
+"    vec3 q = vec3(p.xy + v.xy * h, p.z + vz * h);\n"
+"    bool falling = vz < 0.0;\n"
+"    bool on_fountain = falling && q.x * q.x + q.y * q.y < FOUNTAIN_R2 && q.z < FOUNTAIN_TOP;\n"
+"    bool on_floor = falling && !on_fountain && q.z < FLOOR_TOP;\n"
+"    float plane = on_fountain ? FOUNTAIN_TOP : FLOOR_TOP;\n"
+"    if (on_fountain || on_floor)\n"
+"    {\n"
+"        vz = -FRICTION * vz;\n"
+"        q.z = plane + FRICTION * (plane - q.z);\n"
+"    }\n"
+"    bool alive = life > 0.0;\n"
+"    next_position = alive ? q : p;\n"
+"    next_velocity = vec3(v.xy, alive ? vz : v.z);\n"
+"    next_color = vec4(c.rgb, life);\n"
+"}\n";
+
+static struct {
+    GLuint  program;          // Zero unless the GPU simulation is in use
+    GLuint  buffers[2];
+    GLuint  update_arrays[2]; // Vertex arrays for simulating from each buffer
+    GLuint  draw_arrays[2];   // Vertex arrays for drawing from each buffer
+    int     current;          // Index of the buffer holding the latest state
+    GLint   t_location;
+    GLint   dt_location;
+    GLint   first_slot_location;
+    GLint   births_location;
+    GLint   first_serial_location;
+    GLint   birth_start_location;
+} gpu_simulation;
+
+static int load_simulation_functions(void)
+{
+    LOAD_GL_FUNCTION(PFNGLTRANSFORMFEEDBACKVARYINGSPROC, glTransformFeedbackVaryings);
+    LOAD_GL_FUNCTION(PFNGLBINDBUFFERBASEPROC, glBindBufferBase);
+    LOAD_GL_FUNCTION(PFNGLBEGINTRANSFORMFEEDBACKPROC, glBeginTransformFeedback);
+    LOAD_GL_FUNCTION(PFNGLENDTRANSFORMFEEDBACKPROC, glEndTransformFeedback);
+    LOAD_GL_FUNCTION(PFNGLUNIFORM1UIPROC, glUniform1ui);
+    LOAD_GL_FUNCTION(PFNGLGETBUFFERSUBDATAPROC, glGetBufferSubData);
+    return GL_TRUE;
+}
+
+static int init_gpu_simulation(GLFWwindow* window)
+{
+    GLuint program, shader;
+    GLint status;
+    GLchar log[1024];
+    GPUParticle* initial;
+    int i;
+    const GLchar* varyings[] = { "next_position", "next_velocity", "next_color" };
+    const int major = glfwGetWindowAttrib(window, GLFW_CONTEXT_VERSION_MAJOR);
+    const int minor = glfwGetWindowAttrib(window, GLFW_CONTEXT_VERSION_MINOR);
+
+    if (major < 3 || (major == 3 && minor < 3))
+        return GL_FALSE;
+
+    if (!load_sprite_functions() || !load_simulation_functions())
+        return GL_FALSE;
+
+    shader = compile_shader(GL_VERTEX_SHADER, simulation_vertex_shader_text);
+    if (!shader)
+        return GL_FALSE;
+
+    program = glCreateProgram();
+    glAttachShader(program, shader);
+    glBindAttribLocation(program, 0, "position");
+    glBindAttribLocation(program, 1, "velocity");
+    glBindAttribLocation(program, 2, "color");
+    glTransformFeedbackVaryings(program, 3, varyings, GL_INTERLEAVED_ATTRIBS);
+    glLinkProgram(program);
+
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (status != GL_TRUE)
+    {
+        glGetProgramInfoLog(program, sizeof(log), NULL, log);
+        fprintf(stderr, "Failed to link particle simulation shader:\n%s\n", log);
+        return GL_FALSE;
+    }
+
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "capacity"), particles.capacity);
+    glUniform1ui(glGetUniformLocation(program, "seed_key"), rng_hash(random_seed));
+    glUniform1f(glGetUniformLocation(program, "birth_interval"), birth_interval);
+    glUseProgram(0);
+
+    gpu_simulation.t_location = glGetUniformLocation(program, "t");
+    gpu_simulation.dt_location = glGetUniformLocation(program, "dt");
+    gpu_simulation.first_slot_location = glGetUniformLocation(program, "first_slot");
+    gpu_simulation.births_location = glGetUniformLocation(program, "births");
+    gpu_simulation.first_serial_location = glGetUniformLocation(program, "first_serial");
+    gpu_simulation.birth_start_location = glGetUniformLocation(program, "birth_start");
+
+    // All particles start out dead
+    initial = calloc(particles.capacity, sizeof(GPUParticle));
+    if (!initial)
+        return GL_FALSE;
+
+    glGenBuffers(2, gpu_simulation.buffers);
+    glGenVertexArrays(2, gpu_simulation.update_arrays);
+    glGenVertexArrays(2, gpu_simulation.draw_arrays);
+
+    for (i = 0;  i < 2;  i++)
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, gpu_simulation.buffers[i]);
+        glBufferData(GL_ARRAY_BUFFER, particles.capacity * sizeof(GPUParticle),
+                     initial, GL_DYNAMIC_COPY);
+
+        glBindVertexArray(gpu_simulation.update_arrays[i]);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(GPUParticle),
+                              (void*) offsetof(GPUParticle, x));
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(GPUParticle),
+                              (void*) offsetof(GPUParticle, vx));
+        glEnableVertexAttribArray(2);
+        glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, sizeof(GPUParticle),
+                              (void*) offsetof(GPUParticle, r));
+
+        // The sprite renderer takes the color and life as its color
+        // attribute and turns the life into intensity
+        glBindVertexArray(gpu_simulation.draw_arrays[i]);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(GPUParticle),
+                              (void*) offsetof(GPUParticle, x));
+        glVertexAttribDivisor(0, 1);
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(GPUParticle),
+                              (void*) offsetof(GPUParticle, r));
+        glVertexAttribDivisor(1, 1);
+    }
+
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    free(initial);
+
+    gpu_simulation.program = program;
+    return GL_TRUE;
+}
+
+// The GPU counterpart of particle_engine
+static void gpu_particle_engine(double t, float dt)
+{
+    float dt2;
+
+    glUseProgram(gpu_simulation.program);
+    glUniform1f(gpu_simulation.t_location, (float) t);
+    glEnable(GL_RASTERIZER_DISCARD);
+
+    while (dt > 0.f)
+    {
+        dt2 = dt < MIN_DELTA_T ? dt : MIN_DELTA_T;
+
+        schedule_births(dt2, particles.capacity);
+
+        glUniform1f(gpu_simulation.dt_location, dt2);
+        glUniform1i(gpu_simulation.first_slot_location,
+                    (int) (step.serial % particles.capacity));
+        glUniform1i(gpu_simulation.births_location, step.births);
+        glUniform1ui(gpu_simulation.first_serial_location, (GLuint) step.serial);
+        glUniform1f(gpu_simulation.birth_start_location, step.birth_start);
+
+        glBindVertexArray(gpu_simulation.update_arrays[gpu_simulation.current]);
+        glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0,
+                         gpu_simulation.buffers[!gpu_simulation.current]);
+
+        glBeginTransformFeedback(GL_POINTS);
+        glDrawArrays(GL_POINTS, 0, particles.capacity);
+        glEndTransformFeedback();
+
+        gpu_simulation.current = !gpu_simulation.current;
+        particle_updates += particles.capacity;
+
+        if (step.births)
+        {
+            set_glow(t + birth_age(step.births - 1));
+            particle_births += step.births;
+        }
+
+        dt -= dt2;
+    }
+
+    glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+    glBindVertexArray(0);
+    glDisable(GL_RASTERIZER_DISCARD);
+    glUseProgram(0);
+}
+
+
+//========================================================================
+// Check the GPU simulation against the CPU simulation. Both are run for the
+// same frames from the same seed and every live GPU particle is matched
+// with the CPU particle of the same age.
+//========================================================================
+
+static int compare_life(const void* a, const void* b)
+{
+    const float la = particles.life[*(const int*) a];
+    const float lb = particles.life[*(const int*) b];
+    return (la > lb) - (la < lb);
+}
+
+static float max_difference(float a0, float a1, float a2,
+                            float b0, float b1, float b2)
+{
+    float d = fabsf(a0 - b0);
+    if (fabsf(a1 - b1) > d)
+        d = fabsf(a1 - b1);
+    if (fabsf(a2 - b2) > d)
+        d = fabsf(a2 - b2);
+    return d;
+}
+
+static int check_gpu_simulation(int frames)
+{
+    const float dt = 1.f / 60.f;
+    const float life_tolerance = 0.25f / particles.capacity;
+    float position_error = 0.f, velocity_error = 0.f, color_error = 0.f;
+    float dp, dv, dc;
+    double t;
+    int i, k, lo, hi, gpu_live = 0, mismatches = 0;
+    int* order;
+    GPUParticle* gpu;
+
+    order = calloc(particles.capacity, sizeof(int));
+    gpu = calloc(particles.capacity, sizeof(GPUParticle));
+    if (!order || !gpu)
+        return GL_FALSE;
+
+    for (i = 0, t = 0.0;  i < frames;  i++, t += dt)
+        particle_engine(t, dt);
+
+    min_age = 0.f;
+    birth_serial = 0;
+
+    for (i = 0, t = 0.0;  i < frames;  i++, t += dt)
+        gpu_particle_engine(t, dt);
+
+    glBindBuffer(GL_ARRAY_BUFFER, gpu_simulation.buffers[gpu_simulation.current]);
+    glGetBufferSubData(GL_ARRAY_BUFFER, 0, particles.capacity * sizeof(GPUParticle), gpu);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    // Sort the CPU particles by life, then look up each GPU particle
+    for (i = 0;  i < particles.live;  i++)
+        order[i] = i;
+
+    qsort(order, particles.live, sizeof(int), compare_life);
+
+    for (i = 0;  i < particles.capacity;  i++)
+    {
+        if (gpu[i].life <= 0.f)
+            continue;
+
+        gpu_live++;
+
+        lo = 0;
+        hi = particles.live;
+        while (lo < hi)
+        {
+            const int mid = (lo + hi) / 2;
+            if (particles.life[order[mid]] < gpu[i].life)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        // The closest CPU particle is either at or just before the bound
+        k = -1;
+        if (lo < particles.live)
+            k = order[lo];
+        if (lo > 0 &&
+            (k == -1 || gpu[i].life - particles.life[order[lo - 1]] <
+                        particles.life[k] - gpu[i].life))
+        {
+            k = order[lo - 1];
+        }
+
+        if (k == -1 || fabsf(particles.life[k] - gpu[i].life) > life_tolerance)
+        {
+            mismatches++;
+            continue;
+        }
+
+        dp = max_difference(gpu[i].x, gpu[i].y, gpu[i].z,
+                            particles.x[k], particles.y[k], particles.z[k]);
+        dv = max_difference(gpu[i].vx, gpu[i].vy, gpu[i].vz,
+                            particles.vx[k], particles.vy[k], particles.vz[k]);
+        dc = max_difference(gpu[i].r, gpu[i].g, gpu[i].b,
+                            particles.r[k], particles.g[k], particles.b[k]);
+
+        // A particle that bounced in one simulation but not yet in the other
+        // is off by a whole step, so count those rather than failing on them
+        if (dp > 1e-2f || dv > 1e-1f || dc > 1e-3f)
+        {
+            mismatches++;
+            continue;
+        }
+
+        if (dp > position_error)
+            position_error = dp;
+        if (dv > velocity_error)
+            velocity_error = dv;
+        if (dc > color_error)
+            color_error = dc;
+    }
+
+    printf("%i frames, %i CPU particles, %i GPU particles\n",
+           frames, particles.live, gpu_live);
+    printf("%i mismatched, max difference: position %g, velocity %g, color %g\n",
+           mismatches, position_error, velocity_error, color_error);
+
+    free(order);
+    free(gpu);
+
+    // Allow for a few particles that were born or bounced a step apart
+    return abs(gpu_live - particles.live) + mismatches <= particles.capacity / 1000;
 }
 
 
 //========================================================================
-// Draw all active particles. We use OpenGL 1.1 vertex
-// arrays for this in order to accelerate the drawing.
+// Draw particles with OpenGL 1.1 vertex arrays. This is used when the
+// instanced renderer is not available.
 //========================================================================
 
 #define BATCH_PARTICLES 70  // Number of particles to draw in each batch
@@ -389,16 +2604,14 @@ static void particle_engine(double t, float dt)
                             // the L1 data cache on most CPUs)
 #define PARTICLE_VERTS  4   // Number of vertices per particle
 
-static void draw_particles(GLFWwindow* window, double t, float dt)
+static void draw_sprites_batched(const DrawBuffer* buffer)
 {
     int i, particle_count;
-    Vertex vertex_array[BATCH_PARTICLES * PARTICLE_VERTS];
+    static Vertex vertex_array[BATCH_PARTICLES * PARTICLE_VERTS];
     Vertex* vptr;
-    float alpha;
     GLuint rgba;
     Vec3 quad_lower_left, quad_lower_right;
-    GLfloat mat[16];
-    PARTICLE* pptr;
+    float x, y, z;
 
     // Here comes the real trick with flat single primitive objects (s.c.
     // "billboards"): We must rotate the textured primitive so that it
@@ -409,37 +2622,21 @@ static void draw_particles(GLFWwindow* window, double t, float dt)
     //   3) Translate it according to the particle position
     // Note that 1) and 2) is the same for all particles (done only once).
 
-    // Get modelview matrix. We will only use the upper left 3x3 part of
-    // the matrix, which represents the rotation.
-    glGetFloatv(GL_MODELVIEW_MATRIX, mat);
-
     // 1) & 2) We do it in one swift step:
     // Although not obvious, the following six lines represent two matrix/
     // vector multiplications. The matrix is the inverse 3x3 rotation
-    // matrix (i.e. the transpose of the same matrix), and the two vectors
-    // represent the lower left corner of the quad, PARTICLE_SIZE/2 *
-    // (-1,-1,0), and the lower right corner, PARTICLE_SIZE/2 * (1,-1,0).
+    // matrix (i.e. the transpose of the upper left 3x3 part of the
+    // modelview matrix), and the two vectors represent the lower left
+    // corner of the quad, PARTICLE_SIZE/2 * (-1,-1,0), and the lower right
+    // corner, PARTICLE_SIZE/2 * (1,-1,0).
     // The upper left/right corners of the quad is always the negative of
     // the opposite corners (regardless of rotation).
-    quad_lower_left.x = (-PARTICLE_SIZE / 2) * (mat[0] + mat[1]);
-    quad_lower_left.y = (-PARTICLE_SIZE / 2) * (mat[4] + mat[5]);
-    quad_lower_left.z = (-PARTICLE_SIZE / 2) * (mat[8] + mat[9]);
-    quad_lower_right.x = (PARTICLE_SIZE / 2) * (mat[0] - mat[1]);
-    quad_lower_right.y = (PARTICLE_SIZE / 2) * (mat[4] - mat[5]);
-    quad_lower_right.z = (PARTICLE_SIZE / 2) * (mat[8] - mat[9]);
-
-    // Don't update z-buffer, since all particles are transparent!
-    glDepthMask(GL_FALSE);
-
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE);
-
-    // Select particle texture
-    if (!wireframe)
-    {
-        glEnable(GL_TEXTURE_2D);
-        glBindTexture(GL_TEXTURE_2D, particle_tex_id);
-    }
+    quad_lower_left.x = (-PARTICLE_SIZE / 2) * (modelview[0][0] + modelview[0][1]);
+    quad_lower_left.y = (-PARTICLE_SIZE / 2) * (modelview[1][0] + modelview[1][1]);
+    quad_lower_left.z = (-PARTICLE_SIZE / 2) * (modelview[2][0] + modelview[2][1]);
+    quad_lower_right.x = (PARTICLE_SIZE / 2) * (modelview[0][0] - modelview[0][1]);
+    quad_lower_right.y = (PARTICLE_SIZE / 2) * (modelview[1][0] - modelview[1][1]);
+    quad_lower_right.z = (PARTICLE_SIZE / 2) * (modelview[2][0] - modelview[2][1]);
 
     // Set up vertex arrays. We use interleaved arrays, which is easier to
     // handle (in most situations) and it gives a linear memeory access
@@ -449,89 +2646,59 @@ static void draw_particles(GLFWwindow* window, double t, float dt)
     // Most OpenGL cards / drivers are optimized for this format.
     glInterleavedArrays(GL_T2F_C4UB_V3F, 0, vertex_array);
 
-    // Wait for particle physics thread to be done
-    mtx_lock(&thread_sync.particles_lock);
-    while (!glfwWindowShouldClose(window) &&
-            thread_sync.p_frame <= thread_sync.d_frame)
-    {
-        struct timespec ts;
-        clock_gettime(CLOCK_REALTIME, &ts);
-        ts.tv_nsec += 100000000;
-        cnd_timedwait(&thread_sync.p_done, &thread_sync.particles_lock, &ts);
-    }
-
-    // Store the frame time and delta time for the physics thread
-    thread_sync.t = t;
-    thread_sync.dt = dt;
-
-    // Update frame counter
-    thread_sync.d_frame++;
-
     // Loop through all particles and build vertex arrays.
     particle_count = 0;
     vptr = vertex_array;
-    pptr = particles;
 
-    for (i = 0;  i < MAX_PARTICLES;  i++)
+    for (i = 0;  i < buffer->count;  i++)
     {
-        if (pptr->active)
-        {
-            // Calculate particle intensity (we set it to max during 75%
-            // of its life, then it fades out)
-            alpha =  4.f * pptr->life;
-            if (alpha > 1.f)
-                alpha = 1.f;
-
-            // Convert color from float to 8-bit (store it in a 32-bit
-            // integer using endian independent type casting)
-            ((GLubyte*) &rgba)[0] = (GLubyte)(pptr->r * 255.f);
-            ((GLubyte*) &rgba)[1] = (GLubyte)(pptr->g * 255.f);
-            ((GLubyte*) &rgba)[2] = (GLubyte)(pptr->b * 255.f);
-            ((GLubyte*) &rgba)[3] = (GLubyte)(alpha * 255.f);
-
-            // 3) Translate the quad to the correct position in modelview
-            // space and store its parameters in vertex arrays (we also
-            // store texture coord and color information for each vertex).
-
-            // Lower left corner
-            vptr->s    = 0.f;
-            vptr->t    = 0.f;
-            vptr->rgba = rgba;
-            vptr->x    = pptr->x + quad_lower_left.x;
-            vptr->y    = pptr->y + quad_lower_left.y;
-            vptr->z    = pptr->z + quad_lower_left.z;
-            vptr ++;
-
-            // Lower right corner
-            vptr->s    = 1.f;
-            vptr->t    = 0.f;
-            vptr->rgba = rgba;
-            vptr->x    = pptr->x + quad_lower_right.x;
-            vptr->y    = pptr->y + quad_lower_right.y;
-            vptr->z    = pptr->z + quad_lower_right.z;
-            vptr ++;
-
-            // Upper right corner
-            vptr->s    = 1.f;
-            vptr->t    = 1.f;
-            vptr->rgba = rgba;
-            vptr->x    = pptr->x - quad_lower_left.x;
-            vptr->y    = pptr->y - quad_lower_left.y;
-            vptr->z    = pptr->z - quad_lower_left.z;
-            vptr ++;
-
-            // Upper left corner
-            vptr->s    = 0.f;
-            vptr->t    = 1.f;
-            vptr->rgba = rgba;
-            vptr->x    = pptr->x - quad_lower_right.x;
-            vptr->y    = pptr->y - quad_lower_right.y;
-            vptr->z    = pptr->z - quad_lower_right.z;
-            vptr ++;
-
-            // Increase count of drawable particles
-            particle_count ++;
-        }
+        rgba = buffer->sprites[i].rgba;
+
+        // 3) Translate the quad to the correct position in modelview
+        // space and store its parameters in vertex arrays (we also
+        // store texture coord and color information for each vertex).
+        x = buffer->sprites[i].x;
+        y = buffer->sprites[i].y;
+        z = buffer->sprites[i].z;
+
+        // Lower left corner
+        vptr->s    = 0.f;
+        vptr->t    = 0.f;
+        vptr->rgba = rgba;
+        vptr->x    = x + quad_lower_left.x;
+        vptr->y    = y + quad_lower_left.y;
+        vptr->z    = z + quad_lower_left.z;
+        vptr ++;
+
+        // Lower right corner
+        vptr->s    = 1.f;
+        vptr->t    = 0.f;
+        vptr->rgba = rgba;
+        vptr->x    = x + quad_lower_right.x;
+        vptr->y    = y + quad_lower_right.y;
+        vptr->z    = z + quad_lower_right.z;
+        vptr ++;
+
+        // Upper right corner
+        vptr->s    = 1.f;
+        vptr->t    = 1.f;
+        vptr->rgba = rgba;
+        vptr->x    = x - quad_lower_left.x;
+        vptr->y    = y - quad_lower_left.y;
+        vptr->z    = z - quad_lower_left.z;
+        vptr ++;
+
+        // Upper left corner
+        vptr->s    = 0.f;
+        vptr->t    = 1.f;
+        vptr->rgba = rgba;
+        vptr->x    = x - quad_lower_right.x;
+        vptr->y    = y - quad_lower_right.y;
+        vptr->z    = z - quad_lower_right.z;
+        vptr ++;
+
+        // Increase count of drawable particles
+        particle_count ++;
 
         // If we have filled up one batch of particles, draw it as a set
         // of quads using glDrawArrays.
@@ -544,15 +2711,8 @@ static void draw_particles(GLFWwindow* window, double t, float dt)
             particle_count = 0;
             vptr = vertex_array;
         }
-
-        // Next particle
-        pptr++;
     }
 
-    // We are done with the particle data
-    mtx_unlock(&thread_sync.particles_lock);
-    cnd_signal(&thread_sync.d_done);
-
     // Draw final batch of particles (if any)
     glDrawArrays(GL_QUADS, 0, PARTICLE_VERTS * particle_count);
 
@@ -561,8 +2721,88 @@ static void draw_particles(GLFWwindow* window, double t, float dt)
     glDisableClientState(GL_VERTEX_ARRAY);
     glDisableClientState(GL_TEXTURE_COORD_ARRAY);
     glDisableClientState(GL_COLOR_ARRAY);
+}
+
+
+//========================================================================
+// Draw all active particles
+//========================================================================
+
+// Take the particles of the current frame from the physics thread
+static const DrawBuffer* take_particles(double t, float dt)
+{
+    int frame, published;
+
+    // Wait for the particle physics thread to publish the current frame
+    frame = thread_sync.d_frame;
+    while ((published = atomic_load_int(&thread_sync.p_frame)) <= frame)
+        futex_wait(&thread_sync.frame_changed, &thread_sync.p_frame, published);
+
+    acquire_particles();
+
+    // Store the frame time, delta time and view for the physics thread and
+    // let it start on the next frame while we draw this one
+    thread_sync.t = t;
+    thread_sync.dt = dt;
+    thread_sync.view_depth[0] = modelview[0][2];
+    thread_sync.view_depth[1] = modelview[1][2];
+    thread_sync.view_depth[2] = modelview[2][2];
+    thread_sync.view_depth[3] = modelview[3][2];
+    atomic_add_int(&thread_sync.d_frame, 1);
+    futex_wake(&thread_sync.frame_changed);
+
+    return draw_buffers + draw_buffer_front;
+}
+
+static void draw_particles(GLFWwindow* window, double t, float dt)
+{
+    const DrawBuffer* buffer = NULL;
+
+    // The GPU simulation runs in this thread, right before drawing
+    if (gpu_simulation.program)
+        gpu_particle_engine(t, dt);
+    else
+        buffer = take_particles(t, dt);
+
+    // Don't update z-buffer, since all particles are transparent!
+    glDepthMask(GL_FALSE);
+
+    glEnable(GL_BLEND);
+
+    if (transparency == TRANSPARENCY_WEIGHTED)
+        begin_oit_particles();
+    else if (transparency == TRANSPARENCY_SORTED)
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    else
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+
+    // Select particle texture
+    if (!wireframe)
+    {
+        glEnable(GL_TEXTURE_2D);
+        glBindTexture(GL_TEXTURE_2D, particle_tex_id);
+    }
+
+    if (gpu_simulation.program)
+    {
+        // The GPU particles hold their life instead of intensity, which is
+        // at max during 75% of the life
+        draw_sprites(gpu_simulation.draw_arrays[gpu_simulation.current],
+                     particles.capacity, 4.f);
+    }
+    else if (sprite_renderer.blended.program)
+    {
+        upload_sprites(buffer);
+        draw_sprites(sprite_renderer.vertex_array, buffer->count, 1.f);
+    }
+    else
+        draw_sprites_batched(buffer);
 
     glDisable(GL_TEXTURE_2D);
+
+    if (transparency == TRANSPARENCY_WEIGHTED)
+        composite_oit_particles();
+
     glDisable(GL_BLEND);
 
     glDepthMask(GL_TRUE);
@@ -745,6 +2985,15 @@ static void setup_lights(void)
 {
     float l1pos[4], l1amb[4], l1dif[4], l1spec[4];
     float l2pos[4], l2amb[4], l2dif[4], l2spec[4];
+    const float* l3pos = draw_buffers[draw_buffer_front].glow_pos;
+    const float* l3col = draw_buffers[draw_buffer_front].glow_color;
+
+    // The GPU simulation runs in this thread and sets the glow directly
+    if (gpu_simulation.program)
+    {
+        l3pos = glow_pos;
+        l3col = glow_color;
+    }
 
     // Set light source 1 parameters
     l1pos[0] =  0.f;  l1pos[1] = -9.f; l1pos[2] =   8.f;  l1pos[3] = 1.f;
@@ -766,9 +3015,9 @@ static void setup_lights(void)
     glLightfv(GL_LIGHT2, GL_AMBIENT, l2amb);
     glLightfv(GL_LIGHT2, GL_DIFFUSE, l2dif);
     glLightfv(GL_LIGHT2, GL_SPECULAR, l2spec);
-    glLightfv(GL_LIGHT3, GL_POSITION, glow_pos);
-    glLightfv(GL_LIGHT3, GL_DIFFUSE, glow_color);
-    glLightfv(GL_LIGHT3, GL_SPECULAR, glow_color);
+    glLightfv(GL_LIGHT3, GL_POSITION, l3pos);
+    glLightfv(GL_LIGHT3, GL_DIFFUSE, l3col);
+    glLightfv(GL_LIGHT3, GL_SPECULAR, l3col);
 
     glEnable(GL_LIGHT1);
     glEnable(GL_LIGHT2);
@@ -785,7 +3034,6 @@ static void draw_scene(GLFWwindow* window, double t)
     double xpos, ypos, zpos, angle_x, angle_y, angle_z;
     static double t_old = 0.0;
     float dt;
-    mat4x4 projection;
 
     // Calculate frame-to-frame delta time
     dt = (float) (t - t_old);
@@ -796,23 +3044,29 @@ static void draw_scene(GLFWwindow* window, double t)
                        aspect_ratio,
                        1.0, 60.0);
 
+    if (transparency == TRANSPARENCY_WEIGHTED)
+        begin_oit_scene(window);
+
     glClearColor(0.1f, 0.1f, 0.1f, 1.f);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
     glMatrixMode(GL_PROJECTION);
     glLoadMatrixf((const GLfloat*) projection);
 
-    // Setup camera
-    glMatrixMode(GL_MODELVIEW);
-    glLoadIdentity();
+    // Setup camera. The modelview matrix is kept on our side as well, so
+    // the particle renderers never have to read it back from OpenGL.
+    mat4x4_identity(modelview);
 
     // Rotate camera
     angle_x = 90.0 - 10.0;
     angle_y = 10.0 * sin(0.3 * t);
     angle_z = 10.0 * t;
-    glRotated(-angle_x, 1.0, 0.0, 0.0);
-    glRotated(-angle_y, 0.0, 1.0, 0.0);
-    glRotated(-angle_z, 0.0, 0.0, 1.0);
+    mat4x4_rotate(modelview, modelview, 1.f, 0.f, 0.f,
+                  (float) (-angle_x * M_PI / 180.0));
+    mat4x4_rotate(modelview, modelview, 0.f, 1.f, 0.f,
+                  (float) (-angle_y * M_PI / 180.0));
+    mat4x4_rotate(modelview, modelview, 0.f, 0.f, 1.f,
+                  (float) (-angle_z * M_PI / 180.0));
 
     // Translate camera
     xpos =  15.0 * sin((M_PI / 180.0) * angle_z) +
@@ -820,7 +3074,11 @@ static void draw_scene(GLFWwindow* window, double t)
     ypos = -15.0 * cos((M_PI / 180.0) * angle_z) +
              2.0 * cos((M_PI / 180.0) * 2.9 * t);
     zpos = 4.0 + 2.0 * cos((M_PI / 180.0) * 4.9 * t);
-    glTranslated(-xpos, -ypos, -zpos);
+    mat4x4_translate_in_place(modelview,
+                              (float) -xpos, (float) -ypos, (float) -zpos);
+
+    glMatrixMode(GL_MODELVIEW);
+    glLoadMatrixf((const GLfloat*) modelview);
 
     glFrontFace(GL_CCW);
     glCullFace(GL_BACK);
@@ -850,6 +3108,9 @@ static void draw_scene(GLFWwindow* window, double t)
 
     // Z-buffer not needed anymore
     glDisable(GL_DEPTH_TEST);
+
+    if (transparency == TRANSPARENCY_WEIGHTED)
+        end_oit_scene();
 }
 
 
@@ -895,70 +3156,375 @@ static void key_callback(GLFWwindow* window, int key, int scancode, int action,
 
 static int physics_thread_main(void* arg)
 {
-    GLFWwindow* window = arg;
+    int drawn;
 
     for (;;)
     {
-        mtx_lock(&thread_sync.particles_lock);
-
-        // Wait for particle drawing to be done
-        while (!glfwWindowShouldClose(window) &&
-               thread_sync.p_frame > thread_sync.d_frame)
+        // Wait for the draw thread to take the previous frame
+        while ((drawn = atomic_load_int(&thread_sync.d_frame)) <
+               thread_sync.p_frame)
         {
-            struct timespec ts;
-            clock_gettime(CLOCK_REALTIME, &ts);
-            ts.tv_nsec += 100000000;
-            cnd_timedwait(&thread_sync.d_done, &thread_sync.particles_lock, &ts);
+            futex_wait(&thread_sync.frame_changed, &thread_sync.d_frame, drawn);
         }
 
-        if (glfwWindowShouldClose(window))
+        if (atomic_load_int(&thread_sync.quit))
             break;
 
-        // Update particles
+        // Update particles and hand them over for drawing
         particle_engine(thread_sync.t, thread_sync.dt);
+        publish_particles();
 
-        // Update frame counter
-        thread_sync.p_frame++;
-
-        // Unlock mutex and signal drawing thread
-        mtx_unlock(&thread_sync.particles_lock);
-        cnd_signal(&thread_sync.p_done);
+        // Update frame counter and wake the drawing thread
+        atomic_add_int(&thread_sync.p_frame, 1);
+        futex_wake(&thread_sync.frame_changed);
     }
 
     return 0;
 }
 
+#endif // PARTICLES_BENCH
 
 //========================================================================
-// main
+// Run the particle engine without a window and report its throughput
+//========================================================================
+
+static void benchmark(int frames, float dt)
+{
+    double t = 0.0, start, elapsed;
+    int i, threads = job_pool.count;
+    void (*engine)(double t, float dt) = particle_engine;
+
+#if !defined(PARTICLES_BENCH)
+    if (gpu_simulation.program)
+    {
+        engine = gpu_particle_engine;
+        threads = 1;
+    }
+#endif
+
+    // Let the system fill up before measuring
+    for (i = 0;  i < (int) (LIFE_SPAN / dt);  i++)
+    {
+        engine(t, dt);
+        t += dt;
+    }
+
+#if !defined(PARTICLES_BENCH)
+    if (gpu_simulation.program)
+        glFinish();
+#endif
+
+    // Sort as seen from 15 m down the negative y axis, where the demo camera
+    // starts out
+    thread_sync.view_depth[1] = -1.f;
+    thread_sync.view_depth[3] = -15.f;
+
+    particle_updates = particle_births = 0.0;
+    grid.pairs = grid.build_time = grid.search_time = 0.0;
+    start = get_time();
+
+    for (i = 0;  i < frames;  i++)
+    {
+        engine(t, dt);
+        t += dt;
+
+        if (transparency == TRANSPARENCY_SORTED)
+            publish_particles();
+    }
+
+#if !defined(PARTICLES_BENCH)
+    if (gpu_simulation.program)
+    {
+        glFinish();
+        elapsed = get_time() - start;
+
+        printf("%i particles, %i steps of %.4g s, GPU simulation on %s\n",
+               particles.capacity, frames, dt,
+               (const char*) glGetString(GL_RENDERER));
+    }
+    else
+#endif
+    {
+        elapsed = get_time() - start;
+
+        printf("%i particles, %i steps of %.4g s, %i threads, %s integrator, "
+               "seed %u\n",
+               particles.capacity, frames, dt, job_pool.count, integrator_name,
+               random_seed);
+    }
+
+    printf("%.3f s, %.1f steps/s, %.4g particle updates/s (%.4g per thread), "
+           "%.4g births/s\n",
+           elapsed, frames / elapsed,
+           particle_updates / elapsed,
+           particle_updates / elapsed / threads,
+           particle_births / elapsed);
+
+    if (fluid)
+    {
+        printf("%.3f ms grid building and %.3f ms neighbour search per step, "
+               "%.4g neighbour pairs/s\n",
+               grid.build_time * 1000.0 / frames,
+               grid.search_time * 1000.0 / frames,
+               2.0 * grid.pairs / grid.search_time);
+    }
+
+    if (transparency == TRANSPARENCY_SORTED)
+    {
+        printf("%.3f ms per depth sort, %.4g particles sorted/s\n",
+               depth_sort.time * 1000.0 / frames,
+               particles.live * (double) frames / depth_sort.time);
+    }
+
+    if (engine == particle_engine)
+    {
+        printf("%i live particles, checksum %016" PRIx64 "\n",
+               particles.live, particle_checksum());
+    }
+}
+
+
+//========================================================================
+// main of the headless benchmark, which runs the CPU simulation for a fixed
+// number of steps of a fixed length without any window or context
 //========================================================================
 
+#if defined(PARTICLES_BENCH)
+
 int main(int argc, char** argv)
 {
-    int ch, width, height;
-    thrd_t physics_thread = 0;
-    GLFWwindow* window;
-    GLFWmonitor* monitor = NULL;
+    int ch, count = DEFAULT_PARTICLES, steps = DEFAULT_BENCH_STEPS;
+    int threads = get_processor_count(), check = GL_FALSE;
+    float dt = 1.f / 60.f;
+    const char* integrator = NULL;
+    uint64_t expected = 0;
 
-    if (!glfwInit())
+    while ((ch = getopt(argc, argv, "d:e:hi:j:n:r:s:t:w")) != -1)
     {
-        fprintf(stderr, "Failed to initialize GLFW\n");
+        switch (ch)
+        {
+            case 'd':
+                dt = (float) atof(optarg);
+                if (dt <= 0.f)
+                {
+                    usage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'e':
+                expected = strtoull(optarg, NULL, 16);
+                check = GL_TRUE;
+                break;
+            case 'h':
+                usage();
+                exit(EXIT_SUCCESS);
+            case 'i':
+                integrator = optarg;
+                break;
+            case 'j':
+                threads = atoi(optarg);
+                if (threads < 1)
+                {
+                    usage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'n':
+                count = atoi(optarg);
+                if (count < 1 || count > MAX_PARTICLES)
+                {
+                    usage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'r':
+                random_seed = (uint32_t) strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                steps = atoi(optarg);
+                if (steps < 1)
+                {
+                    usage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 't':
+                if (strcmp(optarg, "add") == 0)
+                    transparency = TRANSPARENCY_ADDITIVE;
+                else if (strcmp(optarg, "sort") == 0)
+                    transparency = TRANSPARENCY_SORTED;
+                else
+                {
+                    usage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'w':
+                fluid = GL_TRUE;
+                break;
+            default:
+                usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (!init_particles(count) || (fluid && !init_grid()) ||
+        (transparency == TRANSPARENCY_SORTED && !init_draw_buffers()))
+    {
+        fprintf(stderr, "Failed to allocate %i particles\n", count);
+        exit(EXIT_FAILURE);
+    }
+
+    // The fastest integrator is measured on the allocated particles
+    if (!select_integrator(integrator))
+    {
+        fprintf(stderr, "The %s integrator is not supported\n", integrator);
         exit(EXIT_FAILURE);
     }
 
-    while ((ch = getopt(argc, argv, "fh")) != -1)
+    if (!work_pool_init(&job_pool, threads))
+    {
+        fprintf(stderr, "Failed to create physics worker threads\n");
+        exit(EXIT_FAILURE);
+    }
+
+    benchmark(steps, dt);
+    work_pool_terminate(&job_pool);
+
+    if (check && particle_checksum() != expected)
+    {
+        fprintf(stderr, "Checksum mismatch, expected %016" PRIx64 " but got %016"
+                PRIx64 "\n", expected, particle_checksum());
+        exit(EXIT_FAILURE);
+    }
+
+    exit(EXIT_SUCCESS);
+}
+
+#else
+
+//========================================================================
+// main
+//========================================================================
+
+int main(int argc, char** argv)
+{
+    int ch, width, height, count = DEFAULT_PARTICLES, frames = 0, drawn = 0;
+    int check_frames = 0, gpu = GL_FALSE;
+    int threads = get_processor_count();
+    thrd_t physics_thread = 0;
+    GLFWwindow* window;
+    GLFWmonitor* monitor = NULL;
+    int fullscreen = GL_FALSE, legacy = GL_FALSE;
+
+    while ((ch = getopt(argc, argv, "b:c:fghj:ln:t:w")) != -1)
     {
         switch (ch)
         {
+            case 'b':
+                frames = atoi(optarg);
+                break;
+            case 'c':
+                check_frames = atoi(optarg);
+                break;
             case 'f':
-                monitor = glfwGetPrimaryMonitor();
+                fullscreen = GL_TRUE;
+                break;
+            case 'g':
+                gpu = GL_TRUE;
                 break;
             case 'h':
                 usage();
                 exit(EXIT_SUCCESS);
+            case 'j':
+                threads = atoi(optarg);
+                if (threads < 1)
+                {
+                    usage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'l':
+                legacy = GL_TRUE;
+                break;
+            case 'n':
+                count = atoi(optarg);
+                if (count < 1 || count > MAX_PARTICLES)
+                {
+                    usage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 't':
+                if (strcmp(optarg, "add") == 0)
+                    transparency = TRANSPARENCY_ADDITIVE;
+                else if (strcmp(optarg, "sort") == 0)
+                    transparency = TRANSPARENCY_SORTED;
+                else if (strcmp(optarg, "oit") == 0)
+                    transparency = TRANSPARENCY_WEIGHTED;
+                else
+                {
+                    usage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'w':
+                fluid = GL_TRUE;
+                break;
+            default:
+                usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    // Alpha blending needs the instanced renderer, and only the particles of
+    // the CPU simulation are sorted or interact
+    if ((transparency != TRANSPARENCY_ADDITIVE && legacy) ||
+        ((transparency == TRANSPARENCY_SORTED || fluid) && gpu))
+    {
+        usage();
+        exit(EXIT_FAILURE);
+    }
+
+    if (!init_particles(count) || (fluid && !init_grid()))
+    {
+        fprintf(stderr, "Failed to allocate %i particles\n", count);
+        exit(EXIT_FAILURE);
+    }
+
+    select_integrator(NULL);
+
+    if (!work_pool_init(&job_pool, threads))
+    {
+        fprintf(stderr, "Failed to create physics worker threads\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (frames > 0 && !gpu)
+    {
+        if (transparency == TRANSPARENCY_SORTED && !init_draw_buffers())
+        {
+            fprintf(stderr, "Failed to allocate draw buffers\n");
+            exit(EXIT_FAILURE);
         }
+
+        benchmark(frames, 1.f / 60.f);
+        work_pool_terminate(&job_pool);
+        exit(EXIT_SUCCESS);
+    }
+
+    if (!glfwInit())
+    {
+        fprintf(stderr, "Failed to initialize GLFW\n");
+        exit(EXIT_FAILURE);
     }
 
+    // The GPU benchmark and check only need a context
+    if (frames > 0 || check_frames > 0)
+        glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
+    else if (fullscreen)
+        monitor = glfwGetPrimaryMonitor();
+
     if (monitor)
     {
         const GLFWvidmode* mode = glfwGetVideoMode(monitor);
@@ -991,6 +3557,32 @@ int main(int argc, char** argv)
     glfwMakeContextCurrent(window);
     glfwSwapInterval(1);
 
+    if (gpu || check_frames > 0)
+    {
+        if (!init_gpu_simulation(window))
+        {
+            fprintf(stderr, "Failed to set up the GPU particle simulation\n");
+            glfwTerminate();
+            exit(EXIT_FAILURE);
+        }
+
+        if (check_frames > 0)
+        {
+            const int passed = check_gpu_simulation(check_frames);
+            work_pool_terminate(&job_pool);
+            glfwTerminate();
+            exit(passed ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+
+        if (frames > 0)
+        {
+            benchmark(frames, 1.f / 60.f);
+            work_pool_terminate(&job_pool);
+            glfwTerminate();
+            exit(EXIT_SUCCESS);
+        }
+    }
+
     glfwSetFramebufferSizeCallback(window, resize_callback);
     glfwSetKeyCallback(window, key_callback);
 
@@ -1026,6 +3618,25 @@ int main(int argc, char** argv)
                       GL_SEPARATE_SPECULAR_COLOR_EXT);
     }
 
+    // The GPU simulation is always drawn with the instanced renderer
+    if (!legacy || gpu)
+        init_sprite_renderer(window);
+
+    if ((gpu || transparency != TRANSPARENCY_ADDITIVE) &&
+        !sprite_renderer.blended.program)
+    {
+        fprintf(stderr, "Failed to set up the instanced particle renderer\n");
+        glfwTerminate();
+        exit(EXIT_FAILURE);
+    }
+
+    if (transparency == TRANSPARENCY_WEIGHTED && !init_oit(window))
+    {
+        fprintf(stderr, "Failed to set up order-independent transparency\n");
+        glfwTerminate();
+        exit(EXIT_FAILURE);
+    }
+
     // Set filled polygon mode as default (not wireframe)
     glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
     wireframe = 0;
@@ -1036,11 +3647,18 @@ int main(int argc, char** argv)
     thread_sync.p_frame = 0;
     thread_sync.d_frame = 0;
 
-    mtx_init(&thread_sync.particles_lock, mtx_timed);
-    cnd_init(&thread_sync.p_done);
-    cnd_init(&thread_sync.d_done);
+    thread_sync.quit = GL_FALSE;
+    init_futex(&thread_sync.frame_changed);
+
+    if (!init_draw_buffers())
+    {
+        fprintf(stderr, "Failed to allocate draw buffers\n");
+        glfwTerminate();
+        exit(EXIT_FAILURE);
+    }
 
-    if (thrd_create(&physics_thread, physics_thread_main, window) != thrd_success)
+    if (!gpu &&
+        thrd_create(&physics_thread, physics_thread_main, NULL) != thrd_success)
     {
         glfwTerminate();
         exit(EXIT_FAILURE);
@@ -1054,9 +3672,24 @@ int main(int argc, char** argv)
 
         glfwSwapBuffers(window);
         glfwPollEvents();
+        drawn++;
     }
 
-    thrd_join(physics_thread, NULL);
+    if (drawn)
+    {
+        printf("%i frames, %.3f ms average frame time\n",
+               drawn, glfwGetTime() * 1000.0 / drawn);
+    }
+
+    // Release the physics thread, which is waiting for the next frame to be
+    // taken, and tell it to exit
+    atomic_store_int(&thread_sync.quit, GL_TRUE);
+    atomic_add_int(&thread_sync.d_frame, 1);
+    futex_wake(&thread_sync.frame_changed);
+
+    if (!gpu)
+        thrd_join(physics_thread, NULL);
+    work_pool_terminate(&job_pool);
 
     glfwDestroyWindow(window);
     glfwTerminate();
@@ -1064,3 +3697,4 @@ int main(int argc, char** argv)
     exit(EXIT_SUCCESS);
 }
 
+#endif // PARTICLES_BENCH
@@ -8,6 +8,12 @@
 //
 // (If the code seems a little bit strange here and there, it may be
 //  because I am not a friend of orthogonal projections)
+//
+// With OpenGL 3.2 or later the views are kept in an offscreen framebuffer
+// and only the views that changed are drawn again. The three wireframe
+// views are drawn together: the geometry is submitted once and fanned out
+// to the views by instancing, using one viewport per view where viewport
+// arrays are supported.
 //========================================================================
 
 #define GLFW_INCLUDE_GLEXT
@@ -21,8 +27,10 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 
 #include <linmath.h>
+#include <meshbuilder.h>
 
 
 //========================================================================
@@ -42,8 +50,15 @@ static int active_view = 0;
 // Rotation around each axis
 static int rot_x = 0, rot_y = 0, rot_z = 0;
 
-// Do redraw?
-static int do_redraw = 1;
+// Views to redraw, one bit per view (bit 0 = upper left, bit 1 = upper
+// right, bit 2 = lower left, bit 3 = lower right), plus a bit for when only
+// the border around the active view changed
+#define VIEW_BIT(view) (1 << ((view) - 1))
+#define ALL_VIEWS      0x0f
+#define ORTHO_VIEWS    (ALL_VIEWS & ~VIEW_BIT(2))
+#define BORDER_BIT     0x10
+
+static int dirty_views = ALL_VIEWS;
 
 
 //========================================================================
@@ -376,15 +391,730 @@ static void drawAllViews(void)
 }
 
 
+//========================================================================
+// Cached views, drawn with shaders on OpenGL 3.2 and later
+//========================================================================
+
+// Number of views, and of viewports with viewport arrays
+#define VIEW_COUNT 4
+
+// Camera position of each view, in the order of the dirty bits
+static const float view_eyes[VIEW_COUNT][3] =
+{
+    { 0.f, 10.f, 1e-3f },   // Upper left (TOP VIEW)
+    { 3.f, 1.5f, 3.f },     // Upper right (PERSPECTIVE VIEW)
+    { 0.f, 0.f, 10.f },     // Lower left (FRONT VIEW)
+    { 10.f, 0.f, 0.f }      // Lower right (SIDE VIEW)
+};
+
+static struct
+{
+    GLuint wire_program;       // Instanced lines, fanned out to the views
+    GLuint lit_program;        // Lit torus of the perspective view
+    GLuint vertex_array;
+    GLuint buffers[2];
+    GLint  mvp_location, views_location, rects_location;
+    GLint  lit_mvp_location, modelview_location, light_location;
+    int    viewport_array;     // Route instances with gl_ViewportIndex
+    GLuint framebuffer;        // Cached views, with the samples of the window
+    GLuint renderbuffers[2];
+    int    samples;
+    int    width, height;      // Size of the cached views
+    GLint  torus_first, torus_count;    // Index ranges of the mesh
+    GLint  outline_first, outline_count;
+    GLint  grid_first, grid_count;
+} views;
+
+static PFNGLCREATESHADERPROC glCreateShader;
+static PFNGLSHADERSOURCEPROC glShaderSource;
+static PFNGLCOMPILESHADERPROC glCompileShader;
+static PFNGLGETSHADERIVPROC glGetShaderiv;
+static PFNGLGETSHADERINFOLOGPROC glGetShaderInfoLog;
+static PFNGLCREATEPROGRAMPROC glCreateProgram;
+static PFNGLATTACHSHADERPROC glAttachShader;
+static PFNGLBINDATTRIBLOCATIONPROC glBindAttribLocation;
+static PFNGLLINKPROGRAMPROC glLinkProgram;
+static PFNGLGETPROGRAMIVPROC glGetProgramiv;
+static PFNGLGETPROGRAMINFOLOGPROC glGetProgramInfoLog;
+static PFNGLUSEPROGRAMPROC glUseProgram;
+static PFNGLGETUNIFORMLOCATIONPROC glGetUniformLocation;
+static PFNGLUNIFORMMATRIX4FVPROC glUniformMatrix4fv;
+static PFNGLUNIFORM3FVPROC glUniform3fv;
+static PFNGLUNIFORM4FVPROC glUniform4fv;
+static PFNGLUNIFORM4IVPROC glUniform4iv;
+static PFNGLGENBUFFERSPROC glGenBuffers;
+static PFNGLBINDBUFFERPROC glBindBuffer;
+static PFNGLBUFFERDATAPROC glBufferData;
+static PFNGLBUFFERSUBDATAPROC glBufferSubData;
+static PFNGLGENVERTEXARRAYSPROC glGenVertexArrays;
+static PFNGLBINDVERTEXARRAYPROC glBindVertexArray;
+static PFNGLENABLEVERTEXATTRIBARRAYPROC glEnableVertexAttribArray;
+static PFNGLVERTEXATTRIBPOINTERPROC glVertexAttribPointer;
+static PFNGLDRAWELEMENTSINSTANCEDPROC glDrawElementsInstanced;
+static PFNGLGENFRAMEBUFFERSPROC glGenFramebuffers;
+static PFNGLBINDFRAMEBUFFERPROC glBindFramebuffer;
+static PFNGLGENRENDERBUFFERSPROC glGenRenderbuffers;
+static PFNGLBINDRENDERBUFFERPROC glBindRenderbuffer;
+static PFNGLRENDERBUFFERSTORAGEMULTISAMPLEPROC glRenderbufferStorageMultisample;
+static PFNGLFRAMEBUFFERRENDERBUFFERPROC glFramebufferRenderbuffer;
+static PFNGLCHECKFRAMEBUFFERSTATUSPROC glCheckFramebufferStatus;
+static PFNGLBLITFRAMEBUFFERPROC glBlitFramebuffer;
+static PFNGLVIEWPORTARRAYVPROC glViewportArrayv;
+static PFNGLSCISSORARRAYVPROC glScissorArrayv;
+
+#define LOAD_GL_FUNCTION(type, name) \
+    if (!(name = (type) glfwGetProcAddress(#name))) return GL_FALSE
+
+static int loadViewFunctions(void)
+{
+    LOAD_GL_FUNCTION(PFNGLCREATESHADERPROC, glCreateShader);
+    LOAD_GL_FUNCTION(PFNGLSHADERSOURCEPROC, glShaderSource);
+    LOAD_GL_FUNCTION(PFNGLCOMPILESHADERPROC, glCompileShader);
+    LOAD_GL_FUNCTION(PFNGLGETSHADERIVPROC, glGetShaderiv);
+    LOAD_GL_FUNCTION(PFNGLGETSHADERINFOLOGPROC, glGetShaderInfoLog);
+    LOAD_GL_FUNCTION(PFNGLCREATEPROGRAMPROC, glCreateProgram);
+    LOAD_GL_FUNCTION(PFNGLATTACHSHADERPROC, glAttachShader);
+    LOAD_GL_FUNCTION(PFNGLBINDATTRIBLOCATIONPROC, glBindAttribLocation);
+    LOAD_GL_FUNCTION(PFNGLLINKPROGRAMPROC, glLinkProgram);
+    LOAD_GL_FUNCTION(PFNGLGETPROGRAMIVPROC, glGetProgramiv);
+    LOAD_GL_FUNCTION(PFNGLGETPROGRAMINFOLOGPROC, glGetProgramInfoLog);
+    LOAD_GL_FUNCTION(PFNGLUSEPROGRAMPROC, glUseProgram);
+    LOAD_GL_FUNCTION(PFNGLGETUNIFORMLOCATIONPROC, glGetUniformLocation);
+    LOAD_GL_FUNCTION(PFNGLUNIFORMMATRIX4FVPROC, glUniformMatrix4fv);
+    LOAD_GL_FUNCTION(PFNGLUNIFORM3FVPROC, glUniform3fv);
+    LOAD_GL_FUNCTION(PFNGLUNIFORM4FVPROC, glUniform4fv);
+    LOAD_GL_FUNCTION(PFNGLUNIFORM4IVPROC, glUniform4iv);
+    LOAD_GL_FUNCTION(PFNGLGENBUFFERSPROC, glGenBuffers);
+    LOAD_GL_FUNCTION(PFNGLBINDBUFFERPROC, glBindBuffer);
+    LOAD_GL_FUNCTION(PFNGLBUFFERDATAPROC, glBufferData);
+    LOAD_GL_FUNCTION(PFNGLBUFFERSUBDATAPROC, glBufferSubData);
+    LOAD_GL_FUNCTION(PFNGLGENVERTEXARRAYSPROC, glGenVertexArrays);
+    LOAD_GL_FUNCTION(PFNGLBINDVERTEXARRAYPROC, glBindVertexArray);
+    LOAD_GL_FUNCTION(PFNGLENABLEVERTEXATTRIBARRAYPROC, glEnableVertexAttribArray);
+    LOAD_GL_FUNCTION(PFNGLVERTEXATTRIBPOINTERPROC, glVertexAttribPointer);
+    LOAD_GL_FUNCTION(PFNGLDRAWELEMENTSINSTANCEDPROC, glDrawElementsInstanced);
+    LOAD_GL_FUNCTION(PFNGLGENFRAMEBUFFERSPROC, glGenFramebuffers);
+    LOAD_GL_FUNCTION(PFNGLBINDFRAMEBUFFERPROC, glBindFramebuffer);
+    LOAD_GL_FUNCTION(PFNGLGENRENDERBUFFERSPROC, glGenRenderbuffers);
+    LOAD_GL_FUNCTION(PFNGLBINDRENDERBUFFERPROC, glBindRenderbuffer);
+    LOAD_GL_FUNCTION(PFNGLRENDERBUFFERSTORAGEMULTISAMPLEPROC, glRenderbufferStorageMultisample);
+    LOAD_GL_FUNCTION(PFNGLFRAMEBUFFERRENDERBUFFERPROC, glFramebufferRenderbuffer);
+    LOAD_GL_FUNCTION(PFNGLCHECKFRAMEBUFFERSTATUSPROC, glCheckFramebufferStatus);
+    LOAD_GL_FUNCTION(PFNGLBLITFRAMEBUFFERPROC, glBlitFramebuffer);
+    return GL_TRUE;
+}
+
+static int loadViewportArrayFunctions(void)
+{
+    LOAD_GL_FUNCTION(PFNGLVIEWPORTARRAYVPROC, glViewportArrayv);
+    LOAD_GL_FUNCTION(PFNGLSCISSORARRAYVPROC, glScissorArrayv);
+    return GL_TRUE;
+}
+
+// Lines of the grid and the torus outlines. Instance i is drawn into view
+// views[i], either by selecting its viewport or, without viewport arrays,
+// by moving it into the rectangle of the view within a window-sized
+// viewport and clipping it to that rectangle.
+static const char* wire_vertex_shader_text =
+"uniform mat4 mvp[4];\n"
+"uniform ivec4 views;\n"
+"uniform vec4 rects[4];\n"
+"in vec3 position;\n"
+"in vec3 color;\n"
+"out Vertex { vec4 color; } vertex;\n"
+"#ifdef VIEWPORT_ARRAY\n"
+"flat out int view;\n"
+"#else\n"
+"out float gl_ClipDistance[4];\n"
+"#endif\n"
+"void main()\n"
+"{\n"
+"    int i = views[gl_InstanceID];\n"
+"    vec4 p = mvp[i] * vec4(position, 1.0);\n"
+"    vertex.color = vec4(color, 1.0);\n"
+"#ifdef VIEWPORT_ARRAY\n"
+"    view = i;\n"
+"    gl_Position = p;\n"
+"#else\n"
+"    gl_ClipDistance[0] = p.w + p.x;\n"
+"    gl_ClipDistance[1] = p.w - p.x;\n"
+"    gl_ClipDistance[2] = p.w + p.y;\n"
+"    gl_ClipDistance[3] = p.w - p.y;\n"
+"    gl_Position = vec4(p.xy * rects[i].xy + rects[i].zw * p.w, p.zw);\n"
+"#endif\n"
+"}\n";
+
+static const char* wire_geometry_shader_text =
+"#extension GL_ARB_viewport_array : require\n"
+"layout(lines) in;\n"
+"layout(line_strip, max_vertices = 2) out;\n"
+"in Vertex { vec4 color; } vertices[];\n"
+"flat in int view[];\n"
+"out Vertex { vec4 color; } vertex;\n"
+"void main()\n"
+"{\n"
+"    for (int i = 0;  i < 2;  i++)\n"
+"    {\n"
+"        gl_ViewportIndex = view[0];\n"
+"        gl_Position = gl_in[i].gl_Position;\n"
+"        vertex.color = vertices[i].color;\n"
+"        EmitVertex();\n"
+"    }\n"
+"}\n";
+
+// The fixed function lighting of the perspective view: light 1 with the
+// default material ambient and global ambient, no local viewer
+static const char* lit_vertex_shader_text =
+"uniform mat4 mvp;\n"
+"uniform mat4 modelview;\n"
+"uniform vec3 light;\n"
+"in vec3 position;\n"
+"in vec3 normal;\n"
+"in vec3 color;\n"
+"out Vertex { vec4 color; } vertex;\n"
+"void main()\n"
+"{\n"
+"    vec3 p = (modelview * vec4(position, 1.0)).xyz;\n"
+"    vec3 n = normalize(mat3(modelview) * normal);\n"
+"    vec3 l = normalize(light - p);\n"
+"    float d = dot(n, l);\n"
+"    vec3 c = vec3(0.08, 0.08, 0.1) + color * max(d, 0.0);\n"
+"    if (d > 0.0)\n"
+"        c += vec3(0.6) * pow(max(dot(n, normalize(l + vec3(0.0, 0.0, 1.0))), 0.0), 20.0);\n"
+"    vertex.color = vec4(c, 1.0);\n"
+"    gl_Position = mvp * vec4(position, 1.0);\n"
+"}\n";
+
+static const char* fragment_shader_text =
+"in Vertex { vec4 color; } vertex;\n"
+"out vec4 fragment;\n"
+"void main()\n"
+"{\n"
+"    fragment = vertex.color;\n"
+"}\n";
+
+static GLuint compileShader(GLenum type, const char* text)
+{
+    GLint status;
+    GLchar log[1024];
+    const char* sources[3];
+    const GLuint shader = glCreateShader(type);
+
+    sources[0] = "#version 150\n";
+    sources[1] = views.viewport_array ? "#define VIEWPORT_ARRAY\n" : "";
+    sources[2] = text;
+
+    glShaderSource(shader, 3, sources, NULL);
+    glCompileShader(shader);
+
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    if (status != GL_TRUE)
+    {
+        glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+        fprintf(stderr, "Failed to compile view shader:\n%s\n", log);
+        return 0;
+    }
+
+    return shader;
+}
+
+// Link the specified shaders, the geometry shader is optional
+static GLuint linkProgram(const char* vertex_text, const char* geometry_text)
+{
+    GLint status;
+    GLchar log[1024];
+    GLuint vertex_shader, geometry_shader = 0, fragment_shader, program;
+
+    vertex_shader = compileShader(GL_VERTEX_SHADER, vertex_text);
+    fragment_shader = compileShader(GL_FRAGMENT_SHADER, fragment_shader_text);
+    if (geometry_text)
+        geometry_shader = compileShader(GL_GEOMETRY_SHADER, geometry_text);
+
+    if (!vertex_shader || !fragment_shader || (geometry_text && !geometry_shader))
+        return 0;
+
+    program = glCreateProgram();
+    glAttachShader(program, vertex_shader);
+    glAttachShader(program, fragment_shader);
+    if (geometry_shader)
+        glAttachShader(program, geometry_shader);
+
+    glBindAttribLocation(program, 0, "position");
+    glBindAttribLocation(program, 1, "normal");
+    glBindAttribLocation(program, 2, "color");
+    glLinkProgram(program);
+
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (status != GL_TRUE)
+    {
+        glGetProgramInfoLog(program, sizeof(log), NULL, log);
+        fprintf(stderr, "Failed to link view program:\n%s\n", log);
+        return 0;
+    }
+
+    return program;
+}
+
+// Index of the vertex of the torus built by buildMeshes
+static uint32_t torusVertex(int i, int j)
+{
+    return (uint32_t) ((i % TORUS_MINOR_RES) * TORUS_MAJOR_RES + j % TORUS_MAJOR_RES);
+}
+
+// Build the torus of drawTorus and the grid lines of drawGrid. The torus is
+// drawn as triangles in the perspective view and as the outlines of its
+// quads, like polygon mode lines, in the wireframe views.
+static int buildMeshes(void)
+{
+    const float scale = 0.5f;
+    const int steps = 12;
+    int    i, j;
+    double s, t, x, y, z, nx, ny, nz, length, twopi;
+    uint32_t* lines;
+    GLsizei line_count = 0, outline_count;
+    mesh_builder m;
+
+    mesh_init(&m);
+    twopi = 2.0 * M_PI;
+
+    // The vertices of the torus, one ring per minor step
+    mesh_color(&m, 1.0f, 0.8f, 0.8f);
+    for (i = 0;  i < TORUS_MINOR_RES;  i++)
+    {
+        for (j = 0;  j < TORUS_MAJOR_RES;  j++)
+        {
+            s = i + 0.5;
+            t = j;
+
+            x = (TORUS_MAJOR + TORUS_MINOR * cos(s * twopi / TORUS_MINOR_RES)) * cos(t * twopi / TORUS_MAJOR_RES);
+            y = TORUS_MINOR * sin(s * twopi / TORUS_MINOR_RES);
+            z = (TORUS_MAJOR + TORUS_MINOR * cos(s * twopi / TORUS_MINOR_RES)) * sin(t * twopi / TORUS_MAJOR_RES);
+
+            nx = x - TORUS_MAJOR * cos(t * twopi / TORUS_MAJOR_RES);
+            ny = y;
+            nz = z - TORUS_MAJOR * sin(t * twopi / TORUS_MAJOR_RES);
+            length = sqrt(nx*nx + ny*ny + nz*nz);
+
+            mesh_normal(&m, (float) (nx / length), (float) (ny / length), (float) (nz / length));
+            mesh_vertex3f(&m, (float) x, (float) y, (float) z);
+        }
+    }
+
+    // The quads of the strips of drawTorus, in the same order and winding
+    for (i = 0;  i < TORUS_MINOR_RES;  i++)
+    {
+        for (j = 0;  j < TORUS_MAJOR_RES;  j++)
+        {
+            mesh_quad(&m, torusVertex(i + 1, j), torusVertex(i, j),
+                          torusVertex(i, j + 1), torusVertex(i + 1, j + 1));
+        }
+    }
+
+    // The grid lines, as horizontal then vertical lines
+    mesh_color(&m, 0.0f, 0.5f, 0.5f);
+    mesh_normal(&m, 0.f, 0.f, 1.f);
+    for (i = 0;  i < steps;  i++)
+    {
+        const float a = scale * 0.5f * (float) (steps - 1);
+        const float b = -a + scale * (float) i;
+
+        mesh_vertex3f(&m, -a, b, 0.f);
+        mesh_vertex3f(&m, a, b, 0.f);
+        mesh_vertex3f(&m, b, -a, 0.f);
+        mesh_vertex3f(&m, b, a, 0.f);
+    }
+
+    // Line indices, every quad outlined on its own like in polygon mode
+    outline_count = TORUS_MINOR_RES * TORUS_MAJOR_RES * 8;
+    lines = calloc(outline_count + steps * 4, sizeof(uint32_t));
+    if (!lines || m.failed)
+    {
+        free(lines);
+        mesh_free(&m);
+        return GL_FALSE;
+    }
+
+    for (i = 0;  i < TORUS_MINOR_RES;  i++)
+    {
+        for (j = 0;  j < TORUS_MAJOR_RES;  j++)
+        {
+            const uint32_t quad[4] =
+            {
+                torusVertex(i + 1, j), torusVertex(i, j),
+                torusVertex(i, j + 1), torusVertex(i + 1, j + 1)
+            };
+            int k;
+
+            for (k = 0;  k < 4;  k++)
+            {
+                lines[line_count++] = quad[k];
+                lines[line_count++] = quad[(k + 1) % 4];
+            }
+        }
+    }
+
+    for (i = 0;  i < steps;  i++)
+    {
+        const uint32_t first = TORUS_MINOR_RES * TORUS_MAJOR_RES + i * 4;
+
+        lines[line_count++] = first;
+        lines[line_count++] = first + 1;
+    }
+
+    for (i = 0;  i < steps;  i++)
+    {
+        const uint32_t first = TORUS_MINOR_RES * TORUS_MAJOR_RES + i * 4;
+
+        lines[line_count++] = first + 2;
+        lines[line_count++] = first + 3;
+    }
+
+    views.torus_first = 0;
+    views.torus_count = m.index_count;
+    views.outline_first = m.index_count;
+    views.outline_count = outline_count;
+    views.grid_first = m.index_count + outline_count;
+    views.grid_count = line_count - outline_count;
+
+    glGenVertexArrays(1, &views.vertex_array);
+    glBindVertexArray(views.vertex_array);
+
+    glGenBuffers(2, views.buffers);
+    glBindBuffer(GL_ARRAY_BUFFER, views.buffers[0]);
+    glBufferData(GL_ARRAY_BUFFER, m.vertex_count * sizeof(mesh_vertex),
+                 m.vertices, GL_STATIC_DRAW);
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, views.buffers[1]);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+                 (m.index_count + line_count) * sizeof(uint32_t),
+                 NULL, GL_STATIC_DRAW);
+    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0,
+                    m.index_count * sizeof(uint32_t), m.indices);
+    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, m.index_count * sizeof(uint32_t),
+                    line_count * sizeof(uint32_t), lines);
+
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(mesh_vertex),
+                          (void*) offsetof(mesh_vertex, position));
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(mesh_vertex),
+                          (void*) offsetof(mesh_vertex, normal));
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(mesh_vertex),
+                          (void*) offsetof(mesh_vertex, color));
+
+    free(lines);
+    mesh_free(&m);
+    return GL_TRUE;
+}
+
+// (Re)allocate the cached views for the current framebuffer size
+static int resizeViewCache(void)
+{
+    if (views.width == width && views.height == height)
+        return GL_TRUE;
+
+    views.width = width;
+    views.height = height;
+
+    glBindRenderbuffer(GL_RENDERBUFFER, views.renderbuffers[0]);
+    glRenderbufferStorageMultisample(GL_RENDERBUFFER, views.samples, GL_RGBA8, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, views.renderbuffers[1]);
+    glRenderbufferStorageMultisample(GL_RENDERBUFFER, views.samples, GL_DEPTH_COMPONENT24, width, height);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, views.framebuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                              GL_RENDERBUFFER, views.renderbuffers[0]);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                              GL_RENDERBUFFER, views.renderbuffers[1]);
+
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        return GL_FALSE;
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    dirty_views |= ALL_VIEWS;
+    return GL_TRUE;
+}
+
+// Set up the cached views, leaving views.wire_program at zero if the
+// context does not support them
+static void initViews(GLFWwindow* window)
+{
+    const int major = glfwGetWindowAttrib(window, GLFW_CONTEXT_VERSION_MAJOR);
+    const int minor = glfwGetWindowAttrib(window, GLFW_CONTEXT_VERSION_MINOR);
+    GLuint wire_program, lit_program;
+
+    if (major < 3 || (major == 3 && minor < 2))
+        return;
+
+    if (!loadViewFunctions())
+        return;
+
+    views.viewport_array = glfwExtensionSupported("GL_ARB_viewport_array") &&
+                           loadViewportArrayFunctions();
+
+    wire_program = linkProgram(wire_vertex_shader_text,
+                               views.viewport_array ? wire_geometry_shader_text : NULL);
+    lit_program = linkProgram(lit_vertex_shader_text, NULL);
+    if (!wire_program || !lit_program)
+        return;
+
+    if (!buildMeshes())
+        return;
+
+    // The views are blitted to the window, so they need the same samples
+    glGetIntegerv(GL_SAMPLES, &views.samples);
+
+    glGenFramebuffers(1, &views.framebuffer);
+    glGenRenderbuffers(2, views.renderbuffers);
+    if (!resizeViewCache())
+        return;
+
+    views.mvp_location = glGetUniformLocation(wire_program, "mvp");
+    views.views_location = glGetUniformLocation(wire_program, "views");
+    views.rects_location = glGetUniformLocation(wire_program, "rects");
+    views.lit_mvp_location = glGetUniformLocation(lit_program, "mvp");
+    views.modelview_location = glGetUniformLocation(lit_program, "modelview");
+    views.light_location = glGetUniformLocation(lit_program, "light");
+
+    views.wire_program = wire_program;
+    views.lit_program = lit_program;
+}
+
+// Rectangle of a view (1-4) in the framebuffer
+static void getViewRect(int view, int rect[4])
+{
+    rect[0] = ((view - 1) & 1) ? width / 2 : 0;
+    rect[1] = view <= 2 ? height / 2 : 0;
+    rect[2] = width / 2;
+    rect[3] = height / 2;
+}
+
+// Redraw the dirty views into the cache. The wireframe views share one
+// draw call for the grid and one for the torus.
+static void drawDirtyViews(void)
+{
+    const float light_position[4] = {0.0f, 8.0f, 8.0f, 1.0f};
+    GLint instance_views[4] = {0, 0, 0, 0};
+    GLfloat rects[VIEW_COUNT][4];
+    GLfloat viewports[VIEW_COUNT][4];
+    GLint scissors[VIEW_COUNT][4];
+    mat4x4 projection, view[VIEW_COUNT], model, mvp[VIEW_COUNT];
+    int i, rect[4], instances = 0;
+    float aspect = (float) width / (float) height;
+    vec4 light;
+
+    glBindFramebuffer(GL_FRAMEBUFFER, views.framebuffer);
+    glBindVertexArray(views.vertex_array);
+    glEnable(GL_SCISSOR_TEST);
+    glEnable(GL_DEPTH_TEST);
+    glDepthFunc(GL_LEQUAL);
+
+    mat4x4_identity(model);
+    mat4x4_rotate(model, model, 1.f, 0.f, 0.f, (float) rot_x * 0.5f * (float) M_PI / 180.f);
+    mat4x4_rotate(model, model, 0.f, 1.f, 0.f, (float) rot_y * 0.5f * (float) M_PI / 180.f);
+    mat4x4_rotate(model, model, 0.f, 0.f, 1.f, (float) rot_z * 0.5f * (float) M_PI / 180.f);
+
+    for (i = 0;  i < VIEW_COUNT;  i++)
+    {
+        vec3 eye = { view_eyes[i][0], view_eyes[i][1], view_eyes[i][2] };
+        vec3 center = { 0.f, 0.f, 0.f };
+        vec3 up = { 0.f, 1.f, 0.f };
+        mat4x4_look_at(view[i], eye, center, up);
+
+        getViewRect(i + 1, rect);
+        viewports[i][0] = (GLfloat) rect[0];
+        viewports[i][1] = (GLfloat) rect[1];
+        viewports[i][2] = (GLfloat) rect[2];
+        viewports[i][3] = (GLfloat) rect[3];
+        scissors[i][0] = rect[0];
+        scissors[i][1] = rect[1];
+        scissors[i][2] = rect[2];
+        scissors[i][3] = rect[3];
+
+        // Where the view ends up in a window-sized viewport
+        rects[i][0] = (float) rect[2] / (float) width;
+        rects[i][1] = (float) rect[3] / (float) height;
+        rects[i][2] = (float) (2 * rect[0] + rect[2]) / (float) width - 1.f;
+        rects[i][3] = (float) (2 * rect[1] + rect[3]) / (float) height - 1.f;
+
+        if (!(dirty_views & VIEW_BIT(i + 1)))
+            continue;
+
+        // Clear the view, to dark bluish grey for the wireframe views
+        glScissor(rect[0], rect[1], rect[2], rect[3]);
+        if (VIEW_BIT(i + 1) & ORTHO_VIEWS)
+        {
+            glClearColor(0.05f, 0.05f, 0.2f, 0.0f);
+            instance_views[instances++] = i;
+        }
+        else
+            glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    }
+
+    // ** ORTHOGONAL VIEWS **
+
+    if (instances)
+    {
+        glUseProgram(views.wire_program);
+        glUniform4iv(views.views_location, 1, instance_views);
+
+        if (views.viewport_array)
+        {
+            glViewportArrayv(0, VIEW_COUNT, (const GLfloat*) viewports);
+            glScissorArrayv(0, VIEW_COUNT, (const GLint*) scissors);
+        }
+        else
+        {
+            glUniform4fv(views.rects_location, VIEW_COUNT, (const GLfloat*) rects);
+            glViewport(0, 0, width, height);
+            glScissor(0, 0, width, height);
+            for (i = 0;  i < 4;  i++)
+                glEnable(GL_CLIP_DISTANCE0 + i);
+        }
+
+        // Enable line anti-aliasing
+        glEnable(GL_LINE_SMOOTH);
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+        mat4x4_ortho(projection, -3.f * aspect, 3.f * aspect, -3.f, 3.f, 1.f, 50.f);
+
+        // The grid is seen from the front in every view, without updating
+        // the Z-buffer
+        {
+            vec3 eye = { 0.f, 0.f, 1.f };
+            vec3 center = { 0.f, 0.f, 0.f };
+            vec3 up = { 0.f, 1.f, 0.f };
+            mat4x4 grid_view;
+
+            mat4x4_look_at(grid_view, eye, center, up);
+            for (i = 0;  i < VIEW_COUNT;  i++)
+                mat4x4_mul(mvp[i], projection, grid_view);
+        }
+
+        glUniformMatrix4fv(views.mvp_location, VIEW_COUNT, GL_FALSE, (const GLfloat*) mvp);
+        glDepthMask(GL_FALSE);
+        glDrawElementsInstanced(GL_LINES, views.grid_count, GL_UNSIGNED_INT,
+                                (void*) (views.grid_first * sizeof(uint32_t)),
+                                instances);
+        glDepthMask(GL_TRUE);
+
+        for (i = 0;  i < VIEW_COUNT;  i++)
+        {
+            mat4x4_mul(mvp[i], view[i], model);
+            mat4x4_mul(mvp[i], projection, mvp[i]);
+        }
+
+        glUniformMatrix4fv(views.mvp_location, VIEW_COUNT, GL_FALSE, (const GLfloat*) mvp);
+        glDrawElementsInstanced(GL_LINES, views.outline_count, GL_UNSIGNED_INT,
+                                (void*) (views.outline_first * sizeof(uint32_t)),
+                                instances);
+
+        glDisable(GL_LINE_SMOOTH);
+        glDisable(GL_BLEND);
+
+        if (!views.viewport_array)
+        {
+            for (i = 0;  i < 4;  i++)
+                glDisable(GL_CLIP_DISTANCE0 + i);
+        }
+    }
+
+    // ** PERSPECTIVE VIEW **
+
+    if (dirty_views & VIEW_BIT(2))
+    {
+        mat4x4 modelview;
+
+        getViewRect(2, rect);
+        glViewport(rect[0], rect[1], rect[2], rect[3]);
+        glScissor(rect[0], rect[1], rect[2], rect[3]);
+
+        glEnable(GL_CULL_FACE);
+        glCullFace(GL_BACK);
+        glFrontFace(GL_CW);
+
+        mat4x4_perspective(projection, 65.f * (float) M_PI / 180.f, aspect, 1.f, 50.f);
+        mat4x4_mul(modelview, view[1], model);
+        mat4x4_mul(mvp[1], projection, modelview);
+        mat4x4_mul_vec4(light, view[1], (float*) light_position);
+
+        glUseProgram(views.lit_program);
+        glUniformMatrix4fv(views.lit_mvp_location, 1, GL_FALSE, (const GLfloat*) mvp[1]);
+        glUniformMatrix4fv(views.modelview_location, 1, GL_FALSE, (const GLfloat*) modelview);
+        glUniform3fv(views.light_location, 1, light);
+        glDrawElements(GL_TRIANGLES, views.torus_count, GL_UNSIGNED_INT,
+                       (void*) (views.torus_first * sizeof(uint32_t)));
+
+        glDisable(GL_CULL_FACE);
+    }
+
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_SCISSOR_TEST);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// Copy the cached views to the window and draw the border around the
+// active view on top of them
+static void presentViews(void)
+{
+    int rect[4];
+
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, views.framebuffer);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    glBlitFramebuffer(0, 0, width, height, 0, 0, width, height,
+                      GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    if (active_view > 0 && active_view != 2)
+    {
+        // The border is one pixel wide, so it is cleared instead of drawn
+        getViewRect(active_view, rect);
+        glEnable(GL_SCISSOR_TEST);
+        glClearColor(1.0f, 1.0f, 0.6f, 0.0f);
+
+        glScissor(rect[0], rect[1], rect[2], 1);
+        glClear(GL_COLOR_BUFFER_BIT);
+        glScissor(rect[0], rect[1] + rect[3] - 1, rect[2], 1);
+        glClear(GL_COLOR_BUFFER_BIT);
+        glScissor(rect[0], rect[1], 1, rect[3]);
+        glClear(GL_COLOR_BUFFER_BIT);
+        glScissor(rect[0] + rect[2] - 1, rect[1], 1, rect[3]);
+        glClear(GL_COLOR_BUFFER_BIT);
+
+        glDisable(GL_SCISSOR_TEST);
+    }
+}
+
+
 //========================================================================
 // Framebuffer size callback function
 //========================================================================
 
 static void framebufferSizeFun(GLFWwindow* window, int w, int h)
 {
+    // A minimized window has no framebuffer to cache, so everything keeps
+    // its size until the window is restored
+    if (w == 0 || h == 0)
+        return;
+
     width  = w;
-    height = h > 0 ? h : 1;
-    do_redraw = 1;
+    height = h;
+    dirty_views |= ALL_VIEWS;
+
+    if (views.wire_program && !resizeViewCache())
+    {
+        // The fixed-function views must not run with the cache state bound
+        glUseProgram(0);
+        glBindVertexArray(0);
+        views.wire_program = 0;
+    }
 }
 
 
@@ -394,9 +1124,19 @@ static void framebufferSizeFun(GLFWwindow* window, int w, int h)
 
 static void windowRefreshFun(GLFWwindow* window)
 {
-    drawAllViews();
+    if (views.wire_program)
+    {
+        // Views that did not change are copied from the cache
+        if (dirty_views & ALL_VIEWS)
+            drawDirtyViews();
+
+        presentViews();
+    }
+    else
+        drawAllViews();
+
     glfwSwapBuffers(window);
-    do_redraw = 0;
+    dirty_views = 0;
 }
 
 
@@ -417,23 +1157,24 @@ static void cursorPosFun(GLFWwindow* window, double x, double y)
     x *= scale;
     y *= scale;
 
-    // Depending on which view was selected, rotate around different axes
+    // Depending on which view was selected, rotate around different axes.
+    // The torus is in every view, so all of them change.
     switch (active_view)
     {
         case 1:
             rot_x += (int) (y - ypos);
             rot_z += (int) (x - xpos);
-            do_redraw = 1;
+            dirty_views |= ALL_VIEWS;
             break;
         case 3:
             rot_x += (int) (y - ypos);
             rot_y += (int) (x - xpos);
-            do_redraw = 1;
+            dirty_views |= ALL_VIEWS;
             break;
         case 4:
             rot_y += (int) (x - xpos);
             rot_z += (int) (y - ypos);
-            do_redraw = 1;
+            dirty_views |= ALL_VIEWS;
             break;
         default:
             // Do nothing for perspective view, or if no view is selected
@@ -467,7 +1208,7 @@ static void mouseButtonFun(GLFWwindow* window, int button, int action, int mods)
         active_view = 0;
     }
 
-    do_redraw = 1;
+    dirty_views |= BORDER_BIT;
 }
 
 static void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
@@ -525,11 +1266,13 @@ int main(void)
     glfwGetFramebufferSize(window, &width, &height);
     framebufferSizeFun(window, width, height);
 
+    initViews(window);
+
     // Main loop
     for (;;)
     {
         // Only redraw if we need to
-        if (do_redraw)
+        if (dirty_views)
             windowRefreshFun(window);
 
         // Wait for new events
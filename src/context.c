@@ -33,6 +33,83 @@
 #include <stdio.h>
 
 
+// Reports the swapped frames whose timestamp queries have completed as
+// presented, oldest first, and retires the frames that cannot be measured
+//
+static void pollFrameQueries(_GLFWwindow* window)
+{
+#if defined(_GLFW_USE_OPENGL)
+    while (window->latency.presented != window->latency.frame)
+    {
+        GLint available;
+        GLuint64 timestamp;
+        const _GLFWframe* frame = window->latency.frames +
+            window->latency.presented % _GLFW_LATENCY_FRAMES;
+
+        // A frame swapped without a query, for example while another context
+        // was current, will never be measured and must not hold up the rest
+        if (frame->gpuSwap < 0.0)
+        {
+            window->latency.presented++;
+            continue;
+        }
+
+        window->GetQueryObjectiv(frame->query, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+        {
+            if (_glfwPlatformGetTime() - frame->swap < _GLFW_LATENCY_TIMEOUT)
+                return;
+
+            // Give up on a query that has taken too long to be meaningful
+            window->latency.presented++;
+            continue;
+        }
+
+        // The query was written when the GPU had completed the swap, so the
+        // difference from the GPU time at the swap is the time it took
+        window->GetQueryObjectui64v(frame->query, GL_QUERY_RESULT, &timestamp);
+        _glfwInputFramePresented(window, frame->swap +
+                                 ((double) timestamp * 1e-9 - frame->gpuSwap));
+    }
+#endif // _GLFW_USE_OPENGL
+}
+
+// Records the frame that was just swapped and starts the next one
+//
+static void swapFrame(_GLFWwindow* window)
+{
+    _GLFWframe* frame = window->latency.frames +
+        window->latency.frame % _GLFW_LATENCY_FRAMES;
+
+    // Give up on the oldest frame if it is still not known to be presented
+    if (window->latency.frame - window->latency.presented == _GLFW_LATENCY_FRAMES)
+        window->latency.presented++;
+
+    frame->input = window->latency.input;
+    frame->swap = _glfwPlatformGetTime();
+    frame->latency = -1.0;
+    frame->gpuSwap = -1.0;
+
+#if defined(_GLFW_USE_OPENGL)
+    // Without presentation events from the platform, the time the GPU has
+    // completed the swap is used instead, if it can be queried
+    if (!window->latency.swapEvents && window->QueryCounter &&
+        window == _glfwPlatformGetCurrentContext())
+    {
+        GLint64 now;
+
+        if (!frame->query)
+            window->GenQueries(1, &frame->query);
+
+        window->GetInteger64v(GL_TIMESTAMP, &now);
+        window->QueryCounter(frame->query, GL_TIMESTAMP);
+        frame->gpuSwap = (double) now * 1e-9;
+    }
+#endif // _GLFW_USE_OPENGL
+
+    window->latency.input = -1.0;
+}
+
 // Parses the client API version string and extracts the version number
 //
 static GLboolean parseVersionString(int* api, int* major, int* minor, int* rev)
@@ -470,6 +547,29 @@ GLboolean _glfwRefreshContextAttribs(const _GLFWctxconfig* ctxconfig)
         else if (behavior == GL_CONTEXT_RELEASE_BEHAVIOR_FLUSH)
             window->context.release = GLFW_RELEASE_BEHAVIOR_FLUSH;
     }
+
+    // Timestamp queries are used to find out when frames have been presented
+    if (window->context.api == GLFW_OPENGL_API &&
+        (window->context.major > 3 ||
+         (window->context.major == 3 && window->context.minor >= 3) ||
+         glfwExtensionSupported("GL_ARB_timer_query")))
+    {
+        window->GenQueries = (PFNGLGENQUERIESPROC)
+            glfwGetProcAddress("glGenQueries");
+        window->GetQueryObjectiv = (PFNGLGETQUERYOBJECTIVPROC)
+            glfwGetProcAddress("glGetQueryObjectiv");
+        window->GetQueryObjectui64v = (PFNGLGETQUERYOBJECTUI64VPROC)
+            glfwGetProcAddress("glGetQueryObjectui64v");
+        window->GetInteger64v = (PFNGLGETINTEGER64VPROC)
+            glfwGetProcAddress("glGetInteger64v");
+
+        if (window->GenQueries && window->GetQueryObjectiv &&
+            window->GetQueryObjectui64v && window->GetInteger64v)
+        {
+            window->QueryCounter = (PFNGLQUERYCOUNTERPROC)
+                glfwGetProcAddress("glQueryCounter");
+        }
+    }
 #endif // _GLFW_USE_OPENGL
 
     return GL_TRUE;
@@ -545,7 +645,25 @@ GLFWAPI void glfwSwapBuffers(GLFWwindow* handle)
 {
     _GLFWwindow* window = (_GLFWwindow*) handle;
     _GLFW_REQUIRE_INIT();
+
+    if (window->latency.enabled && !window->latency.swapEvents &&
+        window == _glfwPlatformGetCurrentContext())
+    {
+        pollFrameQueries(window);
+    }
+
     _glfwPlatformSwapBuffers(window);
+
+    if (window->latency.enabled)
+        swapFrame(window);
+    else
+    {
+        // Frames swapped without tracking have no latency
+        window->latency.frames[window->latency.frame %
+                               _GLFW_LATENCY_FRAMES].latency = -1.0;
+    }
+
+    window->latency.frame++;
 }
 
 GLFWAPI void glfwSwapInterval(int interval)
@@ -625,6 +625,12 @@ void _glfwPlatformSwapInterval(int interval)
     _glfw_eglSwapInterval(_glfw.egl.display, interval);
 }
 
+int _glfwPlatformSelectSwapEvents(_GLFWwindow* window, int enabled)
+{
+    // EGL has no notification of presented frames, so timer queries are used
+    return GL_FALSE;
+}
+
 int _glfwPlatformExtensionSupported(const char* extension)
 {
     const char* extensions = _glfw_eglQueryString(_glfw.egl.display,
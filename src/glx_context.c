@@ -194,6 +194,8 @@ int _glfwInitContextAPI(void)
         dlsym(_glfw.glx.handle, "glXCreateNewContext");
     _glfw.glx.GetVisualFromFBConfig =
         dlsym(_glfw.glx.handle, "glXGetVisualFromFBConfig");
+    _glfw.glx.SelectEvent =
+        dlsym(_glfw.glx.handle, "glXSelectEvent");
     _glfw.glx.GetProcAddress =
         dlsym(_glfw.glx.handle, "glXGetProcAddress");
     _glfw.glx.GetProcAddressARB =
@@ -280,6 +282,12 @@ int _glfwInitContextAPI(void)
     if (_glfwPlatformExtensionSupported("GLX_ARB_context_flush_control"))
         _glfw.glx.ARB_context_flush_control = GL_TRUE;
 
+    if (_glfwPlatformExtensionSupported("GLX_INTEL_swap_event"))
+    {
+        if (_glfw.glx.SelectEvent)
+            _glfw.glx.INTEL_swap_event = GL_TRUE;
+    }
+
     return GL_TRUE;
 }
 
@@ -541,6 +549,21 @@ void _glfwPlatformSwapInterval(int interval)
     }
 }
 
+int _glfwPlatformSelectSwapEvents(_GLFWwindow* window, int enabled)
+{
+#if defined(GLX_BufferSwapComplete)
+    if (_glfw.glx.INTEL_swap_event)
+    {
+        _glfw_glXSelectEvent(_glfw.x11.display,
+                             window->x11.handle,
+                             enabled ? GLX_BUFFER_SWAP_COMPLETE_INTEL_MASK : 0);
+        return GL_TRUE;
+    }
+#endif
+
+    return GL_FALSE;
+}
+
 int _glfwPlatformExtensionSupported(const char* extension)
 {
     const char* extensions =
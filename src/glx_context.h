@@ -57,6 +57,7 @@ typedef const char* (*PFNGLXQUERYEXTENSIONSSTRINGPROC)(Display*,int);
 #define _glfw_glXQueryExtensionsString _glfw.glx.QueryExtensionsString
 #define _glfw_glXCreateNewContext _glfw.glx.CreateNewContext
 #define _glfw_glXGetVisualFromFBConfig _glfw.glx.GetVisualFromFBConfig
+#define _glfw_glXSelectEvent _glfw.glx.SelectEvent
 
 #define _GLFW_PLATFORM_FBCONFIG                 GLXFBConfig     glx
 #define _GLFW_PLATFORM_CONTEXT_STATE            _GLFWcontextGLX glx
@@ -102,6 +103,7 @@ typedef struct _GLFWlibraryGLX
     PFNGLXQUERYEXTENSIONSSTRINGPROC     QueryExtensionsString;
     PFNGLXCREATENEWCONTEXTPROC          CreateNewContext;
     PFNGLXGETVISUALFROMFBCONFIGPROC     GetVisualFromFBConfig;
+    PFNGLXSELECTEVENTPROC               SelectEvent;
 
     // GLX 1.4 and extension functions
     PFNGLXGETPROCADDRESSPROC            GetProcAddress;
@@ -121,6 +123,7 @@ typedef struct _GLFWlibraryGLX
     GLboolean       ARB_create_context_robustness;
     GLboolean       EXT_create_context_es2_profile;
     GLboolean       ARB_context_flush_control;
+    GLboolean       INTEL_swap_event;
 
 } _GLFWlibraryGLX;
 
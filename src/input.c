@@ -28,13 +28,47 @@
 #include "internal.h"
 
 #include <stdlib.h>
+#include <string.h>
 #if defined(_MSC_VER)
  #include <malloc.h>
+ #include <intrin.h>
 #endif
 
 // Internal key state used for sticky keys
 #define _GLFW_STICK 3
 
+// Number of events held by an input event queue, a power of two
+#define _GLFW_EVENT_QUEUE_SIZE 1024
+
+#if defined(_MSC_VER)
+ #define _GLFW_ATOMIC_LOAD(p)     ((unsigned int) _InterlockedOr((volatile long*) (p), 0))
+ #define _GLFW_ATOMIC_STORE(p, v) _InterlockedExchange((volatile long*) (p), (long) (v))
+ #define _GLFW_ATOMIC_LOAD_PTR(p) \
+     _InterlockedCompareExchangePointer((void* volatile*) (p), NULL, NULL)
+ #define _GLFW_ATOMIC_STORE_PTR(p, v) \
+     _InterlockedExchangePointer((void* volatile*) (p), (v))
+#else
+ #define _GLFW_ATOMIC_LOAD(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+ #define _GLFW_ATOMIC_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+ #define _GLFW_ATOMIC_LOAD_PTR(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+ #define _GLFW_ATOMIC_STORE_PTR(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#endif
+
+// Input event queue with a single producer, the main thread processing
+// events, and a single consumer, the thread calling glfwGetEvents. Each
+// index is only written by one side, so no locking is needed.
+//
+struct _GLFWeventqueue
+{
+    GLFWevent       events[_GLFW_EVENT_QUEUE_SIZE];
+    // Total number of events added, written by the main thread
+    unsigned int    head;
+    // Total number of events removed, written by the consumer
+    unsigned int    tail;
+    // Time of the last event added, written by the main thread
+    double          time;
+};
+
 
 // Sets the cursor mode for the specified window
 //
@@ -126,6 +160,96 @@ static void setStickyMouseButtons(_GLFWwindow* window, int enabled)
     window->stickyMouseButtons = enabled;
 }
 
+// Set input event queue mode for the specified window
+//
+static void setEventQueue(_GLFWwindow* window, int enabled)
+{
+    // The queue is kept until the window is destroyed, as another thread may
+    // still be reading from it
+    if (enabled && !window->eventQueue)
+    {
+        _GLFWeventqueue* queue = calloc(1, sizeof(_GLFWeventqueue));
+        if (!queue)
+        {
+            _glfwInputError(GLFW_OUT_OF_MEMORY, NULL);
+            return;
+        }
+
+        // Another thread may already be calling glfwGetEvents, so the queue
+        // must be seen initialized by the time it sees the pointer
+        _GLFW_ATOMIC_STORE_PTR(&window->eventQueue, queue);
+    }
+
+    window->queueEvents = enabled;
+}
+
+// Set input latency tracking mode for the specified window
+//
+static void setLatencyTracking(_GLFWwindow* window, int enabled)
+{
+    if (window->latency.enabled == enabled)
+        return;
+
+    if (enabled)
+    {
+        // Frames swapped before tracking was enabled are not reported
+        window->latency.input = -1.0;
+        window->latency.presented = window->latency.frame;
+        memset(window->latency.histogram, 0, sizeof(window->latency.histogram));
+    }
+
+    window->latency.swapEvents = _glfwPlatformSelectSwapEvents(window, enabled);
+    window->latency.enabled = enabled;
+}
+
+// Returns a new event of the specified type at the head of the input event
+// queue of the specified window, or NULL if it is disabled or full
+//
+static GLFWevent* beginEvent(_GLFWwindow* window, int type)
+{
+    _GLFWeventqueue* queue = window->eventQueue;
+    GLFWevent* event;
+    double time;
+
+    if (!window->queueEvents && !window->latency.enabled)
+        return NULL;
+
+    if (_glfw.eventTime > 0.0)
+        time = _glfw.eventTime;
+    else
+        time = _glfwPlatformGetTime();
+
+    // The latency of a frame is measured from the first input processed for it
+    if (window->latency.enabled && window->latency.input < 0.0)
+        window->latency.input = time;
+
+    if (!window->queueEvents)
+        return NULL;
+
+    if (queue->head - _GLFW_ATOMIC_LOAD(&queue->tail) == _GLFW_EVENT_QUEUE_SIZE)
+        return NULL;
+
+    // Events without a platform timestamp are timed when processed, which may
+    // be later than the timestamp of a following event
+    if (time < queue->time)
+        time = queue->time;
+    queue->time = time;
+
+    event = queue->events + (queue->head & (_GLFW_EVENT_QUEUE_SIZE - 1));
+    memset(event, 0, sizeof(GLFWevent));
+    event->type = type;
+    event->time = time;
+    event->frame = window->latency.frame;
+    return event;
+}
+
+// Makes the event returned by beginEvent visible to glfwGetEvents
+//
+static void endEvent(_GLFWwindow* window)
+{
+    _GLFW_ATOMIC_STORE(&window->eventQueue->head, window->eventQueue->head + 1);
+}
+
 
 //////////////////////////////////////////////////////////////////////////
 //////                         GLFW event API                       //////
@@ -133,6 +257,8 @@ static void setStickyMouseButtons(_GLFWwindow* window, int enabled)
 
 void _glfwInputKey(_GLFWwindow* window, int key, int scancode, int action, int mods)
 {
+    GLFWevent* event;
+
     if (key >= 0 && key <= GLFW_KEY_LAST)
     {
         GLboolean repeated = GL_FALSE;
@@ -152,15 +278,35 @@ void _glfwInputKey(_GLFWwindow* window, int key, int scancode, int action, int m
             action = GLFW_REPEAT;
     }
 
+    event = beginEvent(window, GLFW_KEY_EVENT);
+    if (event)
+    {
+        event->key = key;
+        event->scancode = scancode;
+        event->action = action;
+        event->mods = mods;
+        endEvent(window);
+    }
+
     if (window->callbacks.key)
         window->callbacks.key((GLFWwindow*) window, key, scancode, action, mods);
 }
 
 void _glfwInputChar(_GLFWwindow* window, unsigned int codepoint, int mods, int plain)
 {
+    GLFWevent* event;
+
     if (codepoint < 32 || (codepoint > 126 && codepoint < 160))
         return;
 
+    event = beginEvent(window, GLFW_CHAR_EVENT);
+    if (event)
+    {
+        event->codepoint = codepoint;
+        event->mods = mods;
+        endEvent(window);
+    }
+
     if (window->callbacks.charmods)
         window->callbacks.charmods((GLFWwindow*) window, codepoint, mods);
 
@@ -173,15 +319,34 @@ void _glfwInputChar(_GLFWwindow* window, unsigned int codepoint, int mods, int p
 
 void _glfwInputScroll(_GLFWwindow* window, double xoffset, double yoffset)
 {
+    GLFWevent* event = beginEvent(window, GLFW_SCROLL_EVENT);
+    if (event)
+    {
+        event->x = xoffset;
+        event->y = yoffset;
+        endEvent(window);
+    }
+
     if (window->callbacks.scroll)
         window->callbacks.scroll((GLFWwindow*) window, xoffset, yoffset);
 }
 
 void _glfwInputMouseClick(_GLFWwindow* window, int button, int action, int mods)
 {
+    GLFWevent* event;
+
     if (button < 0 || button > GLFW_MOUSE_BUTTON_LAST)
         return;
 
+    event = beginEvent(window, GLFW_MOUSE_BUTTON_EVENT);
+    if (event)
+    {
+        event->key = button;
+        event->action = action;
+        event->mods = mods;
+        endEvent(window);
+    }
+
     // Register mouse button action
     if (action == GLFW_RELEASE && window->stickyMouseButtons)
         window->mouseButtons[button] = _GLFW_STICK;
@@ -194,6 +359,8 @@ void _glfwInputMouseClick(_GLFWwindow* window, int button, int action, int mods)
 
 void _glfwInputCursorMotion(_GLFWwindow* window, double x, double y)
 {
+    GLFWevent* event;
+
     if (window->cursorMode == GLFW_CURSOR_DISABLED)
     {
         if (x == 0.0 && y == 0.0)
@@ -206,16 +373,64 @@ void _glfwInputCursorMotion(_GLFWwindow* window, double x, double y)
         y = window->cursorPosY;
     }
 
+    event = beginEvent(window, GLFW_CURSOR_POS_EVENT);
+    if (event)
+    {
+        event->x = x;
+        event->y = y;
+        endEvent(window);
+    }
+
     if (window->callbacks.cursorPos)
         window->callbacks.cursorPos((GLFWwindow*) window, x, y);
 }
 
 void _glfwInputCursorEnter(_GLFWwindow* window, int entered)
 {
+    GLFWevent* event = beginEvent(window, GLFW_CURSOR_ENTER_EVENT);
+    if (event)
+    {
+        event->action = entered;
+        endEvent(window);
+    }
+
     if (window->callbacks.cursorEnter)
         window->callbacks.cursorEnter((GLFWwindow*) window, entered);
 }
 
+void _glfwInputFramePresented(_GLFWwindow* window, double time)
+{
+    _GLFWframe* frame;
+
+    if (!window->latency.enabled)
+        return;
+
+    if (window->latency.presented == window->latency.frame)
+        return;
+
+    frame = window->latency.frames +
+        window->latency.presented % _GLFW_LATENCY_FRAMES;
+
+    // A frame cannot be presented before it was swapped or after now, so the
+    // time is clamped to make up for clock mismatches between GPU and CPU
+    if (time < frame->swap)
+        time = frame->swap;
+    if (time > _glfwPlatformGetTime())
+        time = _glfwPlatformGetTime();
+
+    if (frame->input >= 0.0)
+    {
+        int bucket = (int) ((time - frame->input) * 1000.0);
+        if (bucket > _GLFW_LATENCY_BUCKETS - 1)
+            bucket = _GLFW_LATENCY_BUCKETS - 1;
+
+        frame->latency = time - frame->input;
+        window->latency.histogram[bucket]++;
+    }
+
+    window->latency.presented++;
+}
+
 void _glfwInputDrop(_GLFWwindow* window, int count, const char** paths)
 {
     if (window->callbacks.drop)
@@ -241,6 +456,10 @@ GLFWAPI int glfwGetInputMode(GLFWwindow* handle, int mode)
             return window->stickyKeys;
         case GLFW_STICKY_MOUSE_BUTTONS:
             return window->stickyMouseButtons;
+        case GLFW_EVENT_QUEUE:
+            return window->queueEvents;
+        case GLFW_LATENCY_TRACKING:
+            return window->latency.enabled;
         default:
             _glfwInputError(GLFW_INVALID_ENUM, "Invalid input mode");
             return 0;
@@ -264,6 +483,12 @@ GLFWAPI void glfwSetInputMode(GLFWwindow* handle, int mode, int value)
         case GLFW_STICKY_MOUSE_BUTTONS:
             setStickyMouseButtons(window, value ? GL_TRUE : GL_FALSE);
             break;
+        case GLFW_EVENT_QUEUE:
+            setEventQueue(window, value ? GL_TRUE : GL_FALSE);
+            break;
+        case GLFW_LATENCY_TRACKING:
+            setLatencyTracking(window, value ? GL_TRUE : GL_FALSE);
+            break;
         default:
             _glfwInputError(GLFW_INVALID_ENUM, "Invalid input mode");
             break;
@@ -523,6 +748,76 @@ GLFWAPI GLFWdropfun glfwSetDropCallback(GLFWwindow* handle, GLFWdropfun cbfun)
     return cbfun;
 }
 
+GLFWAPI int glfwGetEvents(GLFWwindow* handle, GLFWevent* events, int count)
+{
+    _GLFWwindow* window = (_GLFWwindow*) handle;
+    _GLFWeventqueue* queue;
+    unsigned int i, head, tail, available;
+
+    _GLFW_REQUIRE_INIT_OR_RETURN(0);
+
+    if (count < 0)
+    {
+        _glfwInputError(GLFW_INVALID_VALUE, "Invalid event count");
+        return 0;
+    }
+
+    queue = _GLFW_ATOMIC_LOAD_PTR(&window->eventQueue);
+    if (!queue)
+        return 0;
+
+    // Only this thread writes the tail, but the head is written concurrently
+    // by the main thread and the events it covers must be seen after it
+    tail = queue->tail;
+    head = _GLFW_ATOMIC_LOAD(&queue->head);
+
+    available = head - tail;
+    if (available > (unsigned int) count)
+        available = (unsigned int) count;
+
+    for (i = 0;  i < available;  i++)
+        events[i] = queue->events[(tail + i) & (_GLFW_EVENT_QUEUE_SIZE - 1)];
+
+    // Hand the copied slots back to the main thread
+    _GLFW_ATOMIC_STORE(&queue->tail, tail + available);
+    return (int) available;
+}
+
+GLFWAPI unsigned int glfwGetFrameId(GLFWwindow* handle)
+{
+    _GLFWwindow* window = (_GLFWwindow*) handle;
+    _GLFW_REQUIRE_INIT_OR_RETURN(0);
+    return window->latency.frame;
+}
+
+GLFWAPI double glfwGetFrameLatency(GLFWwindow* handle, unsigned int frame)
+{
+    _GLFWwindow* window = (_GLFWwindow*) handle;
+
+    _GLFW_REQUIRE_INIT_OR_RETURN(-1.0);
+
+    // Only swapped frames among the most recent ones are kept
+    if (window->latency.frame - frame - 1 >= _GLFW_LATENCY_FRAMES)
+        return -1.0;
+
+    return window->latency.frames[frame % _GLFW_LATENCY_FRAMES].latency;
+}
+
+GLFWAPI const unsigned int* glfwGetLatencyHistogram(GLFWwindow* handle, int* count)
+{
+    _GLFWwindow* window = (_GLFWwindow*) handle;
+
+    if (count)
+        *count = 0;
+
+    _GLFW_REQUIRE_INIT_OR_RETURN(NULL);
+
+    if (count)
+        *count = _GLFW_LATENCY_BUCKETS;
+
+    return window->latency.histogram;
+}
+
 GLFWAPI int glfwJoystickPresent(int joy)
 {
     _GLFW_REQUIRE_INIT_OR_RETURN(0);
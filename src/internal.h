@@ -80,6 +80,7 @@ typedef struct _GLFWwindow      _GLFWwindow;
 typedef struct _GLFWlibrary     _GLFWlibrary;
 typedef struct _GLFWmonitor     _GLFWmonitor;
 typedef struct _GLFWcursor      _GLFWcursor;
+typedef struct _GLFWeventqueue  _GLFWeventqueue;
 
 #if defined(_GLFW_COCOA)
  #include "cocoa_platform.h"
@@ -227,6 +228,34 @@ struct _GLFWfbconfig
 };
 
 
+/*! @brief Number of recent frames whose input latency is kept.
+ */
+#define _GLFW_LATENCY_FRAMES 16
+
+/*! @brief Number of input latency histogram buckets, one per millisecond.
+ */
+#define _GLFW_LATENCY_BUCKETS 100
+
+/*! @brief Time in seconds after which an unfinished frame query is abandoned.
+ */
+#define _GLFW_LATENCY_TIMEOUT 1.0
+
+/*! @brief Frame presentation state, for input latency tracking.
+ */
+typedef struct _GLFWframe
+{
+    // Time of the first input processed for the frame, or negative if none
+    double              input;
+    // Time the buffers were swapped
+    double              swap;
+    // Input latency, or negative until the frame has been presented
+    double              latency;
+    // GPU time when the buffers were swapped, or negative if not queried
+    double              gpuSwap;
+    // Timestamp query completed by the GPU after the swap
+    unsigned int        query;
+} _GLFWframe;
+
 /*! @brief Window and context structure.
  */
 struct _GLFWwindow
@@ -247,11 +276,26 @@ struct _GLFWwindow
     // Window input state
     GLboolean           stickyKeys;
     GLboolean           stickyMouseButtons;
+    GLboolean           queueEvents;
+    _GLFWeventqueue*    eventQueue;
     double              cursorPosX, cursorPosY;
     int                 cursorMode;
     char                mouseButtons[GLFW_MOUSE_BUTTON_LAST + 1];
     char                keys[GLFW_KEY_LAST + 1];
 
+    // Input latency tracking state
+    struct {
+        GLboolean       enabled;
+        // Whether the platform reports when frames are presented
+        GLboolean       swapEvents;
+        // The frame being built and the oldest frame not yet presented
+        unsigned int    frame, presented;
+        // Time of the first input processed for the frame being built
+        double          input;
+        _GLFWframe      frames[_GLFW_LATENCY_FRAMES];
+        unsigned int    histogram[_GLFW_LATENCY_BUCKETS];
+    } latency;
+
     // OpenGL extensions and context attributes
     struct {
         int             api;
@@ -264,6 +308,13 @@ struct _GLFWwindow
 
 #if defined(_GLFW_USE_OPENGL)
     PFNGLGETSTRINGIPROC GetStringi;
+
+    // Timer queries, for input latency tracking (OpenGL 3.3 and above)
+    PFNGLGENQUERIESPROC             GenQueries;
+    PFNGLQUERYCOUNTERPROC           QueryCounter;
+    PFNGLGETQUERYOBJECTIVPROC       GetQueryObjectiv;
+    PFNGLGETQUERYOBJECTUI64VPROC    GetQueryObjectui64v;
+    PFNGLGETINTEGER64VPROC          GetInteger64v;
 #endif
     PFNGLGETINTEGERVPROC GetIntegerv;
     PFNGLGETSTRINGPROC  GetString;
@@ -338,6 +389,10 @@ struct _GLFWlibrary
 
     double              cursorPosX, cursorPosY;
 
+    // Time the platform event being processed was generated, or zero if not
+    // known, in which case input is timed when it is processed
+    double              eventTime;
+
     _GLFWcursor*        cursorListHead;
 
     _GLFWwindow*        windowListHead;
@@ -620,6 +675,16 @@ void _glfwPlatformSwapBuffers(_GLFWwindow* window);
  */
 void _glfwPlatformSwapInterval(int interval);
 
+/*! @brief Enables or disables reporting of frame presentation.
+ *  @param[in] window The window whose frames to report.
+ *  @param[in] enabled `GL_TRUE` to enable reporting, or `GL_FALSE` to disable
+ *  it.
+ *  @return `GL_TRUE` if the platform reports the presentation of frames with
+ *  @ref _glfwInputFramePresented, or `GL_FALSE` otherwise.
+ *  @ingroup platform
+ */
+int _glfwPlatformSelectSwapEvents(_GLFWwindow* window, int enabled);
+
 /*! @copydoc glfwExtensionSupported
  *  @ingroup platform
  */
@@ -780,6 +845,13 @@ void _glfwInputError(int error, const char* format, ...);
  */
 void _glfwInputDrop(_GLFWwindow* window, int count, const char** names);
 
+/*! @brief Notifies shared code that the oldest swapped frame was presented.
+ *  @param[in] window The window whose frame was presented.
+ *  @param[in] time The time, in seconds, when the frame was presented.
+ *  @ingroup event
+ */
+void _glfwInputFramePresented(_GLFWwindow* window, double time);
+
 
 //========================================================================
 // Utility functions
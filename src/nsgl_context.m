@@ -274,6 +274,12 @@ void _glfwPlatformSwapInterval(int interval)
     [window->nsgl.context setValues:&sync forParameter:NSOpenGLCPSwapInterval];
 }
 
+int _glfwPlatformSelectSwapEvents(_GLFWwindow* window, int enabled)
+{
+    // NSGL has no notification of presented frames, so timer queries are used
+    return GL_FALSE;
+}
+
 int _glfwPlatformExtensionSupported(const char* extension)
 {
     // There are no NSGL extensions
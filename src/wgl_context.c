@@ -625,6 +625,12 @@ void _glfwPlatformSwapInterval(int interval)
         window->wgl.SwapIntervalEXT(interval);
 }
 
+int _glfwPlatformSelectSwapEvents(_GLFWwindow* window, int enabled)
+{
+    // WGL has no notification of presented frames, so timer queries are used
+    return GL_FALSE;
+}
+
 int _glfwPlatformExtensionSupported(const char* extension)
 {
     const char* extensions;
@@ -400,6 +400,7 @@ GLFWAPI void glfwDestroyWindow(GLFWwindow* handle)
         *prev = window->next;
     }
 
+    free(window->eventQueue);
     free(window);
 }
 
@@ -117,6 +117,9 @@ typedef struct _GLFWlibraryX11
     Cursor          cursor;
     // Context for mapping window XIDs to _GLFWwindow pointers
     XContext        context;
+    // The last window found through the context
+    Window          lastHandle;
+    _GLFWwindow*    lastWindow;
     // XIM input method
     XIM             im;
     // Most recent error code received by X error handler
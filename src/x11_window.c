@@ -32,6 +32,8 @@
 
 #include <sys/select.h>
 
+#include <time.h>
+
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -164,6 +166,10 @@ static _GLFWwindow* findWindowByHandle(Window handle)
 {
     _GLFWwindow* window;
 
+    // Events mostly arrive in runs for the same window
+    if (handle && handle == _glfw.x11.lastHandle)
+        return _glfw.x11.lastWindow;
+
     if (XFindContext(_glfw.x11.display,
                      handle,
                      _glfw.x11.context,
@@ -172,6 +178,8 @@ static _GLFWwindow* findWindowByHandle(Window handle)
         return NULL;
     }
 
+    _glfw.x11.lastHandle = handle;
+    _glfw.x11.lastWindow = window;
     return window;
 }
 
@@ -871,6 +879,102 @@ static unsigned int decodeUTF8(const char** s)
 }
 #endif /*X_HAVE_UTF8_STRING*/
 
+// Translates an X server timestamp to the GLFW timer, or returns zero if it
+// cannot be translated
+//
+static double translateTime(Time time)
+{
+#if defined(CLOCK_MONOTONIC)
+    if (_glfw.posix_time.monotonic)
+    {
+        struct timespec ts;
+        uint64_t now;
+        uint32_t age;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        now = (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+
+        // The timestamp is the low 32 bits of the server clock in milliseconds,
+        // which is the local monotonic clock for a local server, so only its
+        // age can be recovered
+        age = (uint32_t) now - (uint32_t) time;
+
+        // A server using another clock gives ages that make no sense
+        if (age < 10000)
+        {
+            return (double) (now - age) * 1e-3 -
+                   (double) _glfw.posix_time.base * _glfw.posix_time.resolution;
+        }
+    }
+#endif
+
+    return 0.0;
+}
+
+// Returns the time the specified input event was generated, or zero if it
+// has no timestamp
+//
+static double getEventTime(const XEvent* event)
+{
+    switch (event->type)
+    {
+        case KeyPress:
+        case KeyRelease:
+            return translateTime(event->xkey.time);
+        case ButtonPress:
+        case ButtonRelease:
+            return translateTime(event->xbutton.time);
+        case MotionNotify:
+            return translateTime(event->xmotion.time);
+        case EnterNotify:
+        case LeaveNotify:
+            return translateTime(event->xcrossing.time);
+        default:
+            return 0.0;
+    }
+}
+
+// Returns whether the specified event is a motion event directly followed
+// by another one for the same window, which makes it safe to skip
+//
+static GLboolean isSupersededMotion(const XEvent* event)
+{
+    XEvent next;
+    _GLFWwindow* window;
+
+    if (event->type != MotionNotify)
+        return GL_FALSE;
+
+    // The next event is already queued, so peeking at it does no I/O
+    XPeekEvent(_glfw.x11.display, &next);
+
+    if (next.type != MotionNotify ||
+        next.xmotion.window != event->xmotion.window ||
+        next.xmotion.state != event->xmotion.state)
+    {
+        return GL_FALSE;
+    }
+
+    window = findWindowByHandle(event->xmotion.window);
+    if (!window)
+        return GL_FALSE;
+
+    // The input event queue promises every event, not just the latest state
+    if (window->queueEvents)
+        return GL_FALSE;
+
+    // The motion before a warp has to be reported, as the warp itself is
+    // not, and the delta of a disabled cursor is taken from the last event
+    if (event->xmotion.x == window->x11.warpPosX &&
+        event->xmotion.y == window->x11.warpPosY)
+    {
+        return GL_FALSE;
+    }
+
+    return next.xmotion.x != window->x11.warpPosX ||
+           next.xmotion.y != window->x11.warpPosY;
+}
+
 // Process the specified X event
 //
 static void processEvent(XEvent *event)
@@ -886,6 +990,9 @@ static void processEvent(XEvent *event)
     if (_glfw.x11.im)
         filtered = XFilterEvent(event, None);
 
+    // Input is reported with the time it was generated rather than processed
+    _glfw.eventTime = getEventTime(event);
+
     if (event->type != GenericEvent)
     {
         window = findWindowByHandle(event->xany.window);
@@ -896,6 +1003,27 @@ static void processEvent(XEvent *event)
         }
     }
 
+#if defined(_GLFW_GLX) && defined(GLX_BufferSwapComplete)
+    if (event->type == _glfw.glx.eventBase + GLX_BufferSwapComplete)
+    {
+        const GLXBufferSwapComplete* swap = (GLXBufferSwapComplete*) event;
+        double time;
+
+        // The swap time is in microseconds of the monotonic clock, as used
+        // by the GLFW timer when available
+        if (_glfw.posix_time.monotonic)
+        {
+            time = (double) swap->ust * 1e-6 -
+                   (double) _glfw.posix_time.base * _glfw.posix_time.resolution;
+        }
+        else
+            time = _glfwPlatformGetTime();
+
+        _glfwInputFramePresented(window, time);
+        return;
+    }
+#endif
+
     switch (event->type)
     {
         case KeyPress:
@@ -1143,6 +1271,13 @@ static void processEvent(XEvent *event)
                     _glfwInputCursorMotion(window, x, y);
             }
 
+            else
+            {
+                // Only the first event at the warp position is the warp, so
+                // later motion back to the same position is still reported
+                window->x11.warpPosX = window->x11.warpPosY = INT_MIN;
+            }
+
             window->x11.cursorPosX = x;
             window->x11.cursorPosY = y;
             return;
@@ -1408,6 +1543,8 @@ static void processEvent(XEvent *event)
                 {
                     XIDeviceEvent* data = (XIDeviceEvent*) event->xcookie.data;
 
+                    _glfw.eventTime = translateTime(data->time);
+
                     window = findWindowByHandle(data->event);
                     if (window)
                     {
@@ -1434,6 +1571,8 @@ static void processEvent(XEvent *event)
 
                             _glfwInputCursorMotion(window, x, y);
                         }
+                        else
+                            window->x11.warpPosX = window->x11.warpPosY = INT_MIN;
 
                         window->x11.cursorPosX = data->event_x;
                         window->x11.cursorPosY = data->event_y;
@@ -1536,6 +1675,9 @@ void _glfwPlatformDestroyWindow(_GLFWwindow* window)
             pushSelectionToManager(window);
         }
 
+        if (_glfw.x11.lastHandle == window->x11.handle)
+            _glfw.x11.lastHandle = None;
+
         XDeleteContext(_glfw.x11.display, window->x11.handle, _glfw.x11.context);
         XUnmapWindow(_glfw.x11.display, window->x11.handle);
         XDestroyWindow(_glfw.x11.display, window->x11.handle);
@@ -1809,20 +1951,41 @@ int _glfwPlatformWindowVisible(_GLFWwindow* window)
 
 void _glfwPlatformPollEvents(void)
 {
+    _GLFWwindow* window;
+
+    // Read everything the server has sent so far in one go and process only
+    // those events, so a flood of input cannot keep this call from returning
     int count = XPending(_glfw.x11.display);
     while (count--)
     {
         XEvent event;
         XNextEvent(_glfw.x11.display, &event);
+
+        if (count && isSupersededMotion(&event))
+            continue;
+
         processEvent(&event);
     }
 
-    _GLFWwindow* window = _glfw.cursorWindow;
+    _glfw.eventTime = 0.0;
+
+    window = _glfw.cursorWindow;
     if (window && window->cursorMode == GLFW_CURSOR_DISABLED)
     {
-        int width, height;
-        _glfwPlatformGetWindowSize(window, &width, &height);
-        _glfwPlatformSetCursorPos(window, width / 2, height / 2);
+        // The size is kept up to date by ConfigureNotify and the cursor
+        // position by MotionNotify, so no round trip is needed to find out
+        // whether the cursor has to be moved back to the center
+        const int width = window->x11.width;
+        const int height = window->x11.height;
+
+        // The cursor is confined to the window, so move it back as soon as it
+        // has moved to leave the full half-width for the motion until the next
+        // poll, but only then, as a warp generates motion events of its own
+        if (window->x11.cursorPosX != width / 2 ||
+            window->x11.cursorPosY != height / 2)
+        {
+            _glfwPlatformSetCursorPos(window, width / 2, height / 2);
+        }
     }
 }
 
@@ -0,0 +1,253 @@
+//========================================================================
+// Input event queue test
+// Copyright (c) 2026 agent <agent@local>
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would
+//    be appreciated but is not required.
+//
+// 2. Altered source versions must be plainly marked as such, and must not
+//    be misrepresented as being the original software.
+//
+// 3. This notice may not be removed or altered from any source
+//    distribution.
+//
+//========================================================================
+//
+// This test reads the input event queue of a window on a separate thread
+// while the main thread processes events, and verifies that events arrive
+// in order and that their timestamps never decrease.
+//
+// On X11 it sends itself numbered synthetic motion events, so it needs no
+// interaction and can be run against a virtual server such as Xvfb.  Elsewhere
+// it checks the events you generate until the window is closed.
+//
+//========================================================================
+
+#include "tinycthread.h"
+
+#include <GLFW/glfw3.h>
+
+#if defined(GLFW_EXPOSE_NATIVE_X11)
+ #include <GLFW/glfw3native.h>
+ #include <time.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "getopt.h"
+
+// The synthetic motion events are numbered by their position
+#define ROW_LENGTH 400
+
+static volatile int running = GL_TRUE;
+
+static unsigned long event_count;
+static unsigned long motion_count;
+static unsigned long skipped_count;
+static unsigned long order_errors;
+static unsigned long time_errors;
+
+static void usage(void)
+{
+    printf("Usage: eventqueue [-h] [-n EVENTS]\n");
+    printf("Options:\n");
+    printf("  -h show this help\n");
+    printf("  -n the number of motion events to send (X11)\n");
+}
+
+static void error_callback(int error, const char* description)
+{
+    fprintf(stderr, "Error: %s\n", description);
+}
+
+static int thread_main(void* data)
+{
+    GLFWwindow* window = data;
+    GLFWevent events[64];
+    double last_time = 0.0;
+    long last_index = -1;
+
+    for (;;)
+    {
+        int i, count;
+
+        // Only stop once the queue is empty after the main thread is done
+        const int done = !running;
+
+        count = glfwGetEvents(window, events, 64);
+        if (!count)
+        {
+            if (done)
+                break;
+
+            thrd_yield();
+            continue;
+        }
+
+        for (i = 0;  i < count;  i++)
+        {
+            const GLFWevent* event = events + i;
+
+            if (event->time < last_time)
+            {
+                printf("Event %lu time %0.6f is before the previous %0.6f\n",
+                       event_count, event->time, last_time);
+                time_errors++;
+            }
+
+            last_time = event->time;
+            event_count++;
+
+            if (event->type == GLFW_CURSOR_POS_EVENT)
+            {
+                const long index = (long) event->y * ROW_LENGTH + (long) event->x;
+
+                if (index <= last_index)
+                {
+                    printf("Motion event %li arrived after %li\n",
+                           index, last_index);
+                    order_errors++;
+                }
+                else
+                    skipped_count += index - last_index - 1;
+
+                last_index = index;
+                motion_count++;
+            }
+        }
+    }
+
+    return 0;
+}
+
+#if defined(GLFW_EXPOSE_NATIVE_X11)
+// Sends the specified range of numbered motion events to the window, with
+// timestamps from the clock used by a local X server
+static void send_motion(GLFWwindow* window, int first, int count)
+{
+    int i;
+    XEvent event;
+    struct timespec ts;
+    Display* display = glfwGetX11Display();
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    memset(&event, 0, sizeof(event));
+    event.type = MotionNotify;
+    event.xmotion.window = glfwGetX11Window(window);
+    event.xmotion.time = (Time) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+    for (i = first;  i < first + count;  i++)
+    {
+        event.xmotion.x = i % ROW_LENGTH;
+        event.xmotion.y = i / ROW_LENGTH;
+        XSendEvent(display, event.xmotion.window, False, PointerMotionMask, &event);
+    }
+
+    XFlush(display);
+}
+#endif
+
+int main(int argc, char** argv)
+{
+    int ch, result, total = 100000;
+    thrd_t thread;
+    GLFWwindow* window;
+
+    while ((ch = getopt(argc, argv, "hn:")) != -1)
+    {
+        switch (ch)
+        {
+            case 'h':
+                usage();
+                exit(EXIT_SUCCESS);
+
+            case 'n':
+                total = (int) strtol(optarg, NULL, 10);
+                break;
+
+            default:
+                usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (total <= 0)
+    {
+        usage();
+        exit(EXIT_FAILURE);
+    }
+
+    glfwSetErrorCallback(error_callback);
+
+    if (!glfwInit())
+        exit(EXIT_FAILURE);
+
+    window = glfwCreateWindow(ROW_LENGTH, 300, "Event Queue Test", NULL, NULL);
+    if (!window)
+    {
+        glfwTerminate();
+        exit(EXIT_FAILURE);
+    }
+
+    glfwSetInputMode(window, GLFW_EVENT_QUEUE, GL_TRUE);
+
+    if (thrd_create(&thread, thread_main, window) != thrd_success)
+    {
+        fprintf(stderr, "Failed to create secondary thread\n");
+
+        glfwTerminate();
+        exit(EXIT_FAILURE);
+    }
+
+#if defined(GLFW_EXPOSE_NATIVE_X11)
+    {
+        int sent = 0;
+
+        while (sent < total && !glfwWindowShouldClose(window))
+        {
+            const int count = total - sent < 100 ? total - sent : 100;
+
+            send_motion(window, sent, count);
+            sent += count;
+
+            glfwPollEvents();
+        }
+
+        // Process the events still in flight
+        XSync(glfwGetX11Display(), False);
+        glfwPollEvents();
+    }
+#else
+    while (!glfwWindowShouldClose(window))
+        glfwWaitEvents();
+#endif
+
+    running = GL_FALSE;
+    thrd_join(thread, &result);
+
+    printf("%lu events, %lu motion events, %lu dropped by a full queue\n",
+           event_count, motion_count, skipped_count);
+    printf("%lu out of order, %lu with decreasing time\n",
+           order_errors, time_errors);
+
+    glfwDestroyWindow(window);
+    glfwTerminate();
+
+    if (order_errors || time_errors)
+        exit(EXIT_FAILURE);
+
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,239 @@
+//========================================================================
+// Input latency test
+// Copyright (c) 2026 agent <agent@local>
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would
+//    be appreciated but is not required.
+//
+// 2. Altered source versions must be plainly marked as such, and must not
+//    be misrepresented as being the original software.
+//
+// 3. This notice may not be removed or altered from any source
+//    distribution.
+//
+//========================================================================
+//
+// This test enables input latency tracking for a window, renders frames
+// with input and verifies the frame identifiers, the latency of each frame
+// as it is about to be forgotten and the latency histogram.
+//
+// On X11 it sends itself a synthetic motion event before every frame, so it
+// needs no interaction and can be run against a virtual server such as Xvfb.
+// Elsewhere it measures the input you generate until the window is closed.
+//
+// Whether any frame is measured depends on the platform reporting frame
+// presentation or the context supporting timer queries, so frames without a
+// latency are reported but are not an error.
+//
+//========================================================================
+
+#include <GLFW/glfw3.h>
+
+#if defined(GLFW_EXPOSE_NATIVE_X11)
+ #include <GLFW/glfw3native.h>
+ #include <string.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "getopt.h"
+
+// The number of recent frames whose latency is guaranteed to be kept
+#define KEPT_FRAMES 16
+
+// Latencies above this are assumed to be errors
+#define MAX_LATENCY 1.0
+
+static void usage(void)
+{
+    printf("Usage: latency [-h] [-n FRAMES]\n");
+    printf("Options:\n");
+    printf("  -h show this help\n");
+    printf("  -n the number of frames to render (X11)\n");
+}
+
+static void error_callback(int error, const char* description)
+{
+    fprintf(stderr, "Error: %s\n", description);
+}
+
+#if defined(GLFW_EXPOSE_NATIVE_X11)
+// Sends the window a motion event, so that the next frame has input
+static void send_motion(GLFWwindow* window, int index)
+{
+    XEvent event;
+    Display* display = glfwGetX11Display();
+
+    memset(&event, 0, sizeof(event));
+    event.type = MotionNotify;
+    event.xmotion.window = glfwGetX11Window(window);
+    event.xmotion.x = index % 100;
+    event.xmotion.y = index % 100;
+
+    XSendEvent(display, event.xmotion.window, False, PointerMotionMask, &event);
+    XFlush(display);
+}
+#endif
+
+int main(int argc, char** argv)
+{
+    int ch, i, count, total = 300, frames = 0;
+    unsigned int first, frame, measured = 0, errors = 0, histogram_total = 0;
+    const unsigned int* histogram;
+    GLFWwindow* window;
+
+    while ((ch = getopt(argc, argv, "hn:")) != -1)
+    {
+        switch (ch)
+        {
+            case 'h':
+                usage();
+                exit(EXIT_SUCCESS);
+
+            case 'n':
+                total = (int) strtol(optarg, NULL, 10);
+                break;
+
+            default:
+                usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (total <= KEPT_FRAMES)
+    {
+        usage();
+        exit(EXIT_FAILURE);
+    }
+
+    glfwSetErrorCallback(error_callback);
+
+    if (!glfwInit())
+        exit(EXIT_FAILURE);
+
+    window = glfwCreateWindow(200, 200, "Input Latency Test", NULL, NULL);
+    if (!window)
+    {
+        glfwTerminate();
+        exit(EXIT_FAILURE);
+    }
+
+    glfwMakeContextCurrent(window);
+    glfwSwapInterval(1);
+
+    glfwSetInputMode(window, GLFW_LATENCY_TRACKING, GL_TRUE);
+    if (glfwGetInputMode(window, GLFW_LATENCY_TRACKING) != GL_TRUE)
+    {
+        printf("Latency tracking could not be enabled\n");
+        errors++;
+    }
+
+    first = glfwGetFrameId(window);
+
+    for (;;)
+    {
+#if defined(GLFW_EXPOSE_NATIVE_X11)
+        if (frames == total)
+            break;
+
+        send_motion(window, frames);
+        XSync(glfwGetX11Display(), False);
+#endif
+        glfwPollEvents();
+
+        if (glfwWindowShouldClose(window))
+            break;
+
+        frame = glfwGetFrameId(window);
+        if (frame != first + frames)
+        {
+            printf("Frame %u has identifier %u\n", frames, frame - first);
+            errors++;
+        }
+
+        // The current frame has not been presented yet
+        if (glfwGetFrameLatency(window, frame) >= 0.0 ||
+            glfwGetFrameLatency(window, frame + 1) >= 0.0)
+        {
+            printf("Frame %u has latency before being swapped\n", frames);
+            errors++;
+        }
+
+        glClear(GL_COLOR_BUFFER_BIT);
+        glfwSwapBuffers(window);
+        frames++;
+
+        // Check the oldest frame that is still kept, once for each frame
+        if (frames >= KEPT_FRAMES)
+        {
+            const double latency = glfwGetFrameLatency(window, frame + 1 - KEPT_FRAMES);
+
+            if (latency > MAX_LATENCY)
+            {
+                printf("Frame %u has latency %0.3f s\n",
+                       frame + 1 - KEPT_FRAMES - first, latency);
+                errors++;
+            }
+            else if (latency >= 0.0)
+                measured++;
+        }
+    }
+
+    histogram = glfwGetLatencyHistogram(window, &count);
+    if (!histogram || count <= 0)
+    {
+        printf("No latency histogram was returned\n");
+        errors++;
+    }
+    else
+    {
+        for (i = 0;  i < count;  i++)
+            histogram_total += histogram[i];
+
+        // Every measured frame is counted, and frames can only be counted once
+        if (histogram_total < measured || histogram_total > (unsigned int) frames)
+        {
+            printf("The histogram counts %u frames of %u measured and %i swapped\n",
+                   histogram_total, measured, frames);
+            errors++;
+        }
+
+        if (histogram_total)
+        {
+            int median = 0;
+            unsigned int sum = 0;
+
+            while (sum + histogram[median] <= histogram_total / 2)
+                sum += histogram[median++];
+
+            printf("Median latency %i ms\n", median);
+        }
+    }
+
+    printf("%i frames swapped, %u measured when checked, %u in the histogram\n",
+           frames, measured, histogram_total);
+
+    if (!histogram_total)
+        printf("No frame was measured; presentation times are not available\n");
+
+    printf("%u errors\n", errors);
+
+    glfwDestroyWindow(window);
+    glfwTerminate();
+
+    if (errors)
+        exit(EXIT_FAILURE);
+
+    exit(EXIT_SUCCESS);
+}
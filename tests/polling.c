@@ -0,0 +1,191 @@
+//========================================================================
+// Event polling benchmark
+// Copyright (c) 2026 agent <agent@local>
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+// 1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would
+//    be appreciated but is not required.
+//
+// 2. Altered source versions must be plainly marked as such, and must not
+//    be misrepresented as being the original software.
+//
+// 3. This notice may not be removed or altered from any source
+//    distribution.
+//
+//========================================================================
+//
+// This test measures how long glfwPollEvents takes, optionally with the
+// cursor disabled, and on X11 how many requests it sends to the server per
+// call. On X11 it can also flood the window with synthetic motion events
+// before every poll. It needs no interaction and can be run against a
+// virtual server such as Xvfb.
+//
+//========================================================================
+
+#include <GLFW/glfw3.h>
+
+#if defined(GLFW_EXPOSE_NATIVE_X11)
+ #include <GLFW/glfw3native.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "getopt.h"
+
+static void usage(void)
+{
+    printf("Usage: polling [-d] [-h] [-m EVENTS] [-n POLLS]\n");
+    printf("Options:\n");
+    printf("  -d disable the cursor\n");
+    printf("  -h show this help\n");
+    printf("  -m send the number of motion events before every poll (X11)\n");
+    printf("  -n the number of polls to measure\n");
+}
+
+static unsigned long motion_count;
+
+static void cursor_position_callback(GLFWwindow* window, double x, double y)
+{
+    motion_count++;
+}
+
+#if defined(GLFW_EXPOSE_NATIVE_X11)
+// Queue the specified number of motion events for the window, as a high
+// rate pointing device would
+static void send_motion(GLFWwindow* window, int count)
+{
+    int i;
+    XEvent event;
+    Display* display = glfwGetX11Display();
+
+    memset(&event, 0, sizeof(event));
+    event.type = MotionNotify;
+    event.xmotion.window = glfwGetX11Window(window);
+
+    for (i = 0;  i < count;  i++)
+    {
+        event.xmotion.x = 100 + i % 200;
+        event.xmotion.y = 100 + i % 100;
+        XSendEvent(display, event.xmotion.window, False, PointerMotionMask, &event);
+    }
+
+    // Wait for the events to arrive, so only their processing is measured
+    XSync(display, False);
+}
+#endif
+
+static void error_callback(int error, const char* description)
+{
+    fprintf(stderr, "Error: %s\n", description);
+}
+
+int main(int argc, char** argv)
+{
+    int ch, i, count = 100000, motions = 0;
+    GLboolean disabled = GL_FALSE;
+    GLFWwindow* window;
+    double start, elapsed = 0.0;
+#if defined(GLFW_EXPOSE_NATIVE_X11)
+    unsigned long requests = 0;
+#endif
+
+    while ((ch = getopt(argc, argv, "dhm:n:")) != -1)
+    {
+        switch (ch)
+        {
+            case 'd':
+                disabled = GL_TRUE;
+                break;
+
+            case 'h':
+                usage();
+                exit(EXIT_SUCCESS);
+
+            case 'm':
+                motions = (int) strtol(optarg, NULL, 10);
+                break;
+
+            case 'n':
+                count = (int) strtol(optarg, NULL, 10);
+                break;
+
+            default:
+                usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (count <= 0 || motions < 0)
+    {
+        usage();
+        exit(EXIT_FAILURE);
+    }
+
+    glfwSetErrorCallback(error_callback);
+
+    if (!glfwInit())
+        exit(EXIT_FAILURE);
+
+    window = glfwCreateWindow(640, 480, "Event Polling Benchmark", NULL, NULL);
+    if (!window)
+    {
+        glfwTerminate();
+        exit(EXIT_FAILURE);
+    }
+
+    if (disabled)
+        glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+
+    glfwSetCursorPosCallback(window, cursor_position_callback);
+
+    // Let the window be mapped and configured before measuring
+    for (i = 0;  i < 100;  i++)
+        glfwPollEvents();
+
+    motion_count = 0;
+
+    for (i = 0;  i < count;  i++)
+    {
+#if defined(GLFW_EXPOSE_NATIVE_X11)
+        unsigned long first_request;
+
+        if (motions)
+            send_motion(window, motions);
+
+        first_request = NextRequest(glfwGetX11Display());
+#endif
+
+        start = glfwGetTime();
+        glfwPollEvents();
+        elapsed += glfwGetTime() - start;
+
+#if defined(GLFW_EXPOSE_NATIVE_X11)
+        requests += NextRequest(glfwGetX11Display()) - first_request;
+#endif
+    }
+
+    printf("%i polls with the cursor %s: %0.3f us per poll\n",
+           count, disabled ? "disabled" : "normal",
+           elapsed * 1e6 / count);
+    printf("%0.3f cursor position callbacks per poll\n",
+           (double) motion_count / count);
+
+#if defined(GLFW_EXPOSE_NATIVE_X11)
+    printf("%0.3f X requests per poll\n", (double) requests / count);
+#endif
+
+    glfwDestroyWindow(window);
+    glfwTerminate();
+    exit(EXIT_SUCCESS);
+}
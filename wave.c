@@ -15,11 +15,19 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
 #include <math.h>
+#include <stdint.h>
 
+#define GLFW_INCLUDE_GLEXT
 #include <GLFW/glfw3.h>
 
+#include <tinycthread.h>
+#include <workpool.h>
+#include <getopt.h>
 #include <linmath.h>
+#include <gridmesh.h>
 
 // Maximum delta T to allow for differential calculations
 #define MAX_DELTA_T 0.01
@@ -27,9 +35,17 @@
 // Animation speed (10.0 looks good)
 #define ANIMATION_SPEED 10.0
 
+// Default time budget for the simulation of a frame (ms)
+#define DEFAULT_BUDGET 8.0
+
+// Interval between reports of a slowed down simulation (s)
+#define REPORT_INTERVAL 5.0
+
 GLfloat alpha = 210.f, beta = -70.f;
 GLfloat zoom = 2.f;
 
+mat4x4 projection;
+
 double cursorX;
 double cursorY;
 
@@ -39,45 +55,99 @@ struct Vertex
     GLfloat r, g, b;
 };
 
-#define GRIDW 50
-#define GRIDH 50
-#define VERTEXNUM (GRIDW*GRIDH)
+// A reusable barrier for a fixed number of threads. The counters are only
+// accessed atomically.
+typedef struct
+{
+    mtx_t lock;
+    cnd_t opened;      // Signalled when the barrier opens, if anyone sleeps
+    int   count;       // Number of threads using the barrier
+    int   arrived;     // Number of threads waiting at the barrier
+    int   generation;  // Number of times the barrier has opened
+    int   sleepers;    // Number of threads sleeping on the condition
+} Barrier;
+
+// Define WAVE_FLOAT to run the simulation in single precision
+#if defined(WAVE_FLOAT)
+typedef float Real;
+#else
+typedef double Real;
+#endif
+
+// Default and maximum grid dimensions (vertices)
+#define DEFAULT_GRID_SIZE 50
+#define MAX_GRID_SIZE 16384
+
+// Width of the column tiles the grid is updated in (cells). The rows of a
+// tile touched by one row update (two of pressure and velocity each) stay
+// in the L1 cache until the next row update reuses them.
+#define TILE_WIDTH 512
 
-#define QUADW (GRIDW - 1)
-#define QUADH (GRIDH - 1)
-#define QUADNUM (QUADW*QUADH)
+int grid_width = DEFAULT_GRID_SIZE;
+int grid_height = DEFAULT_GRID_SIZE;
 
-GLuint quad[4 * QUADNUM];
-struct Vertex vertex[VERTEXNUM];
+struct Vertex* vertex;
 
-/* The grid will look like this:
+/* The grid will look like this, drawn as triangle strips along the rows
+ * of quads:
  *
  *      3   4   5
  *      *---*---*
- *      |   |   |
- *      | 0 | 1 |
- *      |   |   |
+ *      |  /|  /|
+ *      | / | / |
+ *      |/  |/  |
  *      *---*---*
  *      0   1   2
  */
 
+// Triangle strips of the legacy renderer, joined by degenerate triangles
+GLvoid* strips;
+GLsizei strip_count;
+GLenum strip_type;
+
+//========================================================================
+// Print usage information
+//========================================================================
+
+static void usage(void)
+{
+    printf("Usage: wave [-ghl] [-b steps] [-j threads] [-s size] [-t budget]\n");
+    printf("Options:\n");
+    printf(" -b   Benchmark the simulation for the given number of steps\n");
+    printf(" -g   Run the simulation on the GPU (needs OpenGL 3.3), with -b also\n"
+           "      compare it with the CPU\n");
+    printf(" -h   Display this help\n");
+    printf(" -j   Number of simulation threads (default is one per processor)\n");
+    printf(" -l   Use the legacy vertex array renderer\n");
+    printf(" -s   Grid size as WIDTHxHEIGHT, or a single number for a square grid\n"
+           "      (default is %i, maximum is %i)\n",
+           DEFAULT_GRID_SIZE, MAX_GRID_SIZE);
+    printf(" -t   Time budget for the simulation of a frame in ms (default is %g)\n",
+           DEFAULT_BUDGET);
+}
+
+
 //========================================================================
 // Initialize grid geometry
 //========================================================================
 
-void init_vertices(void)
+int init_vertices(void)
 {
     int x, y, p;
 
+    vertex = malloc(sizeof(struct Vertex) * grid_width * grid_height);
+    if (!vertex)
+        return GL_FALSE;
+
     // Place the vertices in a grid
-    for (y = 0;  y < GRIDH;  y++)
+    for (y = 0;  y < grid_height;  y++)
     {
-        for (x = 0;  x < GRIDW;  x++)
+        for (x = 0;  x < grid_width;  x++)
         {
-            p = y * GRIDW + x;
+            p = y * grid_width + x;
 
-            vertex[p].x = (GLfloat) (x - GRIDW / 2) / (GLfloat) (GRIDW / 2);
-            vertex[p].y = (GLfloat) (y - GRIDH / 2) / (GLfloat) (GRIDH / 2);
+            vertex[p].x = (GLfloat) (x - grid_width / 2) / (GLfloat) (grid_width / 2);
+            vertex[p].y = (GLfloat) (y - grid_height / 2) / (GLfloat) (grid_height / 2);
             vertex[p].z = 0;
 
             if ((x % 4 < 2) ^ (y % 4 < 2))
@@ -85,29 +155,79 @@ void init_vertices(void)
             else
                 vertex[p].r = 1.0;
 
-            vertex[p].g = (GLfloat) y / (GLfloat) GRIDH;
-            vertex[p].b = 1.f - ((GLfloat) x / (GLfloat) GRIDW + (GLfloat) y / (GLfloat) GRIDH) / 2.f;
+            vertex[p].g = (GLfloat) y / (GLfloat) grid_height;
+            vertex[p].b = 1.f - ((GLfloat) x / (GLfloat) grid_width + (GLfloat) y / (GLfloat) grid_height) / 2.f;
         }
     }
 
-    for (y = 0;  y < QUADH;  y++)
-    {
-        for (x = 0;  x < QUADW;  x++)
-        {
-            p = 4 * (y * QUADW + x);
+    return GL_TRUE;
+}
 
-            quad[p + 0] = y       * GRIDW + x;     // Some point
-            quad[p + 1] = y       * GRIDW + x + 1; // Neighbor at the right side
-            quad[p + 2] = (y + 1) * GRIDW + x + 1; // Upper right neighbor
-            quad[p + 3] = (y + 1) * GRIDW + x;     // Upper neighbor
-        }
-    }
+// Build the triangle strips of the grid, with 16-bit indices if possible.
+// The strips are separated by the restart index or, for contexts without
+// primitive restart, joined by degenerate triangles
+GLvoid* make_strips(int restart, GLsizei* count, GLenum* type)
+{
+    const int size = grid_index_size(grid_width, grid_height);
+    GLvoid* indices;
+
+    *count = grid_strip_index_count(grid_width, grid_height, restart);
+    *type = size == 2 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+
+    indices = malloc((size_t) size * *count);
+    if (indices)
+        grid_strip_indices(indices, size, grid_width, grid_height, restart);
+
+    return indices;
 }
 
+// The simulation state is stored row by row, with grid_stride elements per
+// row. The pressure has a halo column at x = grid_width and a halo row at
+// y = grid_height, which hold copies of column and row 0 for the wraparound
+// of the velocity update. The pressures of row and column 0 never change, so
+// the halos only need to be filled in by init_grid.
 double dt;
-double p[GRIDW][GRIDH];
-double vx[GRIDW][GRIDH], vy[GRIDW][GRIDH];
-double ax[GRIDW][GRIDH], ay[GRIDW][GRIDH];
+int grid_stride;
+Real* p;
+Real* vx;
+Real* vy;
+
+// Simulation scheduling, to keep slow frames from making the following
+// frames slower
+struct {
+    double budget;       // Time allowed for the simulation of a frame (s)
+    double step_cost;    // Running average of the time of a step (s)
+    double simulated;    // Simulation time advanced since the last report (s)
+    double dropped;      // Simulation time dropped since the last report (s)
+    double report_time;  // Time of the last report (s)
+} scheduler;
+
+// The simulation threads, including the main thread
+struct {
+    thrd_t*  threads;
+    int      count;
+    Barrier  barrier;
+    Real     time_step;  // Time step of the current step
+    int      quit;       // Tells the threads to exit
+} simulation;
+
+//========================================================================
+// Allocate the simulation grid
+//========================================================================
+
+int alloc_grid(void)
+{
+    const size_t rows = grid_height + 1;
+
+    grid_stride = grid_width + 1;
+
+    p = calloc(rows * grid_stride, sizeof(Real));
+    vx = calloc((size_t) grid_height * grid_stride, sizeof(Real));
+    vy = calloc((size_t) grid_height * grid_stride, sizeof(Real));
+
+    return p && vx && vy;
+}
+
 
 //========================================================================
 // Initialize grid
@@ -117,26 +237,665 @@ void init_grid(void)
 {
     int x, y;
     double dx, dy, d;
+    Real* row;
 
-    for (y = 0; y < GRIDH;  y++)
+    for (y = 0; y < grid_height;  y++)
     {
-        for (x = 0; x < GRIDW;  x++)
+        row = p + (size_t) y * grid_stride;
+
+        for (x = 0; x < grid_width;  x++)
         {
-            dx = (double) (x - GRIDW / 2);
-            dy = (double) (y - GRIDH / 2);
+            dx = (double) (x - grid_width / 2);
+            dy = (double) (y - grid_height / 2);
             d = sqrt(dx * dx + dy * dy);
-            if (d < 0.1 * (double) (GRIDW / 2))
+            if (d < 0.1 * (double) (grid_width / 2))
             {
                 d = d * 10.0;
-                p[x][y] = -cos(d * (M_PI / (double)(GRIDW * 4))) * 100.0;
+                row[x] = (Real) (-cos(d * (M_PI / (double)(grid_width * 4))) * 100.0);
             }
             else
-                p[x][y] = 0.0;
+                row[x] = 0.0;
+        }
+
+        row[grid_width] = row[0];
+    }
+
+    memcpy(p + (size_t) grid_height * grid_stride, p, sizeof(Real) * grid_stride);
+
+    memset(vx, 0, sizeof(Real) * grid_height * grid_stride);
+    memset(vy, 0, sizeof(Real) * grid_height * grid_stride);
+}
+
+
+//========================================================================
+// Streaming renderer. The positions, colours and triangle indices of the
+// grid never change, so they are uploaded once into immutable buffers. Only
+// the heights change, and adjust_grid writes them straight into a
+// persistently mapped buffer with room for three frames of heights, so the
+// driver never has to copy them. A fence per frame keeps the heights of a
+// frame from being overwritten before the GPU is done with them. This needs
+// OpenGL 3.3 and ARB_buffer_storage and only uses core profile functionality.
+//========================================================================
+
+#define HEIGHT_FRAMES 3
+
+static PFNGLCREATESHADERPROC glCreateShader;
+static PFNGLSHADERSOURCEPROC glShaderSource;
+static PFNGLCOMPILESHADERPROC glCompileShader;
+static PFNGLGETSHADERIVPROC glGetShaderiv;
+static PFNGLGETSHADERINFOLOGPROC glGetShaderInfoLog;
+static PFNGLCREATEPROGRAMPROC glCreateProgram;
+static PFNGLATTACHSHADERPROC glAttachShader;
+static PFNGLBINDATTRIBLOCATIONPROC glBindAttribLocation;
+static PFNGLLINKPROGRAMPROC glLinkProgram;
+static PFNGLGETPROGRAMIVPROC glGetProgramiv;
+static PFNGLGETPROGRAMINFOLOGPROC glGetProgramInfoLog;
+static PFNGLUSEPROGRAMPROC glUseProgram;
+static PFNGLGETUNIFORMLOCATIONPROC glGetUniformLocation;
+static PFNGLUNIFORMMATRIX4FVPROC glUniformMatrix4fv;
+static PFNGLGENBUFFERSPROC glGenBuffers;
+static PFNGLBINDBUFFERPROC glBindBuffer;
+static PFNGLBUFFERSTORAGEPROC glBufferStorage;
+static PFNGLMAPBUFFERRANGEPROC glMapBufferRange;
+static PFNGLGENVERTEXARRAYSPROC glGenVertexArrays;
+static PFNGLBINDVERTEXARRAYPROC glBindVertexArray;
+static PFNGLENABLEVERTEXATTRIBARRAYPROC glEnableVertexAttribArray;
+static PFNGLVERTEXATTRIBPOINTERPROC glVertexAttribPointer;
+static PFNGLFENCESYNCPROC glFenceSync;
+static PFNGLCLIENTWAITSYNCPROC glClientWaitSync;
+static PFNGLDELETESYNCPROC glDeleteSync;
+static PFNGLPRIMITIVERESTARTINDEXPROC glPrimitiveRestartIndex;
+
+static const char* grid_vertex_shader_text =
+"#version 330\n"
+"uniform mat4 mvp;\n"
+"in vec2 position;\n"
+"in float height;\n"
+"in vec3 color;\n"
+"out vec3 vertex_color;\n"
+"void main()\n"
+"{\n"
+"    vertex_color = color;\n"
+"    gl_Position = mvp * vec4(position, height, 1.0);\n"
+"}\n";
+
+static const char* grid_fragment_shader_text =
+"#version 330\n"
+"in vec3 vertex_color;\n"
+"out vec4 frag_color;\n"
+"void main()\n"
+"{\n"
+"    frag_color = vec4(vertex_color, 1.0);\n"
+"}\n";
+
+struct {
+    GLuint   program;        // Zero if the streaming renderer is not used
+    GLint    mvp_location;
+    GLuint   vertex_array;
+    GLuint   height_buffer;
+    GLfloat* heights;        // Mapping of all frames of the height buffer
+    GLsync   fences[HEIGHT_FRAMES];
+    int      frame;          // Height frame of the current frame
+    GLsizei  index_count;
+    GLenum   index_type;
+} stream;
+
+#define LOAD_GL_FUNCTION(type, name) \
+    if (!(name = (type) glfwGetProcAddress(#name))) return GL_FALSE
+
+// Load the functions shared by the streaming renderer and the GPU simulation
+static int load_shader_functions(void)
+{
+    LOAD_GL_FUNCTION(PFNGLCREATESHADERPROC, glCreateShader);
+    LOAD_GL_FUNCTION(PFNGLSHADERSOURCEPROC, glShaderSource);
+    LOAD_GL_FUNCTION(PFNGLCOMPILESHADERPROC, glCompileShader);
+    LOAD_GL_FUNCTION(PFNGLGETSHADERIVPROC, glGetShaderiv);
+    LOAD_GL_FUNCTION(PFNGLGETSHADERINFOLOGPROC, glGetShaderInfoLog);
+    LOAD_GL_FUNCTION(PFNGLCREATEPROGRAMPROC, glCreateProgram);
+    LOAD_GL_FUNCTION(PFNGLATTACHSHADERPROC, glAttachShader);
+    LOAD_GL_FUNCTION(PFNGLBINDATTRIBLOCATIONPROC, glBindAttribLocation);
+    LOAD_GL_FUNCTION(PFNGLLINKPROGRAMPROC, glLinkProgram);
+    LOAD_GL_FUNCTION(PFNGLGETPROGRAMIVPROC, glGetProgramiv);
+    LOAD_GL_FUNCTION(PFNGLGETPROGRAMINFOLOGPROC, glGetProgramInfoLog);
+    LOAD_GL_FUNCTION(PFNGLUSEPROGRAMPROC, glUseProgram);
+    LOAD_GL_FUNCTION(PFNGLGETUNIFORMLOCATIONPROC, glGetUniformLocation);
+    LOAD_GL_FUNCTION(PFNGLUNIFORMMATRIX4FVPROC, glUniformMatrix4fv);
+    LOAD_GL_FUNCTION(PFNGLGENBUFFERSPROC, glGenBuffers);
+    LOAD_GL_FUNCTION(PFNGLBINDBUFFERPROC, glBindBuffer);
+    LOAD_GL_FUNCTION(PFNGLGENVERTEXARRAYSPROC, glGenVertexArrays);
+    LOAD_GL_FUNCTION(PFNGLBINDVERTEXARRAYPROC, glBindVertexArray);
+    LOAD_GL_FUNCTION(PFNGLENABLEVERTEXATTRIBARRAYPROC, glEnableVertexAttribArray);
+    LOAD_GL_FUNCTION(PFNGLVERTEXATTRIBPOINTERPROC, glVertexAttribPointer);
+    LOAD_GL_FUNCTION(PFNGLPRIMITIVERESTARTINDEXPROC, glPrimitiveRestartIndex);
+    return GL_TRUE;
+}
+
+static int load_stream_functions(void)
+{
+    if (!load_shader_functions())
+        return GL_FALSE;
+
+    LOAD_GL_FUNCTION(PFNGLBUFFERSTORAGEPROC, glBufferStorage);
+    LOAD_GL_FUNCTION(PFNGLMAPBUFFERRANGEPROC, glMapBufferRange);
+    LOAD_GL_FUNCTION(PFNGLFENCESYNCPROC, glFenceSync);
+    LOAD_GL_FUNCTION(PFNGLCLIENTWAITSYNCPROC, glClientWaitSync);
+    LOAD_GL_FUNCTION(PFNGLDELETESYNCPROC, glDeleteSync);
+    return GL_TRUE;
+}
 
-            vx[x][y] = 0.0;
-            vy[x][y] = 0.0;
+static GLuint compile_shader(GLenum type, const char* text)
+{
+    GLint status;
+    GLchar log[1024];
+    GLuint shader = glCreateShader(type);
+
+    glShaderSource(shader, 1, &text, NULL);
+    glCompileShader(shader);
+
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    if (status != GL_TRUE)
+    {
+        glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+        fprintf(stderr, "Failed to compile grid shader:\n%s\n", log);
+        return 0;
+    }
+
+    return shader;
+}
+
+static GLuint link_program(GLuint vertex_shader, GLuint fragment_shader)
+{
+    GLint status;
+    GLchar log[1024];
+    GLuint program = glCreateProgram();
+
+    glAttachShader(program, vertex_shader);
+    glAttachShader(program, fragment_shader);
+    glBindAttribLocation(program, 0, "position");
+    glBindAttribLocation(program, 1, "height");
+    glBindAttribLocation(program, 2, "color");
+    glLinkProgram(program);
+
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (status != GL_TRUE)
+    {
+        glGetProgramInfoLog(program, sizeof(log), NULL, log);
+        fprintf(stderr, "Failed to link grid shader:\n%s\n", log);
+        return 0;
+    }
+
+    return program;
+}
+
+// Set up the streaming renderer, leaving stream.program at zero if the
+// context does not support it
+void init_stream_renderer(GLFWwindow* window)
+{
+    const int major = glfwGetWindowAttrib(window, GLFW_CONTEXT_VERSION_MAJOR);
+    const int minor = glfwGetWindowAttrib(window, GLFW_CONTEXT_VERSION_MINOR);
+    const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT |
+                             GL_MAP_COHERENT_BIT;
+    const size_t vertex_count = (size_t) grid_width * grid_height;
+    GLuint vertex_shader, fragment_shader, program, buffers[2];
+    GLvoid* indices;
+
+    if (major < 3 || (major == 3 && minor < 3))
+        return;
+
+    if ((major < 4 || (major == 4 && minor < 4)) &&
+        !glfwExtensionSupported("GL_ARB_buffer_storage"))
+    {
+        return;
+    }
+
+    if (!load_stream_functions())
+        return;
+
+    vertex_shader = compile_shader(GL_VERTEX_SHADER, grid_vertex_shader_text);
+    fragment_shader = compile_shader(GL_FRAGMENT_SHADER, grid_fragment_shader_text);
+    if (!vertex_shader || !fragment_shader)
+        return;
+
+    program = link_program(vertex_shader, fragment_shader);
+    if (!program)
+        return;
+
+    // There are no quads in the core profile, so the grid is drawn as
+    // triangle strips separated by the restart index
+    indices = make_strips(GL_TRUE, &stream.index_count, &stream.index_type);
+    if (!indices)
+        return;
+
+    glGenVertexArrays(1, &stream.vertex_array);
+    glBindVertexArray(stream.vertex_array);
+
+    glGenBuffers(2, buffers);
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers[0]);
+    glBufferStorage(GL_ELEMENT_ARRAY_BUFFER,
+                    (stream.index_type == GL_UNSIGNED_SHORT ? 2 : 4) *
+                    (GLsizeiptr) stream.index_count,
+                    indices, 0);
+    free(indices);
+
+    // The z of the vertices is not used, but uploading them as they are is
+    // simpler than repacking them
+    glBindBuffer(GL_ARRAY_BUFFER, buffers[1]);
+    glBufferStorage(GL_ARRAY_BUFFER, sizeof(struct Vertex) * vertex_count,
+                    vertex, 0);
+
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(struct Vertex),
+                          (void*) offsetof(struct Vertex, x));
+
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(struct Vertex),
+                          (void*) offsetof(struct Vertex, r));
+
+    glGenBuffers(1, &stream.height_buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, stream.height_buffer);
+    glBufferStorage(GL_ARRAY_BUFFER,
+                    sizeof(GLfloat) * vertex_count * HEIGHT_FRAMES,
+                    NULL, flags);
+
+    stream.heights = glMapBufferRange(GL_ARRAY_BUFFER, 0,
+                                      sizeof(GLfloat) * vertex_count * HEIGHT_FRAMES,
+                                      flags);
+    if (stream.heights)
+        glEnableVertexAttribArray(1);
+
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    if (!stream.heights)
+        return;
+
+    // Only this renderer draws elements, so the restart index is left on.
+    // It is enabled last, as the strips drawn when any of the above fails
+    // must not be cut at the restart index.
+    glEnable(GL_PRIMITIVE_RESTART);
+    glPrimitiveRestartIndex(stream.index_type == GL_UNSIGNED_SHORT ?
+                            0xffff : 0xffffffff);
+
+    stream.mvp_location = glGetUniformLocation(program, "mvp");
+    stream.program = program;
+}
+
+// Return the heights of the next frame, once the GPU is done with them
+GLfloat* begin_height_frame(void)
+{
+    GLsync fence;
+
+    stream.frame = (stream.frame + 1) % HEIGHT_FRAMES;
+
+    fence = stream.fences[stream.frame];
+    if (fence)
+    {
+        while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) ==
+               GL_TIMEOUT_EXPIRED)
+        {
         }
+
+        glDeleteSync(fence);
+        stream.fences[stream.frame] = NULL;
+    }
+
+    return stream.heights + (size_t) stream.frame * grid_width * grid_height;
+}
+
+// Draw the grid with the heights of the current frame
+void draw_stream(mat4x4 mvp)
+{
+    const size_t offset = sizeof(GLfloat) * stream.frame * grid_width * grid_height;
+
+    glUseProgram(stream.program);
+    glUniformMatrix4fv(stream.mvp_location, 1, GL_FALSE, (const GLfloat*) mvp);
+
+    glBindVertexArray(stream.vertex_array);
+    glBindBuffer(GL_ARRAY_BUFFER, stream.height_buffer);
+    glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, 0, (void*) offset);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    glDrawElements(GL_TRIANGLE_STRIP, stream.index_count, stream.index_type, NULL);
+
+    glBindVertexArray(0);
+    glUseProgram(0);
+
+    stream.fences[stream.frame] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+
+//========================================================================
+// GPU simulation. The pressure and velocities are kept in a pair of RGBA32F
+// textures, as (p, vx, vy, unused), and each step renders the new state of
+// every cell from the old one into the other texture. The grid is then
+// drawn straight from the state texture, so nothing goes between the CPU
+// and the GPU after the initial upload. This needs OpenGL 3.3 and runs in
+// single precision.
+//========================================================================
+
+// Number of frames of steps that can be timed on the GPU at once
+#define GPU_TIMER_QUERIES 4
+
+static PFNGLBUFFERDATAPROC glBufferData;
+static PFNGLUNIFORM1FPROC glUniform1f;
+static PFNGLGENFRAMEBUFFERSPROC glGenFramebuffers;
+static PFNGLBINDFRAMEBUFFERPROC glBindFramebuffer;
+static PFNGLFRAMEBUFFERTEXTURE2DPROC glFramebufferTexture2D;
+static PFNGLCHECKFRAMEBUFFERSTATUSPROC glCheckFramebufferStatus;
+static PFNGLGENQUERIESPROC glGenQueries;
+static PFNGLBEGINQUERYPROC glBeginQuery;
+static PFNGLENDQUERYPROC glEndQuery;
+static PFNGLGETQUERYOBJECTIVPROC glGetQueryObjectiv;
+static PFNGLGETQUERYOBJECTUI64VPROC glGetQueryObjectui64v;
+
+// Draws a triangle covering the viewport without any vertex data
+static const char* step_vertex_shader_text =
+"#version 330\n"
+"void main()\n"
+"{\n"
+"    vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);\n"
+"    gl_Position = vec4(corner * 4.0 - 1.0, 0.0, 1.0);\n"
+"}\n";
+
+// The same update as calc_speeds and calc_pressure. The pressure update
+// needs the new velocities of the cells to the left and below, which are
+// computed again here from their old state
+static const char* step_fragment_shader_text =
+"#version 330\n"
+"uniform sampler2D state;\n"
+"uniform float time_step;\n"
+"out vec4 new_state;\n"
+"void main()\n"
+"{\n"
+"    ivec2 size = textureSize(state, 0);\n"
+"    ivec2 cell = ivec2(gl_FragCoord.xy);\n"
+"    vec4 s = texelFetch(state, cell, 0);\n"
+"    float right = texelFetch(state, ivec2((cell.x + 1) % size.x, cell.y), 0).x;\n"
+"    float above = texelFetch(state, ivec2(cell.x, (cell.y + 1) % size.y), 0).x;\n"
+"    float vx = s.y + (s.x - right) * time_step;\n"
+"    float vy = s.z + (s.x - above) * time_step;\n"
+"    float p = s.x;\n"
+"    if (cell.x > 0 && cell.y > 0)\n"
+"    {\n"
+"        vec4 left = texelFetch(state, cell - ivec2(1, 0), 0);\n"
+"        vec4 below = texelFetch(state, cell - ivec2(0, 1), 0);\n"
+"        float vx_left = left.y + (left.x - s.x) * time_step;\n"
+"        float vy_below = below.z + (below.x - s.x) * time_step;\n"
+"        p = p + (vx_left - vx + vy_below - vy) * time_step;\n"
+"    }\n"
+"    new_state = vec4(p, vx, vy, 0.0);\n"
+"}\n";
+
+// Like grid_vertex_shader_text, with the height read from the state
+static const char* gpu_grid_vertex_shader_text =
+"#version 330\n"
+"uniform mat4 mvp;\n"
+"uniform sampler2D state;\n"
+"in vec2 position;\n"
+"in vec3 color;\n"
+"out vec3 vertex_color;\n"
+"void main()\n"
+"{\n"
+"    int width = textureSize(state, 0).x;\n"
+"    ivec2 cell = ivec2(gl_VertexID % width, gl_VertexID / width);\n"
+"    float height = texelFetch(state, cell, 0).x * (1.0 / 50.0);\n"
+"    vertex_color = color;\n"
+"    gl_Position = mvp * vec4(position, height, 1.0);\n"
+"}\n";
+
+struct {
+    GLuint   program;        // Zero if the GPU simulation is not used
+    GLuint   step_program;
+    GLint    mvp_location;
+    GLint    time_step_location;
+    GLuint   vertex_array;
+    GLuint   empty_array;    // For the steps, which have no vertex data
+    GLuint   textures[2];
+    GLuint   framebuffers[2];
+    int      current;        // Texture holding the current state
+    GLsizei  index_count;
+    GLenum   index_type;
+    GLuint   queries[GPU_TIMER_QUERIES];  // Time taken by the steps of a frame
+    int      query_steps[GPU_TIMER_QUERIES];
+    int      oldest_query;   // Oldest query whose result is still pending
+    int      pending_queries;
+    int      timing;         // Whether the steps of this frame are being timed
+} gpu;
+
+static int load_gpu_functions(void)
+{
+    if (!load_shader_functions())
+        return GL_FALSE;
+
+    LOAD_GL_FUNCTION(PFNGLBUFFERDATAPROC, glBufferData);
+    LOAD_GL_FUNCTION(PFNGLUNIFORM1FPROC, glUniform1f);
+    LOAD_GL_FUNCTION(PFNGLGENFRAMEBUFFERSPROC, glGenFramebuffers);
+    LOAD_GL_FUNCTION(PFNGLBINDFRAMEBUFFERPROC, glBindFramebuffer);
+    LOAD_GL_FUNCTION(PFNGLFRAMEBUFFERTEXTURE2DPROC, glFramebufferTexture2D);
+    LOAD_GL_FUNCTION(PFNGLCHECKFRAMEBUFFERSTATUSPROC, glCheckFramebufferStatus);
+    LOAD_GL_FUNCTION(PFNGLGENQUERIESPROC, glGenQueries);
+    LOAD_GL_FUNCTION(PFNGLBEGINQUERYPROC, glBeginQuery);
+    LOAD_GL_FUNCTION(PFNGLENDQUERYPROC, glEndQuery);
+    LOAD_GL_FUNCTION(PFNGLGETQUERYOBJECTIVPROC, glGetQueryObjectiv);
+    LOAD_GL_FUNCTION(PFNGLGETQUERYOBJECTUI64VPROC, glGetQueryObjectui64v);
+    return GL_TRUE;
+}
+
+static GLuint make_program(const char* vertex_text, const char* fragment_text)
+{
+    GLuint vertex_shader, fragment_shader;
+
+    vertex_shader = compile_shader(GL_VERTEX_SHADER, vertex_text);
+    fragment_shader = compile_shader(GL_FRAGMENT_SHADER, fragment_text);
+    if (!vertex_shader || !fragment_shader)
+        return 0;
+
+    return link_program(vertex_shader, fragment_shader);
+}
+
+// Set up the GPU simulation from the current state of the CPU grid, leaving
+// gpu.program at zero if the context does not support it
+void init_gpu_simulation(GLFWwindow* window)
+{
+    const int major = glfwGetWindowAttrib(window, GLFW_CONTEXT_VERSION_MAJOR);
+    const int minor = glfwGetWindowAttrib(window, GLFW_CONTEXT_VERSION_MINOR);
+    GLuint program, step_program, buffers[2];
+    GLint max_size;
+    GLfloat* pressure;
+    GLvoid* indices;
+    int i, x, y;
+
+    if (major < 3 || (major == 3 && minor < 3))
+        return;
+
+    if (!load_gpu_functions())
+        return;
+
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+    if (grid_width > max_size || grid_height > max_size)
+        return;
+
+    program = make_program(gpu_grid_vertex_shader_text, grid_fragment_shader_text);
+    step_program = make_program(step_vertex_shader_text, step_fragment_shader_text);
+    if (!program || !step_program)
+        return;
+
+    // Only the pressure is uploaded, the velocities start out as zero
+    pressure = malloc(sizeof(GLfloat) * grid_width * grid_height);
+    if (!pressure)
+        return;
+
+    for (y = 0;  y < grid_height;  y++)
+    {
+        for (x = 0;  x < grid_width;  x++)
+            pressure[y * grid_width + x] = (GLfloat) p[(size_t) y * grid_stride + x];
+    }
+
+    glGenTextures(2, gpu.textures);
+    glGenFramebuffers(2, gpu.framebuffers);
+
+    for (i = 0;  i < 2;  i++)
+    {
+        glBindTexture(GL_TEXTURE_2D, gpu.textures[i]);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, grid_width, grid_height, 0,
+                     GL_RED, GL_FLOAT, pressure);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, gpu.framebuffers[i]);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                               GL_TEXTURE_2D, gpu.textures[i], 0);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            break;
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    free(pressure);
+
+    if (i < 2 || glGetError() != GL_NO_ERROR)
+        return;
+
+    indices = make_strips(GL_TRUE, &gpu.index_count, &gpu.index_type);
+    if (!indices)
+        return;
+
+    glGenVertexArrays(1, &gpu.empty_array);
+    glGenVertexArrays(1, &gpu.vertex_array);
+    glBindVertexArray(gpu.vertex_array);
+
+    glGenBuffers(2, buffers);
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers[0]);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+                 (gpu.index_type == GL_UNSIGNED_SHORT ? 2 : 4) *
+                 (GLsizeiptr) gpu.index_count,
+                 indices, GL_STATIC_DRAW);
+    free(indices);
+
+    glBindBuffer(GL_ARRAY_BUFFER, buffers[1]);
+    glBufferData(GL_ARRAY_BUFFER,
+                 sizeof(struct Vertex) * (GLsizeiptr) grid_width * grid_height,
+                 vertex, GL_STATIC_DRAW);
+
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(struct Vertex),
+                          (void*) offsetof(struct Vertex, x));
+
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(struct Vertex),
+                          (void*) offsetof(struct Vertex, r));
+
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    // Only this renderer draws elements, so the restart index is left on
+    glEnable(GL_PRIMITIVE_RESTART);
+    glPrimitiveRestartIndex(gpu.index_type == GL_UNSIGNED_SHORT ?
+                            0xffff : 0xffffffff);
+
+    glGenQueries(GPU_TIMER_QUERIES, gpu.queries);
+
+    gpu.mvp_location = glGetUniformLocation(program, "mvp");
+    gpu.time_step_location = glGetUniformLocation(step_program, "time_step");
+    gpu.step_program = step_program;
+    gpu.program = program;
+}
+
+// Run one step of the simulation, from the current state texture into the
+// other one
+void step_gpu(GLfloat time_step)
+{
+    GLint viewport[4];
+
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    glViewport(0, 0, grid_width, grid_height);
+
+    glUseProgram(gpu.step_program);
+    glUniform1f(gpu.time_step_location, time_step);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, gpu.framebuffers[!gpu.current]);
+    glBindTexture(GL_TEXTURE_2D, gpu.textures[gpu.current]);
+    glBindVertexArray(gpu.empty_array);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+
+    glBindVertexArray(0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glUseProgram(0);
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+
+    gpu.current = !gpu.current;
+}
+
+// Start timing the steps of a frame on the GPU, after folding the frames
+// whose timings have arrived into the cost of a step. The results arrive a
+// few frames late, but without stalling the pipeline.
+static void begin_gpu_timing(void)
+{
+    while (gpu.pending_queries > 0)
+    {
+        const int query = gpu.oldest_query;
+        GLint available;
+        GLuint64 elapsed;
+
+        glGetQueryObjectiv(gpu.queries[query], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+            break;
+
+        glGetQueryObjectui64v(gpu.queries[query], GL_QUERY_RESULT, &elapsed);
+        scheduler.step_cost += ((double) elapsed * 1e-9 / gpu.query_steps[query] -
+                                scheduler.step_cost) * 0.1;
+
+        gpu.oldest_query = (query + 1) % GPU_TIMER_QUERIES;
+        gpu.pending_queries--;
+    }
+
+    // If all queries are still pending, this frame goes untimed
+    gpu.timing = gpu.pending_queries < GPU_TIMER_QUERIES;
+    if (gpu.timing)
+    {
+        const int query = (gpu.oldest_query + gpu.pending_queries) % GPU_TIMER_QUERIES;
+        glBeginQuery(GL_TIME_ELAPSED, gpu.queries[query]);
+    }
+}
+
+static void end_gpu_timing(int steps)
+{
+    if (!gpu.timing)
+        return;
+
+    glEndQuery(GL_TIME_ELAPSED);
+
+    // A frame without steps is not counted and its query is reused
+    if (steps > 0)
+    {
+        const int query = (gpu.oldest_query + gpu.pending_queries) % GPU_TIMER_QUERIES;
+        gpu.query_steps[query] = steps;
+        gpu.pending_queries++;
     }
+
+    gpu.timing = GL_FALSE;
+}
+
+// Draw the grid with the heights of the current state
+void draw_gpu(mat4x4 mvp)
+{
+    glUseProgram(gpu.program);
+    glUniformMatrix4fv(gpu.mvp_location, 1, GL_FALSE, (const GLfloat*) mvp);
+
+    glBindTexture(GL_TEXTURE_2D, gpu.textures[gpu.current]);
+    glBindVertexArray(gpu.vertex_array);
+    glDrawElements(GL_TRIANGLE_STRIP, gpu.index_count, gpu.index_type, NULL);
+
+    glBindVertexArray(0);
+    glUseProgram(0);
+}
+
+// Read back the pressure of the current state, for comparisons with the CPU
+void read_gpu_pressure(GLfloat* pressure)
+{
+    glBindTexture(GL_TEXTURE_2D, gpu.textures[gpu.current]);
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RED, GL_FLOAT, pressure);
 }
 
 
@@ -146,9 +905,27 @@ void init_grid(void)
 
 void draw_scene(GLFWwindow* window)
 {
+    mat4x4 modelview, mvp;
+
     // Clear the color and depth buffers
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
+    if (stream.program || gpu.program)
+    {
+        mat4x4_translate(modelview, 0.f, 0.f, -zoom);
+        mat4x4_rotate_X(modelview, modelview, beta * (float) M_PI / 180.f);
+        mat4x4_rotate_Z(modelview, modelview, alpha * (float) M_PI / 180.f);
+        mat4x4_mul(mvp, projection, modelview);
+
+        if (gpu.program)
+            draw_gpu(mvp);
+        else
+            draw_stream(mvp);
+
+        glfwSwapBuffers(window);
+        return;
+    }
+
     // We don't want to modify the projection matrix
     glMatrixMode(GL_MODELVIEW);
     glLoadIdentity();
@@ -159,7 +936,7 @@ void draw_scene(GLFWwindow* window)
     glRotatef(beta, 1.0, 0.0, 0.0);
     glRotatef(alpha, 0.0, 0.0, 1.0);
 
-    glDrawElements(GL_QUADS, 4 * QUADNUM, GL_UNSIGNED_INT, quad);
+    glDrawElements(GL_TRIANGLE_STRIP, strip_count, strip_type, strips);
 
     glfwSwapBuffers(window);
 }
@@ -177,10 +954,15 @@ void init_opengl(void)
     // Switch on the z-buffer
     glEnable(GL_DEPTH_TEST);
 
-    glEnableClientState(GL_VERTEX_ARRAY);
-    glEnableClientState(GL_COLOR_ARRAY);
-    glVertexPointer(3, GL_FLOAT, sizeof(struct Vertex), vertex);
-    glColorPointer(3, GL_FLOAT, sizeof(struct Vertex), &vertex[0].r); // Pointer to the first color
+    // The streaming renderer and the GPU simulation have their own vertex
+    // arrays
+    if (!stream.program && !gpu.program)
+    {
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glEnableClientState(GL_COLOR_ARRAY);
+        glVertexPointer(3, GL_FLOAT, sizeof(struct Vertex), vertex);
+        glColorPointer(3, GL_FLOAT, sizeof(struct Vertex), &vertex[0].r); // Pointer to the first color
+    }
 
     glPointSize(2.0);
 
@@ -197,15 +979,247 @@ void adjust_grid(void)
 {
     int pos;
     int x, y;
+    const Real* row;
+    GLfloat* z = &vertex[0].z;
+    int stride = sizeof(struct Vertex) / sizeof(GLfloat);
+
+    // The GPU simulation draws its own state
+    if (gpu.program)
+        return;
+
+    // The streaming renderer takes the heights as they are
+    if (stream.program)
+    {
+        z = begin_height_frame();
+        stride = 1;
+    }
 
-    for (y = 0; y < GRIDH;  y++)
+    for (y = 0; y < grid_height;  y++)
     {
-        for (x = 0;  x < GRIDW;  x++)
+        row = p + (size_t) y * grid_stride;
+
+        for (x = 0;  x < grid_width;  x++)
+        {
+            pos = y * grid_width + x;
+            z[pos * stride] = (GLfloat) (row[x] * (1.0 / 50.0));
+        }
+    }
+}
+
+
+//========================================================================
+// Calculate the new velocities of the cells [x0, x1) of row y
+//========================================================================
+
+static void calc_speeds(int y, int x0, int x1, Real time_step)
+{
+    const Real* p_row = p + (size_t) y * grid_stride;
+    const Real* p_above = p_row + grid_stride;
+    Real* vx_row = vx + (size_t) y * grid_stride;
+    Real* vy_row = vy + (size_t) y * grid_stride;
+    int x;
+
+    for (x = x0;  x < x1;  x++)
+    {
+        vx_row[x] = vx_row[x] + (p_row[x] - p_row[x + 1]) * time_step;
+        vy_row[x] = vy_row[x] + (p_row[x] - p_above[x]) * time_step;
+    }
+}
+
+
+//========================================================================
+// Calculate the new pressures of the cells [x0, x1) of row y from the new
+// velocities. Row and column 0 keep their pressure.
+//========================================================================
+
+static void calc_pressure(int y, int x0, int x1, Real time_step)
+{
+    Real* p_row = p + (size_t) y * grid_stride;
+    const Real* vx_row = vx + (size_t) y * grid_stride;
+    const Real* vy_row = vy + (size_t) y * grid_stride;
+    const Real* vy_below = vy_row - grid_stride;
+    int x;
+
+    if (y == 0)
+        return;
+
+    if (x0 == 0)
+        x0 = 1;
+
+    for (x = x0;  x < x1;  x++)
+        p_row[x] = p_row[x] + (vx_row[x - 1] - vx_row[x] + vy_below[x] - vy_row[x]) * time_step;
+}
+
+
+//========================================================================
+// Calculate wave propagation in the rows [y0, y1), except for the pressure
+// of row y0. This is a single sweep, tile by tile and row by row, where the
+// new velocities of a row are computed before its pressures. That gives the
+// same results as updating all the velocities and then all the pressures,
+// as the pressures depend on the new velocities to the left and below and
+// the velocities on the old pressures to the right and above.
+//========================================================================
+
+static void calc_band(int y0, int y1, Real time_step)
+{
+    int x0, x1, y;
+
+    for (x0 = 0;  x0 < grid_width;  x0 += TILE_WIDTH)
+    {
+        x1 = x0 + TILE_WIDTH;
+        if (x1 > grid_width)
+            x1 = grid_width;
+
+        for (y = y0;  y < y1;  y++)
+        {
+            calc_speeds(y, x0, x1, time_step);
+
+            if (y > y0)
+                calc_pressure(y, x0, x1, time_step);
+        }
+    }
+}
+
+
+//========================================================================
+// Barrier for the simulation threads. The last thread to arrive opens it by
+// bumping the generation. The others spin for a while, as the barriers
+// between the phases of a step only take a moment, and then sleep, as the
+// one at the start of a step waits for the next frame.
+//========================================================================
+
+#define BARRIER_SPIN_COUNT 10000
+
+static void init_barrier(Barrier* barrier, int count)
+{
+    mtx_init(&barrier->lock, mtx_plain);
+    cnd_init(&barrier->opened);
+    barrier->count = count;
+    barrier->arrived = 0;
+    barrier->generation = 0;
+    barrier->sleepers = 0;
+}
+
+static void barrier_wait(Barrier* barrier)
+{
+    const int generation = atomic_load_int(&barrier->generation);
+    int i;
+
+    if (atomic_add_int(&barrier->arrived, 1) == barrier->count - 1)
+    {
+        atomic_store_int(&barrier->arrived, 0);
+        atomic_add_int(&barrier->generation, 1);
+
+        // Either the sleeper is counted here or it sees the new generation
+        if (atomic_load_int(&barrier->sleepers) > 0)
+        {
+            mtx_lock(&barrier->lock);
+            cnd_broadcast(&barrier->opened);
+            mtx_unlock(&barrier->lock);
+        }
+
+        return;
+    }
+
+    for (i = 0;  i < BARRIER_SPIN_COUNT;  i++)
+    {
+        if (atomic_load_int(&barrier->generation) != generation)
+            return;
+    }
+
+    mtx_lock(&barrier->lock);
+    atomic_add_int(&barrier->sleepers, 1);
+
+    while (atomic_load_int(&barrier->generation) == generation)
+        cnd_wait(&barrier->opened, &barrier->lock);
+
+    atomic_add_int(&barrier->sleepers, -1);
+    mtx_unlock(&barrier->lock);
+}
+
+
+//========================================================================
+// Simulation threads. The grid is split into one band of rows per thread,
+// including the main thread. Each step is run in two phases separated by a
+// barrier. The first sweeps each band, except for the pressure of its first
+// row, as the velocities of the last row of the band below still need the
+// old pressures. The second updates those first rows. Neighbouring bands
+// read each other's boundary rows directly from the shared grid.
+//========================================================================
+
+// Run one step of the specified band
+static void run_band(int band)
+{
+    const Real time_step = simulation.time_step;
+    const int y0 = grid_height * band / simulation.count;
+    const int y1 = grid_height * (band + 1) / simulation.count;
+
+    calc_band(y0, y1, time_step);
+    barrier_wait(&simulation.barrier);
+
+    calc_pressure(y0, 0, grid_width, time_step);
+    barrier_wait(&simulation.barrier);
+}
+
+static int simulation_thread_main(void* arg)
+{
+    const int band = (int) (intptr_t) arg;
+
+    for (;;)
+    {
+        // Wait for the next step
+        barrier_wait(&simulation.barrier);
+
+        if (simulation.quit)
+            break;
+
+        run_band(band);
+    }
+
+    return 0;
+}
+
+int init_simulation_threads(int count)
+{
+    int i;
+
+    // Every band needs at least one row
+    if (count > grid_height)
+        count = grid_height;
+
+    simulation.count = count;
+    init_barrier(&simulation.barrier, count);
+
+    simulation.threads = calloc(count, sizeof(thrd_t));
+    if (!simulation.threads)
+        return GL_FALSE;
+
+    for (i = 1;  i < count;  i++)
+    {
+        if (thrd_create(&simulation.threads[i], simulation_thread_main,
+                        (void*) (intptr_t) i) != thrd_success)
         {
-            pos = y * GRIDW + x;
-            vertex[pos].z = (float) (p[x][y] * (1.0 / 50.0));
+            return GL_FALSE;
         }
     }
+
+    return GL_TRUE;
+}
+
+void terminate_simulation_threads(void)
+{
+    int i;
+
+    if (simulation.count > 1)
+    {
+        simulation.quit = GL_TRUE;
+        barrier_wait(&simulation.barrier);
+
+        for (i = 1;  i < simulation.count;  i++)
+            thrd_join(simulation.threads[i], NULL);
+    }
+
+    free(simulation.threads);
 }
 
 
@@ -215,44 +1229,187 @@ void adjust_grid(void)
 
 void calc_grid(void)
 {
-    int x, y, x2, y2;
-    double time_step = dt * ANIMATION_SPEED;
+    simulation.time_step = (Real) (dt * ANIMATION_SPEED);
 
-    // Compute accelerations
-    for (x = 0;  x < GRIDW;  x++)
+    if (gpu.program)
     {
-        x2 = (x + 1) % GRIDW;
-        for(y = 0; y < GRIDH; y++)
-            ax[x][y] = p[x][y] - p[x2][y];
+        step_gpu((GLfloat) simulation.time_step);
+        return;
     }
 
-    for (y = 0;  y < GRIDH;  y++)
+    if (simulation.count == 1)
     {
-        y2 = (y + 1) % GRIDH;
-        for(x = 0; x < GRIDW; x++)
-            ay[x][y] = p[x][y] - p[x][y2];
+        calc_band(0, grid_height, simulation.time_step);
+        return;
     }
 
-    // Compute speeds
-    for (x = 0;  x < GRIDW;  x++)
+    // Start the step on all threads and do the first band here
+    barrier_wait(&simulation.barrier);
+    run_band(0);
+}
+
+
+//========================================================================
+// Advance the simulation by the time since the last frame, within the time
+// budget for a frame. The substeps that do not fit are dropped, so a slow
+// frame makes the simulation run slower than real time instead of making
+// the next frame even slower. At least one substep is always run.
+//
+// The GPU runs the substeps long after they are submitted, so there the
+// cost of a substep is measured with timer queries and the budget is spent
+// on the estimated GPU time rather than on the time taken to submit them.
+//========================================================================
+
+void run_simulation(double dt_total)
+{
+    const double start = glfwGetTime();
+    double now = start, elapsed, used;
+    int steps = 0;
+
+    if (gpu.program)
+        begin_gpu_timing();
+
+    while (dt_total > 0.0)
+    {
+        used = gpu.program ? steps * scheduler.step_cost : now - start;
+
+        // Would the next substep go over the budget?
+        if (steps > 0 && used + scheduler.step_cost > scheduler.budget)
+        {
+            scheduler.dropped += dt_total;
+            break;
+        }
+
+        // Select iteration time step
+        dt = dt_total > MAX_DELTA_T ? MAX_DELTA_T : dt_total;
+        dt_total -= dt;
+
+        // Calculate wave propagation
+        calc_grid();
+        scheduler.simulated += dt;
+        steps++;
+
+        // Keep a running average of the cost of a substep
+        elapsed = glfwGetTime() - now;
+        now += elapsed;
+        if (!gpu.program)
+            scheduler.step_cost += (elapsed - scheduler.step_cost) * 0.1;
+    }
+
+    if (gpu.program)
+        end_gpu_timing(steps);
+
+    // Report every few seconds while the simulation is slowed down
+    if (now - scheduler.report_time >= REPORT_INTERVAL)
     {
-        for (y = 0;  y < GRIDH;  y++)
+        if (scheduler.dropped > 0.0)
         {
-            vx[x][y] = vx[x][y] + ax[x][y] * time_step;
-            vy[x][y] = vy[x][y] + ay[x][y] * time_step;
+            printf("Simulation running at %.0f%% of real time, %.3f ms per step\n",
+                   100.0 * scheduler.simulated /
+                   (scheduler.simulated + scheduler.dropped),
+                   scheduler.step_cost * 1000.0);
         }
+
+        scheduler.simulated = scheduler.dropped = 0.0;
+        scheduler.report_time = now;
+    }
+}
+
+
+//========================================================================
+// Run the simulation without a window and report its throughput
+//========================================================================
+
+static void benchmark(int steps)
+{
+    double start, elapsed, sum = 0.0;
+    int i, y, x;
+
+    dt = MAX_DELTA_T;
+    start = get_time();
+
+    for (i = 0;  i < steps;  i++)
+        calc_grid();
+
+    elapsed = get_time() - start;
+
+    // Print a sum of the pressures, so changes to the solver can be checked
+    for (y = 0;  y < grid_height;  y++)
+    {
+        for (x = 0;  x < grid_width;  x++)
+            sum += p[(size_t) y * grid_stride + x];
     }
 
-    // Compute pressure
-    for (x = 1;  x < GRIDW;  x++)
+    printf("%ix%i grid, %i steps, %i threads, %s precision\n",
+           grid_width, grid_height, steps, simulation.count,
+           sizeof(Real) == sizeof(float) ? "single" : "double");
+    printf("%.3f s, %.1f steps/s, %.4g cells/s (%.4g per thread), "
+           "pressure sum %.17g\n",
+           elapsed, steps / elapsed,
+           (double) grid_width * grid_height * steps / elapsed,
+           (double) grid_width * grid_height * steps / elapsed / simulation.count,
+           sum);
+}
+
+
+//========================================================================
+// Run the simulation on the GPU and then on the CPU from the same initial
+// state, and report the throughput of both and how far apart they end up
+//========================================================================
+
+static void benchmark_gpu(int steps)
+{
+    const size_t count = (size_t) grid_width * grid_height;
+    double start, elapsed, diff, sum = 0.0, max_pressure = 0.0;
+    double max_diff = 0.0, square_diff = 0.0;
+    GLfloat* pressure;
+    int i, y, x;
+
+    pressure = malloc(sizeof(GLfloat) * count);
+    if (!pressure)
+        return;
+
+    dt = MAX_DELTA_T;
+    start = get_time();
+
+    for (i = 0;  i < steps;  i++)
+        calc_grid();
+
+    glFinish();
+    elapsed = get_time() - start;
+
+    read_gpu_pressure(pressure);
+
+    for (i = 0;  i < (int) count;  i++)
+        sum += pressure[i];
+
+    printf("%ix%i grid, %i steps on the GPU, single precision\n",
+           grid_width, grid_height, steps);
+    printf("%.3f s, %.1f steps/s, %.4g cells/s, pressure sum %.17g\n",
+           elapsed, steps / elapsed, (double) count * steps / elapsed, sum);
+
+    // Without the GPU program, calc_grid runs on the CPU again
+    gpu.program = 0;
+    benchmark(steps);
+
+    for (y = 0;  y < grid_height;  y++)
     {
-        x2 = x - 1;
-        for (y = 1;  y < GRIDH;  y++)
+        for (x = 0;  x < grid_width;  x++)
         {
-            y2 = y - 1;
-            p[x][y] = p[x][y] + (vx[x2][y] - vx[x][y] + vy[x][y2] - vy[x][y]) * time_step;
+            const double cpu = p[(size_t) y * grid_stride + x];
+
+            diff = fabs(pressure[y * grid_width + x] - cpu);
+            max_diff = diff > max_diff ? diff : max_diff;
+            max_pressure = fabs(cpu) > max_pressure ? fabs(cpu) : max_pressure;
+            square_diff += diff * diff;
         }
     }
+
+    printf("GPU vs CPU pressure: max difference %.3g, RMS difference %.3g, "
+           "max |p| %.3g\n",
+           max_diff, sqrt(square_diff / count), max_pressure);
+
+    free(pressure);
 }
 
 
@@ -364,7 +1521,6 @@ void scroll_callback(GLFWwindow* window, double x, double y)
 void framebuffer_size_callback(GLFWwindow* window, int width, int height)
 {
     float ratio = 1.f;
-    mat4x4 projection;
 
     if (height > 0)
         ratio = (float) width / (float) height;
@@ -390,13 +1546,91 @@ int main(int argc, char* argv[])
 {
     GLFWwindow* window;
     double t, dt_total, t_old;
-    int width, height;
+    int ch, count, width, height, steps = 0;
+    int threads = get_processor_count(), legacy = GL_FALSE, use_gpu = GL_FALSE;
+
+    scheduler.budget = DEFAULT_BUDGET / 1000.0;
+
+    while ((ch = getopt(argc, argv, "b:ghj:ls:t:")) != -1)
+    {
+        switch (ch)
+        {
+            case 'b':
+                steps = atoi(optarg);
+                break;
+            case 'g':
+                use_gpu = GL_TRUE;
+                break;
+            case 'h':
+                usage();
+                exit(EXIT_SUCCESS);
+            case 'j':
+                threads = atoi(optarg);
+                if (threads < 1)
+                {
+                    usage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'l':
+                legacy = GL_TRUE;
+                break;
+            case 's':
+                count = sscanf(optarg, "%dx%d", &grid_width, &grid_height);
+                if (count == 1)
+                    grid_height = grid_width;
+                if (count < 1 || grid_width < 2 || grid_width > MAX_GRID_SIZE ||
+                    grid_height < 2 || grid_height > MAX_GRID_SIZE)
+                {
+                    usage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 't':
+                scheduler.budget = atof(optarg) / 1000.0;
+                if (scheduler.budget <= 0.0)
+                {
+                    usage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (!alloc_grid())
+    {
+        fprintf(stderr, "Failed to allocate the %ix%i grid\n",
+                grid_width, grid_height);
+        exit(EXIT_FAILURE);
+    }
+
+    init_grid();
+
+    if (!init_simulation_threads(threads))
+    {
+        fprintf(stderr, "Failed to create simulation threads\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (steps > 0 && !use_gpu)
+    {
+        benchmark(steps);
+        terminate_simulation_threads();
+        exit(EXIT_SUCCESS);
+    }
 
     glfwSetErrorCallback(error_callback);
 
     if (!glfwInit())
         exit(EXIT_FAILURE);
 
+    // The GPU benchmark only needs the context
+    if (steps > 0)
+        glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
+
     window = glfwCreateWindow(640, 480, "Wave Simulation", NULL, NULL);
     if (!window)
     {
@@ -416,14 +1650,55 @@ int main(int argc, char* argv[])
     glfwGetFramebufferSize(window, &width, &height);
     framebuffer_size_callback(window, width, height);
 
-    // Initialize OpenGL
-    init_opengl();
-
     // Initialize simulation
-    init_vertices();
-    init_grid();
+    if (!init_vertices())
+    {
+        fprintf(stderr, "Failed to allocate the grid geometry\n");
+        glfwTerminate();
+        exit(EXIT_FAILURE);
+    }
+
+    if (use_gpu)
+    {
+        init_gpu_simulation(window);
+        if (!gpu.program)
+            fprintf(stderr, "The GPU simulation is not supported, using the CPU\n");
+    }
+
+    if (steps > 0)
+    {
+        if (!gpu.program)
+        {
+            terminate_simulation_threads();
+            glfwTerminate();
+            exit(EXIT_FAILURE);
+        }
+
+        benchmark_gpu(steps);
+        terminate_simulation_threads();
+        glfwTerminate();
+        exit(EXIT_SUCCESS);
+    }
+
+    if (!legacy && !gpu.program)
+        init_stream_renderer(window);
+
+    if (!stream.program && !gpu.program)
+    {
+        strips = make_strips(GL_FALSE, &strip_count, &strip_type);
+        if (!strips)
+        {
+            fprintf(stderr, "Failed to allocate the grid geometry\n");
+            glfwTerminate();
+            exit(EXIT_FAILURE);
+        }
+    }
+
     adjust_grid();
 
+    // Initialize OpenGL
+    init_opengl();
+
     // Initialize timer
     t_old = glfwGetTime() - 0.01;
 
@@ -433,16 +1708,8 @@ int main(int argc, char* argv[])
         dt_total = t - t_old;
         t_old = t;
 
-        // Safety - iterate if dt_total is too large
-        while (dt_total > 0.f)
-        {
-            // Select iteration time step
-            dt = dt_total > MAX_DELTA_T ? MAX_DELTA_T : dt_total;
-            dt_total -= dt;
-
-            // Calculate wave propagation
-            calc_grid();
-        }
+        // Iterate if dt_total is too large, within the budget
+        run_simulation(dt_total);
 
         // Compute height of each vertex
         adjust_grid();
@@ -453,6 +1720,8 @@ int main(int argc, char* argv[])
         glfwPollEvents();
     }
 
+    terminate_simulation_threads();
+
     exit(EXIT_SUCCESS);
 }
 